@@ -0,0 +1,143 @@
+/*
+	bench.cpp - lib605 I/O backend benchmark
+
+	Runs MSR_COM_TEST round trips against emulated readers on
+	pseudo terminals, one thread per reader, with the classic and the
+	io_uring backend, and reports throughput and the CPU time the
+	reader threads spent per command.
+
+	Usage: lib605-bench [-d devices] [-n commands]
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "lib605.hpp"
+#include "lib605_uring.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+using namespace lib605;
+
+// Answers MSR_COM_TEST until the reader side is closed
+static void Emulate(int master) {
+	unsigned char buffer[64];
+	bool escape = false;
+	while(true) {
+		int count = read(master, buffer, sizeof(buffer));
+		if(count <= 0) break;
+		for(int i = 0; i < count; i++) {
+			if(escape && buffer[i] == 'e') {
+				static const unsigned char ok[2] = { 0x1B, 'y' };
+				if(write(master, ok, sizeof(ok)) != (ssize_t)sizeof(ok)) return;
+			}
+			escape = (buffer[i] == 0x1B);
+		}
+	}
+}
+
+static double ThreadCpuSeconds(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static bool Run(MSR::IO_BACKEND Backend, int Devices, int Commands) {
+	std::vector<int> masters;
+	std::vector<std::thread> emulators;
+	std::vector<std::unique_ptr<MSR>> readers;
+	bool ok = true;
+	for(int i = 0; i < Devices && ok; i++) {
+		int master, slave;
+		char name[64];
+		if(openpty(&master, &slave, name, NULL, NULL) != 0) {
+			perror("openpty");
+			ok = false;
+			break;
+		}
+		masters.push_back(master);
+		emulators.push_back(std::thread(Emulate, master));
+		readers.push_back(std::unique_ptr<MSR>(new MSR(name, Backend)));
+		if(!readers.back()->Connect()) ok = false;
+		// Held until the reader has it open, the master reads EOF while no one does
+		close(slave);
+		readers.back()->SetTimeout(std::chrono::milliseconds(1000));
+	}
+
+	// Held so the counters outlive the readers
+	std::shared_ptr<UringEngine> engine;
+	UringStats before;
+	if(ok && readers[0]->GetIOBackend() == MSR::IO_URING) {
+		engine = UringEngine::Shared();
+		before = engine->GetStats();
+	}
+
+	if(ok) {
+		std::atomic<int> failures(0);
+		std::vector<double> cpu(Devices);
+		std::vector<std::thread> workers;
+		auto start = std::chrono::steady_clock::now();
+		for(int i = 0; i < Devices; i++) {
+			workers.push_back(std::thread([&, i] {
+				double begin = ThreadCpuSeconds();
+				for(int n = 0; n < Commands; n++)
+					if(!readers[i]->TestCommunication()) failures++;
+				cpu[i] = ThreadCpuSeconds() - begin;
+			}));
+		}
+		for(std::thread& worker : workers) worker.join();
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		double total_cpu = 0;
+		for(double seconds : cpu) total_cpu += seconds;
+		int total = Devices * Commands;
+		printf("%-8s %3d devices %8d commands %10.0f cmd/s %8.2f us cpu/cmd %d failed",
+			engine ? "io_uring" : "classic", Devices, total, total / elapsed, total_cpu * 1e6 / total, failures.load());
+		if(engine) printf(", %.2f io_uring_enter/cmd", (double)(engine->GetStats().Syscalls - before.Syscalls) / total);
+		printf("\n");
+		ok = (failures == 0);
+	}
+
+	for(std::unique_ptr<MSR>& reader : readers) reader->Disconnect();
+	readers.clear();
+	for(std::thread& emulator : emulators) emulator.join();
+	for(int master : masters) close(master);
+	return ok;
+}
+
+auto main(int argc, char** argv) -> int {
+	int devices = 4;
+	int commands = 20000;
+	int opt;
+	while((opt = getopt(argc, argv, "d:n:")) != -1) {
+		switch(opt) {
+			case 'd': devices = atoi(optarg); break;
+			case 'n': commands = atoi(optarg); break;
+			default:
+				std::cerr << "Usage: " << argv[0] << " [-d devices] [-n commands]" << std::endl;
+				return 1;
+		}
+	}
+	if(devices <= 0 || commands <= 0) return 1;
+
+	if(!UringEngine::Shared()) std::cout << "io_uring is unavailable, both runs use the classic backend" << std::endl;
+	bool ok = Run(MSR::IO_CLASSIC, devices, commands);
+	ok = Run(MSR::IO_URING, devices, commands) && ok;
+	return ok ? 0 : 1;
+}
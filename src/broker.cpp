@@ -0,0 +1,444 @@
+/*
+	broker.cpp - lib605 device broker
+
+	Owns one or more readers, accepts commands from clients on a Unix
+	domain socket and publishes every swipe to a shared memory ring.
+
+	Usage: lib605-broker [-s socket] [-r ring] [-R] [-m mode] [-f iso|raw] [-d window_ms] [-c capture_dir] [device...]
+
+	-R replaces a ring of the same name left behind by a broker that
+	crashed, -m sets the octal mode of the ring and of the capture files,
+	600 by default.
+
+	Commands are single lines, answered with "OK [result]" or "ERR reason":
+		DEVICES							Lists the devices, their index is used below
+		RING							Name of the swipe ring
+		MODEL <dev>
+		FIRMWARE <dev>
+		LED <dev> green|yellow|red|all|off
+		COERCIVITY <dev> [hi|lo]		Gets or sets the coercivity
+		FORMAT <dev> iso|raw			Format swipes are read and published in
+		RESET <dev>
+		WRITE <dev> <tk1> <tk2> <tk3>	Writes ISO data on the next swipe, - leaves a track out
+		ERASE <dev> <tracks>			Erases e.g. 1, 23 or 123 on the next swipe
+		QUIT
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "lib605.hpp"
+#include "lib605_broker.hpp"
+#include "lib605_capture.hpp"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace lib605;
+
+// Ring writes from the device threads are serialized here
+static SwipeRingWriter Ring;
+static std::mutex RingLock;
+// Every published swipe is also kept here when a capture directory is given,
+// the store serializes appends itself
+static CaptureStore Captures;
+static bool Capturing = false;
+// Cancelled by SIGINT/SIGTERM, writing to an eventfd is async signal safe
+static CancelToken* Shutdown = NULL;
+
+// A command run on the device thread in between swipes, the token is
+// cancelled when the broker shuts down
+struct Job {
+	std::function<std::string(MSR&, CancelToken*)> Run;
+	std::promise<std::string> Reply;
+};
+
+// A device and the thread that owns it
+class Station {
+	private:
+		std::string Path;
+		uint32_t Index;
+		MSR Device;
+		// Interrupts the pending read so jobs can run
+		CancelToken Wakeup;
+		// Interrupts jobs waiting on a swipe at shutdown
+		CancelToken Halt;
+		std::mutex Lock;
+		std::deque<std::shared_ptr<Job> > Jobs;
+		Magstripe::CARD_DATA_FORMAT Format;
+		bool Stopping;
+		std::thread Worker;
+
+		void Loop(void) {
+			bool initialized = false;
+			while(true) {
+				// Reset first so a Submit racing with us re-cancels the next read
+				this->Wakeup.Reset();
+				std::deque<std::shared_ptr<Job> > jobs;
+				Magstripe::CARD_DATA_FORMAT format;
+				bool stopping;
+				{
+					std::lock_guard<std::mutex> guard(this->Lock);
+					jobs.swap(this->Jobs);
+					format = this->Format;
+					stopping = this->Stopping;
+				}
+				for(auto& job : jobs) {
+					if(!this->Device.IsConnected())
+						job->Reply.set_value("ERR device not connected");
+					else
+						job->Reply.set_value(job->Run(this->Device, &this->Halt));
+				}
+				if(stopping) break;
+
+				if(!this->Device.IsConnected()) {
+					bool ok = initialized ? this->Device.Reconnect()
+						: (this->Device.Connect() && this->Device.Initialize());
+					if(!ok) {
+						if(this->Device.IsConnected()) this->Device.Disconnect();
+						// Retry later, jobs and shutdown still wake us
+						struct pollfd pfd;
+						pfd.fd = this->Wakeup.GetFd();
+						pfd.events = POLLIN;
+						pfd.revents = 0;
+						poll(&pfd, 1, 1000);
+						continue;
+					}
+					if(!initialized) std::cout << "[*] Device " << this->Index << " '" << this->Path << "' ready" << std::endl;
+					initialized = true;
+				}
+
+				Magstripe card = this->Device.ReadCard(format, &this->Wakeup);
+				// Interrupted for a job, or no card data block came back
+				if(this->Device.WasCancelled() || this->Device.GetLastStatus() == cmd::FAIL) continue;
+				{
+					std::lock_guard<std::mutex> guard(RingLock);
+					Ring.Publish(this->Index, card, this->Device.GetLastStatus());
+				}
+				// Outside RingLock, a segment being sealed must not hold up the other stations' swipes
+				if(Capturing && !Captures.Append(card, this->Index, this->Device.GetLastStatus()))
+					std::cerr << "[*] Error: unable to capture a swipe of device " << this->Index << std::endl;
+			}
+		}
+	public:
+		Station(std::string Path, uint32_t Index, Magstripe::CARD_DATA_FORMAT Format, int DedupMs) : Path(Path), Index(Index), Device(Path) {
+			this->Format = Format;
+			this->Stopping = false;
+			this->Device.SetAutoReconnect(true);
+			if(DedupMs > 0) this->Device.EnableDuplicateDetection(std::chrono::milliseconds(DedupMs));
+		}
+
+		void Start(void) {
+			this->Worker = std::thread(&Station::Loop, this);
+		}
+
+		void Stop(void) {
+			{
+				std::lock_guard<std::mutex> guard(this->Lock);
+				this->Stopping = true;
+			}
+			this->Wakeup.Cancel();
+			this->Halt.Cancel();
+			if(this->Worker.joinable()) this->Worker.join();
+		}
+
+		// Runs fn on the device thread, blocks until it is done
+		std::string Submit(std::function<std::string(MSR&, CancelToken*)> fn) {
+			std::shared_ptr<Job> job(new Job());
+			job->Run = fn;
+			std::future<std::string> reply = job->Reply.get_future();
+			{
+				std::lock_guard<std::mutex> guard(this->Lock);
+				if(this->Stopping) return "ERR shutting down";
+				this->Jobs.push_back(job);
+			}
+			this->Wakeup.Cancel();
+			return reply.get();
+		}
+
+		void SetFormat(Magstripe::CARD_DATA_FORMAT Format) {
+			std::lock_guard<std::mutex> guard(this->Lock);
+			this->Format = Format;
+		}
+
+		const std::string& GetPath(void) const {
+			return this->Path;
+		}
+};
+
+static std::vector<std::unique_ptr<Station> > Stations;
+static std::string RingName = BROKER_RING;
+
+static std::string Ok(bool ok) {
+	return ok ? "OK" : "ERR command failed";
+}
+
+static std::string Execute(const std::string& line) {
+	std::istringstream in(line);
+	std::string verb;
+	in >> verb;
+	if(verb == "DEVICES") {
+		std::ostringstream out;
+		out << "OK " << Stations.size();
+		for(auto& s : Stations) out << " " << s->GetPath();
+		return out.str();
+	}
+	if(verb == "RING") return "OK " + RingName;
+
+	size_t dev;
+	if(!(in >> dev)) return "ERR expected a device index";
+	if(dev >= Stations.size()) return "ERR no such device";
+	Station& station = *Stations[dev];
+	std::string arg;
+	in >> arg;
+
+	if(verb == "MODEL") {
+		return station.Submit([](MSR& m, CancelToken*) { return "OK " + m.GetModel(); });
+	} else if(verb == "FIRMWARE") {
+		return station.Submit([](MSR& m, CancelToken*) { return "OK " + m.GetFirmwareVersion(); });
+	} else if(verb == "RESET") {
+		return station.Submit([](MSR& m, CancelToken*) { m.SendReset(); return std::string("OK"); });
+	} else if(verb == "LED") {
+		static const char* names[] = { "green", "yellow", "red", "all", "off" };
+		for(int i = 0; i < 5; i++) {
+			if(arg != names[i]) continue;
+			MSR::MSR_LED led = (MSR::MSR_LED)i;
+			return station.Submit([led](MSR& m, CancelToken*) { m.SetLED(led); return std::string("OK"); });
+		}
+		return "ERR expected green, yellow, red, all or off";
+	} else if(verb == "COERCIVITY") {
+		if(arg.empty()) {
+			return station.Submit([](MSR& m, CancelToken*) {
+				MSR::COERCIVITY co = m.GetCoercivity();
+				if(co == MSR::ERR) return std::string("ERR command failed");
+				return std::string((co == MSR::HI_CO) ? "OK hi" : "OK lo");
+			});
+		}
+		if(arg != "hi" && arg != "lo") return "ERR expected hi or lo";
+		MSR::COERCIVITY co = (arg == "hi") ? MSR::HI_CO : MSR::LO_CO;
+		return station.Submit([co](MSR& m, CancelToken*) { return Ok(m.SetCoercivity(co)); });
+	} else if(verb == "FORMAT") {
+		if(arg != "iso" && arg != "raw") return "ERR expected iso or raw";
+		station.SetFormat((arg == "iso") ? Magstripe::ISO : Magstripe::RAW);
+		// Re-arm the pending read in the new format
+		return station.Submit([](MSR&, CancelToken*) { return std::string("OK"); });
+	} else if(verb == "WRITE") {
+		std::string tracks[3] = { arg, "", "" };
+		in >> tracks[1] >> tracks[2];
+		if(tracks[2].empty()) return "ERR expected three tracks";
+		Magstripe card(Magstripe::ISO);
+		const Track::TRACK_BIT_LEN bits[3] = { Track::TRACK_7_BIT, Track::TRACK_5_BIT, Track::TRACK_5_BIT };
+		for(int i = 0; i < 3; i++) {
+			if(tracks[i] == "-") tracks[i].clear();
+			const unsigned char* data = (const unsigned char*)tracks[i].data();
+			int len = (int)tracks[i].size();
+			if(i == 0) card.SetTrack1(data, len, bits[i]);
+			if(i == 1) card.SetTrack2(data, len, bits[i]);
+			if(i == 2) card.SetTrack3(data, len, bits[i]);
+		}
+		return station.Submit([card](MSR& m, CancelToken* halt) { return Ok(m.WriteCard(card, halt)); });
+	} else if(verb == "ERASE") {
+		static const char* names[] = { "1", "2", "3", "12", "13", "23", "123" };
+		for(int i = 0; i < 7; i++) {
+			if(arg != names[i]) continue;
+			MSR::TRACK track = (MSR::TRACK)i;
+			return station.Submit([track](MSR& m, CancelToken* halt) {
+				bool ok = m.EraseCard(track, halt);
+				if(!m.WasCancelled()) m.SendReset();
+				return Ok(ok);
+			});
+		}
+		return "ERR expected 1, 2, 3, 12, 13, 23 or 123";
+	}
+	return "ERR unknown command";
+}
+
+// Serves one client connection until it hangs up or sends QUIT
+class Client {
+	private:
+		int Fd;
+		std::atomic<bool> Done;
+		std::thread Worker;
+
+		void Loop(void) {
+			std::string pending;
+			char buf[512];
+			while(true) {
+				ssize_t count = read(this->Fd, buf, sizeof(buf));
+				if(count < 0 && errno == EINTR) continue;
+				if(count <= 0) break;
+				pending.append(buf, (size_t)count);
+				size_t eol;
+				bool quit = false;
+				while(!quit && (eol = pending.find('\n')) != std::string::npos) {
+					std::string line = pending.substr(0, eol);
+					pending.erase(0, eol + 1);
+					if(!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+					if(line.empty()) continue;
+					if(line == "QUIT") {
+						quit = true;
+						break;
+					}
+					std::string reply = Execute(line) + "\n";
+					if(send(this->Fd, reply.data(), reply.size(), MSG_NOSIGNAL) < 0) quit = true;
+				}
+				if(quit || pending.size() > 4096) break;
+			}
+			this->Done = true;
+		}
+	public:
+		Client(int Fd) : Fd(Fd), Done(false) {
+			this->Worker = std::thread(&Client::Loop, this);
+		}
+
+		~Client(void) {
+			// Unblocks the read, a command in progress still finishes
+			shutdown(this->Fd, SHUT_RDWR);
+			this->Worker.join();
+			close(this->Fd);
+		}
+
+		bool IsDone(void) const {
+			return this->Done;
+		}
+};
+
+static void OnSignal(int) {
+	if(Shutdown != NULL) Shutdown->Cancel();
+}
+
+static void Usage(const char* name) {
+	std::cerr << "Usage: " << name << " [-s socket] [-r ring] [-R] [-m mode] [-f iso|raw] [-d window_ms] [-c capture_dir] [device...]" << std::endl;
+}
+
+auto main(int argc, char** argv) -> int {
+	std::string socket_path = BROKER_SOCKET;
+	Magstripe::CARD_DATA_FORMAT format = Magstripe::ISO;
+	int dedup_ms = 0;
+	std::string capture_dir;
+	bool replace = false;
+	mode_t mode = 0600;
+	int opt;
+	while((opt = getopt(argc, argv, "s:r:Rm:f:d:c:h")) != -1) {
+		switch(opt) {
+			case 's': socket_path = optarg; break;
+			case 'r': RingName = optarg; break;
+			case 'R': replace = true; break;
+			case 'm': mode = (mode_t)strtoul(optarg, NULL, 8) & 0777; break;
+			case 'f':
+				if(strcmp(optarg, "iso") != 0 && strcmp(optarg, "raw") != 0) {
+					Usage(argv[0]);
+					return 1;
+				}
+				format = (strcmp(optarg, "iso") == 0) ? Magstripe::ISO : Magstripe::RAW;
+				break;
+			case 'd': dedup_ms = atoi(optarg); break;
+			case 'c': capture_dir = optarg; break;
+			default:
+				Usage(argv[0]);
+				return 1;
+		}
+	}
+	std::vector<std::string> devices(argv + optind, argv + argc);
+	if(devices.empty()) devices.push_back(DEFAULT_DEV);
+
+	CancelToken shutdown_token;
+	Shutdown = &shutdown_token;
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = OnSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if(!Ring.Create(RingName, replace, mode)) {
+		std::cerr << "[*] Error: unable to create ring '" << RingName << "': " << strerror(errno) << std::endl;
+		if(errno == EEXIST) std::cerr << "[*] Another broker may be using it, -R replaces it" << std::endl;
+		return 1;
+	}
+
+	if(!capture_dir.empty()) {
+		if(!Captures.Open(capture_dir, false, mode)) {
+			std::cerr << "[*] Error: unable to open capture store '" << capture_dir << "': " << strerror(errno) << std::endl;
+			return 1;
+		}
+		Capturing = true;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(socket_path.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "[*] Error: socket path too long" << std::endl;
+		return 1;
+	}
+	strcpy(addr.sun_path, socket_path.c_str());
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(socket_path.c_str());
+	if(listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+		std::cerr << "[*] Error: unable to listen on '" << socket_path << "': " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	for(size_t i = 0; i < devices.size(); i++) {
+		Stations.push_back(std::unique_ptr<Station>(new Station(devices[i], (uint32_t)i, format, dedup_ms)));
+		Stations.back()->Start();
+	}
+	std::cout << "[*] Listening on '" << socket_path << "', publishing to '" << RingName << "'" << std::endl;
+
+	std::vector<std::unique_ptr<Client> > clients;
+	while(true) {
+		struct pollfd pfd[2];
+		pfd[0].fd = listener;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = shutdown_token.GetFd();
+		pfd[1].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = 0;
+		if(poll(pfd, 2, -1) < 0 && errno != EINTR) break;
+		if(pfd[1].revents & POLLIN) break;
+		if((pfd[0].revents & POLLIN) == 0) continue;
+
+		int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if(fd < 0) continue;
+		// Reap finished clients as new ones come in
+		for(size_t i = 0; i < clients.size(); ) {
+			if(clients[i]->IsDone()) {
+				clients.erase(clients.begin() + i);
+			} else {
+				i++;
+			}
+		}
+		clients.push_back(std::unique_ptr<Client>(new Client(fd)));
+	}
+
+	std::cout << "[*] Shutting down" << std::endl;
+	close(listener);
+	unlink(socket_path.c_str());
+	// Stations first so clients waiting on a command get their answer
+	for(auto& s : Stations) s->Stop();
+	clients.clear();
+	Stations.clear();
+	Ring.Close();
+	Shutdown = NULL;
+	return 0;
+}
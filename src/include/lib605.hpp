@@ -11,107 +11,46 @@
 */
 
 #pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <ostream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <tuple>
+#include <vector>
+
+#include "lib605_cancel.hpp"
+#include "lib605_commands.hpp"
+#include "lib605_trace.hpp"
 
 // Allows one to redefine the default device at compile time
 #if !defined(DEFAULT_DEV)
 #define DEFAULT_DEV "/dev/ttyUSB0"
 #endif
 
-// Protocol defines
-
-// Control Code
-#define MSR_ESC 			"\x1B"
-
-// Status byte values
-#define MSR_G_OK			"\x30"
-#define MSR_RW_ERROR		"\x31"
-#define MSR_CFMT_ERROR		"\x32"
-#define MSR_INVALID_CMD		"\x34"
-#define MSR_INVALID_SWP 	"\x39"
-
-// OK and FAIL values
-#define MSR_OK				MSR_ESC MSR_G_OK
-#define MSR_FAIL			MSR_ESC	"\x41"
-
-
-// Response: NONE
-#define MSR_RESET 			MSR_ESC "\x61"
-// Response: [DATA] MSR_ESC [STATUS]
-#define MSR_ISO_READ 		MSR_ESC "\x72"
-// Response: MSR_ESC [STATUS]
-#define MSR_ISO_WRITE 		MSR_ESC "\x77"
-// Response: MSR_ESC Y(\x79)
-#define MSR_COM_TEST 		MSR_ESC "\x65"
-// Response: None
-#define MSR_ALL_LED_OFF 	MSR_ESC "\x81"
-// Response: None
-#define MSR_ALL_LED_ON 		MSR_ESC "\x82"
-// Response: None
-#define MSR_GREEN_LED_ON 	MSR_ESC "\x83"
-// Response: None
-#define MSR_YELLOW_LED_ON 	MSR_ESC "\x84"
-// Response: None
-#define MSR_RED_LED_ON 		MSR_ESC "\x85"
-// Response: MSR_ESC 0 (If test succeeded)
-// NOTE: Will not return unless MSR_REST or Card swiped
-#define MSR_SENS_TEST		MSR_ESC "\x86"
-// Response: MSR_ESC 0 (If test succeeded) MSR_ESC A on fail
-#define MSR_RAM_TEST		MSR_ESC "\x87"
-// Response: MSR_ESC 0 (If set succeeded) MSR_ESC A on fail
-/* NOTE: This command is used to set how many leading zeros will be written before the card data starts, and
-		 the space should calculated as [leading zero] X25.4 / BPI (75or210) =mm
-		 Default setting of leading zero: [3D] [16]
-		 TK1 & TK3: [3D] means leading zero=61
-		 TK2: [16] means leading zero=22
-*/
-#define MSR_SET_LEAD_ZERO	MSR_ESC "\x7A"
-// Response: MSR_ESC [00-FF] [00-FF]
-#define MSR_CHECK_LEAD_ZERO	MSR_ESC "\x6C"
-// Response: MSR_ESC 0 (If erase succeeded) MSR_ESC A on fail
-#define MSR_ERASE_CARD		MSR_ESC "\x6C"
-// Track constants
-#define MSR_EC_TRACK1		"\x00"
-#define MSR_EC_TRACK2		"\x02"
-#define MSR_EC_TRACK3		"\x04"
-#define MSR_EC_TRACK1_2		"\x03"
-#define MSR_EC_TRACK1_3		"\x05"
-#define MSR_EC_TRACK2_3		"\x06"
-#define MSR_EC_TRACK1_2_3	"\x07"
-// Response: MSR_OK (If set succeeded) MSR_FAIL on fail
-#define MSR_SET_BPI			MSR_ESC "\x62"
-// Sub commands per track.
-#define MSR_SB_TRACK1_210	MSR_SET_BPI "\xA1"
-#define MSR_SB_TRACK1_75	MSR_SET_BPI "\xA0"
-#define MSR_SB_TRACK2_210	MSR_SET_BPI "\xD2"
-#define MSR_SB_TRACK2_75	MSR_SET_BPI "\x4B"
-#define MSR_SB_TRACK3_210	MSR_SET_BPI "\xC1"
-#define MSR_SB_TRACK3_75	MSR_SET_BPI "\xC0"
-// Response: [RAW_DATA] MSR_ESC [STATUS]
-#define MSR_RAW_READ		MSR_ESC "\x6D"
-// Response: MSR_ESC [STATUS]
-#define MSR_RAW_WRITE		MSR_ESC "\x6E"
-// Response: MSR_ESC [Model] S
-#define MSR_REQ_MODEL		MSR_ESC "\x74"
-// Response: MSR_ESC [Version]
-#define MSR_REQ_FIRM_VER	MSR_ESC "\x76"
-// Response: MSR_ESC \x30 [TK1] [TK2] [TK3]
-// NOTE: Track sizes are between 05-08
-#define MSR_SET_BPC			MSR_ESC "\x6F"
-// Response: MSR_ESC 0
-#define MSR_SET_HI_CO		MSR_ESC "\x78"
-// Response: MSR_ESC 0
-#define MSR_SET_LO_CO		MSR_ESC "\x79"
-// Response: MSR_ESC H/L
-#define MSR_GET_CO_STAT		MSR_ESC "\x64"
+// Where WarmInitialize keeps device profiles
+#if !defined(PROFILE_DIR)
+#define PROFILE_DIR "/var/tmp/lib605"
+#endif
+
+// How long a supervised connection keeps trying to reopen the device
+#if !defined(RECONNECT_BUDGET_MS)
+#define RECONNECT_BUDGET_MS 1000
+#endif
 
 /*! \namespace lib605
 	\brief MSR605 and 606 Userspace library
 */
 namespace lib605 {
+	class DuplicateFilter;
+	class QualityTracker;
+	class UringEngine;
+	struct ReadQuality;
+
 	/*! \class lib605::Track
 		\brief Track data container
 		This class contains the definition for all of the track data
@@ -136,34 +75,34 @@ namespace lib605 {
 			};
 		private:
 			// Raw track data
-			unsigned char* TrackData;
-			// size of data
-			int TrackDataLength;
+			std::vector<unsigned char> TrackData;
 			// Track BPC
 			TRACK_BIT_LEN TrackBitLength;
 		public:
 			/*!
-				Construct a new track
+				Construct a new track, the data is copied
 
 				\param data The track information
 				\param data_len The length of the track
 				\param bit_len The density of the track
 			*/
-			Track(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
+			Track(const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
 			// Destructor
 			~Track(void);
 
 			/*! Returns the raw track data */
-			unsigned char* GetTrackData(void);
+			const unsigned char* GetTrackData(void) const;
 			/*! Returns the length of the track data */
-			int GetTrackDataLength(void);
+			int GetTrackDataLength(void) const;
 
-			TRACK_BIT_LEN GetTrackBitLength(void);
+			TRACK_BIT_LEN GetTrackBitLength(void) const;
 
 			// Allows human-readable output of data
-			friend std::ostream& operator<< (std::ostream &out, Track &sTrack);
+			friend std::ostream& operator<< (std::ostream &out, const Track &sTrack);
 	};
 
+	struct TrackDecode;
+
 	// Magstripe data class
 	class Magstripe {
 		public:
@@ -173,34 +112,78 @@ namespace lib605 {
 				ISO
 			};
 		private:
-			// Tracks
-			Track* Track1;
-			Track* Track2;
-			Track* Track3;
+			// Tracks, a track read from the card is only copied out of Response when first asked for
+			mutable std::atomic<Track*> Tracks[3];
+			// Characters of each track, decoded when first asked for
+			mutable std::atomic<TrackDecode*> Decoded[3];
 			CARD_DATA_FORMAT Format;
-			// Creates a track from the given buffer (Might move into Track class)
-			Track* CreateTrack(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
+			// Seen within the duplicate window of the reader
+			bool Duplicate;
+			// Track data as read, shared between copies of the card
+			std::shared_ptr<const std::vector<unsigned char> > Response;
+			// Where each track lies in Response, -1 if it is not in there
+			int Offset[3];
+			int Length[3];
+			Track::TRACK_BIT_LEN Bits[3];
+
+			// Replaces a track with a copy of the given buffer
+			void ReplaceTrack(int n, const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
+			// Gets a track, copying it out of Response the first time
+			Track* LoadTrack(int n) const;
+			// Gets a track decoded, decoding it the first time
+			const TrackDecode* LoadDecoded(int n) const;
+			// Finds the fields of the first track of the card holding them
+			bool SplitFields(std::string* PAN, std::string* Name, std::string* Expiry, std::string* ServiceCode) const;
 		public:
 			// Constructor
 			Magstripe(CARD_DATA_FORMAT Format);
+			// Copies the tracks, the data as read is shared
+			Magstripe(const Magstripe& other);
+			Magstripe& operator= (const Magstripe& other);
 			// Destructor
 			~Magstripe(void);
 
-			// Gets each track object
-			Track* GetTrack1(void);
-			Track* GetTrack2(void);
-			Track* GetTrack3(void);
+			// Gets each track object, NULL if the track was never set
+			Track* GetTrack1(void) const;
+			Track* GetTrack2(void) const;
+			Track* GetTrack3(void) const;
+
+			// Gets the data of track 1 to 3 without copying it out, false if the track was never set.
+			// It stays valid until the track is set again or the card is destroyed
+			bool PeekTrack(int Number, const unsigned char*& data, int& data_len, Track::TRACK_BIT_LEN& bit_len) const;
 
 			// Sets each track object
-			void SetTrack1(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
-			void SetTrack2(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
-			void SetTrack3(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
+			void SetTrack1(const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
+			void SetTrack2(const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
+			void SetTrack3(const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len);
+
+			// Keeps a card data block as read, each track is only copied out or decoded once asked for
+			void SetCardBlock(const unsigned char* data, const cmd::CardBlock& Block, const Track::TRACK_BIT_LEN Bits[3]);
+
+			// Gets the ISO characters of each track, decoded from raw data the first time they are
+			// asked for. NULL if the track was never set
+			const TrackDecode* GetDecodedTrack1(void) const;
+			const TrackDecode* GetDecodedTrack2(void) const;
+			const TrackDecode* GetDecodedTrack3(void) const;
+
+			// Gets the fields of a financial card, from track 2 and else track 1, decoding only
+			// the track they are taken from. Empty if no track decoded cleanly holds them
+			std::string GetPAN(void) const;
+			// Name of the holder, on track 1 only
+			std::string GetName(void) const;
+			// Expiry date as YYMM
+			std::string GetExpiry(void) const;
+			std::string GetServiceCode(void) const;
 
 			// Returns the card format
-			CARD_DATA_FORMAT GetCardDataFormat(void);
+			CARD_DATA_FORMAT GetCardDataFormat(void) const;
+
+			// Whether the reader saw this card within its duplicate window
+			bool IsDuplicate(void) const;
+			void SetDuplicate(bool Duplicate);
 
 			// Outputs a nice human-readable representation of the Magstripe data
-			friend std::ostream& operator<< (std::ostream &out, Magstripe &sMagstripe);
+			friend std::ostream& operator<< (std::ostream &out, const Magstripe &sMagstripe);
 	};
 
 	// Main class for interacting with the MSR device
@@ -220,6 +203,17 @@ namespace lib605 {
 				LO_CO,
 				ERR
 			};
+			// How device I/O is done
+			enum IO_BACKEND {
+				IO_CLASSIC,	// Write, poll and read on the calling thread
+				IO_URING	// Command exchanges through an io_uring shared by all devices
+			};
+			// Outcome of ProbeIfIdle
+			enum PROBE_RESULT {
+				PROBE_SKIPPED,
+				PROBE_OK,
+				PROBE_FAILED
+			};
 			// Track control enum
 			enum TRACK {
 				TRACK_1,
@@ -230,6 +224,27 @@ namespace lib605 {
 				TRACK_2_3,
 				TRACK_1_2_3
 			};
+			// Settings applied through this object, replayed after a reconnect
+			struct Settings {
+				bool HasCoercivity;
+				COERCIVITY Coercivity;
+				bool HasBPI[3];
+				Track::TRACK_BPI BPI[3];
+				bool HasBPC;
+				char BPC[3];
+				bool HasLeadZero;
+				unsigned char LeadZero[2];	// Tracks 1 and 3, track 2
+			};
+			// What WarmInitialize remembers about a device between runs
+			struct Profile {
+				char Model[2];				// As returned by GetModel
+				char FirmwareVersion[9];	// As returned by GetFirmwareVersion
+				bool SelfTestPassed;
+				int64_t SelfTestTime;		// Seconds since the epoch
+				COERCIVITY Coercivity;		// As the device last reported it
+				unsigned char LeadZero[2];
+				Settings Applied;			// Replayed on reconnect
+			};
 		private:
 			// Device handle
 			int devhndl;
@@ -237,15 +252,104 @@ namespace lib605 {
 			bool MSRConected;
 			// Device path '/dev/ttyUSB0' by default
 			std::string Device;
+			// Record of all device traffic
+			TraceRing Trace;
+			// Where to dump the trace when a command fails, empty to disable
+			std::string TraceDumpPath;
+			// Status byte of the last card command
+			unsigned char LastStatus;
+			// How long to wait for a command reply, zero waits forever
+			std::chrono::milliseconds Timeout;
+			// Bits per character of each track as last set with SetBPC
+			Track::TRACK_BIT_LEN TrackBits[3];
+			// Last applied settings
+			Settings Applied;
+			// Reopen the device and replay Applied when the link drops
+			bool AutoReconnect;
+			// Set when the device errors or hangs up, cleared on connect. Like Reconnecting and
+			// Armed it is read by monitor threads without IOLock
+			std::atomic<bool> LinkDown;
+			// Guards against reconnecting from within a reconnect
+			std::atomic<bool> Reconnecting;
+			// Token of the blocking operation in progress, NULL if none
+			CancelToken* ActiveCancel;
+			// Set when the operation in progress was cancelled
+			bool Cancelled;
+			// Recently read cards, NULL unless duplicate detection is on
+			std::unique_ptr<DuplicateFilter> Duplicates;
+			// Outcome of every swipe read
+			std::unique_ptr<QualityTracker> Quality;
+			// Directory profiles are kept in
+			std::string ProfileDir;
+			// Profile file name of the device, looked up the first time a profile is used
+			std::string DeviceKey;
+			// Profile of the connected device, valid once WarmInitialize ran
+			Profile Known;
+			bool ProfileActive;
+			// Held for every exchange with the device, lets a monitor thread probe in between
+			std::recursive_mutex IOLock;
+			// Set while a card read is waiting for a swipe
+			std::atomic<bool> Armed;
+			// No-reply commands waiting for Flush, at most one of each
+			std::mutex QueueLock;
+			bool QueuedReset;
+			int QueuedLED;	// MSR_LED, -1 if none
+			// Shared ring of the IO_URING backend, NULL for the classic one
+			std::shared_ptr<UringEngine> Uring;
+
+			// Installs a cancel token for the scope of an operation and
+			// resets the device if the operation was cancelled
+			class CancelScope {
+				private:
+					MSR& Owner;
+					CancelToken* Previous;
+				public:
+					CancelScope(MSR& Owner, CancelToken* Cancel);
+					~CancelScope(void);
+			};
 
 			//  Cycles the LEDs used in initialization step
 			void CycleLED(void) noexcept;
+			// Called whenever a command fails, dumps the trace if configured
+			void OnCommandFailure(void);
+			// Waits until the device is readable, false on timeout or hangup
+			bool WaitReadable(std::chrono::steady_clock::time_point deadline, bool bounded);
+			// Updates the track bit lengths from bits per character values
+			void SetTrackBits(const char* bpc);
+			// Saves the profile when settings change after WarmInitialize
+			void OnSettingsChanged(void);
+			// Returns DeviceKey, scanning /dev/serial/by-id for it the first time
+			const std::string& GetDeviceKey(void);
+			// Sends the settings marked in replay through the setters, false on the first that fails
+			bool ApplySettings(const Settings& replay);
+			// Reconnects if supervised and the link dropped, true if the caller should retry
+			bool RecoverLink(void);
+			// Reads and discards input until the line stays quiet for the given time
+			void DrainInput(std::chrono::milliseconds Quiet);
+			// Reads len bytes, bounded by the timeout if asked to
+			int ReadReply(char* buffer, int len, bool bounded);
+			// Writes a frame and reads reply_len bytes back, reconnecting once if supervised
+			bool Exchange(const unsigned char* frame, int frame_len, unsigned char* reply, int reply_len, bool swipe);
+			// Writes a frame and reads and parses the reply of command C
+			template<typename C>
+			cmd::Response<typename C::Reply::Result> Transact(const unsigned char* frame, int frame_len);
+			// Reads a card data block following a card command, returns its length or -1
+			int ReadCardBlock(unsigned char* buffer, int buffer_size, bool length_prefixed, cmd::CardBlock& block);
+			// Arms the given card read command and waits for the card data block
+			template<typename C>
+			int ReadCardCommand(unsigned char* buffer, int buffer_size, cmd::CardBlock& block);
+			// Builds the card read into buffer, flagging duplicates and counting its quality
+			Magstripe MakeCard(Magstripe::CARD_DATA_FORMAT Format, const unsigned char* buffer, const cmd::CardBlock& block);
+			// Loop of ReadCards for the given card read command
+			template<typename C>
+			bool StreamCardCommand(Magstripe::CARD_DATA_FORMAT Format, const std::function<bool(const Magstripe&, unsigned char)>& Handler);
 
 		public:
 			// Construct a new MSR class
 			MSR(void) noexcept;
-			// Set a device
-			MSR(std::string Device) noexcept;
+			// Set a device, and optionally the I/O backend. IO_URING falls back to
+			// IO_CLASSIC where io_uring is unavailable
+			MSR(std::string Device, IO_BACKEND Backend = IO_CLASSIC) noexcept;
 			// Destructor
 			~MSR(void);
 
@@ -256,39 +360,94 @@ namespace lib605 {
 
 			// Initialize the MSR device
 			bool Initialize(void);
+			// Initialize using the profile saved by a previous run: when the device passed its
+			// self test last time, answers MSR_COM_TEST and reports the saved model and firmware,
+			// the self tests are skipped and the saved identity is used. Settings that can't be
+			// read back are sent again, the others only if the device lost them to a power cycle.
+			// Otherwise runs Initialize and saves a new profile. Settings changed afterwards are
+			// saved as well
+			bool WarmInitialize(void);
+			// Sets the directory profiles are kept in, PROFILE_DIR by default
+			void SetProfileDir(std::string Dir);
+			// Returns the profile of the connected device, valid after WarmInitialize
+			Profile GetProfile(void);
 
 			// Communication Self Test (Runs second)
 			bool TestCommunication(void);
 			// Sensor Self Test (Runs last)
-			bool TestSensor(void);
+			// Without a token the sensor test is answered by sending a reset straight away,
+			// with one it waits for a card swipe until cancelled
+			bool TestSensor(CancelToken* Cancel = NULL);
 			// RAM Self Test (Runs first)
 			bool TestRAM(void);
 
 			// Sends the reset code to the device
 			void SendReset(void);
 
+			// Runs the communication test bounded by Timeout, unless another thread is talking
+			// to the device or a card read is armed. A disconnected device fails the probe. A failed probe
+			// waits up to Timeout again for a late reply to drain. Safe to call from any thread
+			PROBE_RESULT ProbeIfIdle(std::chrono::milliseconds Timeout, std::chrono::microseconds& RoundTrip);
+
 			// Sets the LED on the device
 			void SetLED(MSR_LED LED);
 
+			// Queue a reset or LED change for the next Flush, safe from any thread. Only the
+			// latest LED state is kept and a queued reset goes out before it
+			void QueueReset(void);
+			void QueueLED(MSR_LED LED);
+			// Sends everything queued in one write. Leaves it queued and returns false if a read
+			// is armed or another thread is talking to the device, ReadCards sends it between cards
+			bool Flush(void);
+			// Returns whether anything is waiting for Flush
+			bool HasQueued(void);
+
+			// Sets how long to wait for a command reply, zero (the default) waits forever
+			// NOTE: Does not apply to card swipes
+			void SetTimeout(std::chrono::milliseconds Timeout);
+
+			// Opt in to supervised mode: when the device drops off (e.g. a USB reset) it is
+			// reopened with backoff, the last applied settings are replayed and the
+			// interrupted command or pending card read is resumed
+			// NOTE: Use a /dev/serial/by-id path, ttyUSB numbers can change across a reset
+			void SetAutoReconnect(bool Enable);
+			// Reopens the device and replays the last applied settings, waits for an exchange in
+			// progress on another thread to finish first
+			bool Reconnect(void);
+			// Returns the settings applied through this object
+			Settings GetSettings(void);
+
+			// Returns the I/O backend in use
+			IO_BACKEND GetIOBackend(void);
+
 			// Check the device connection
 			bool IsConnected(void);
 			// Disconnects from the device
 			void Disconnect(void);
 
-			// Gets the model number of the device
+			// Sets the file the trace is dumped to when a command fails, empty disables
+			void SetTraceDumpPath(std::string Path);
+			// Returns the trace of device traffic
+			const TraceRing& GetTrace(void);
+			// Writes the trace of device traffic to the given file
+			bool DumpTrace(std::string Path);
+
+			// Gets the model number of the device, from the profile after WarmInitialize
 			std::string GetModel(void);
-			// Gets the firmware version of the device
+			// Gets the firmware version of the device, from the profile after WarmInitialize
 			std::string GetFirmwareVersion(void);
 
 
-			// Attempts to estimate buffer size and read that many bytes from the device
-			int ReadAutoBytes(char* buffer);
 			// Reads an arbitrary number of bytes from the device
 			int ReadBytes(char* buffer, int len);
-			// Attempts to estimate the size of the write buffer and write to the device
-			int WriteAutoSize(char* buffer);
+			// Reads at least one and at most len bytes from the device
+			int ReadSome(char* buffer, int len);
 			// Writes an arbitrary number of bytes to the device
-			int WriteBytes(char* buffer, int len);
+			int WriteBytes(const char* buffer, int len);
+
+			// Builds the frame for command C on the stack, sends it and parses the typed reply
+			template<typename C, typename... Args>
+			cmd::Response<typename C::Reply::Result> Send(Args... args);
 
 			// Set the bits per character on the device per tack
 			bool SetBPC(char Track1, char Track2, char Track3);
@@ -307,14 +466,72 @@ namespace lib605 {
 
 			// Sets the device to erase the given track
 			// NOTE: CALL A RESET AFTER USING!!!!
-			bool EraseCard(TRACK track);
+			bool EraseCard(TRACK track, CancelToken* Cancel = NULL);
 
 			// Returns a magstripe object with card data in the given format
-			Magstripe ReadCard(Magstripe::CARD_DATA_FORMAT Format);
-
-			// Read a ISO Track into a buffer
-			bool ReadISOTrackData(unsigned char* buffer, int buffer_size, Track::TRACK_BIT_LEN trackFmt);
-			// Read raw track data into a buffer
-			bool ReadRAWTrackData(unsigned char* buffer, int buffer_size, Track::TRACK_BIT_LEN trackFmt);
+			// NOTE: Waits for a card swipe, tracks are empty on failure or cancellation
+			Magstripe ReadCard(Magstripe::CARD_DATA_FORMAT Format, CancelToken* Cancel = NULL);
+			// Keeps a card read armed and calls Handler with every card and its status byte
+			// until Handler returns false or the operation is cancelled. The next read is
+			// armed before Handler runs, so cards swiped while it runs are not missed
+			// NOTE: Returns false if the device fails, true when stopped or cancelled
+			bool ReadCards(Magstripe::CARD_DATA_FORMAT Format, std::function<bool(const Magstripe&, unsigned char)> Handler, CancelToken* Cancel = NULL);
+			// Writes the tracks of the given card in its format, waits for a card swipe
+			bool WriteCard(const Magstripe& Card, CancelToken* Cancel = NULL);
+			// Returns whether the last blocking operation was cancelled
+			bool WasCancelled(void);
+
+			// Opt in to flagging cards read again within Window with Magstripe::IsDuplicate,
+			// at most Capacity cards are remembered
+			void EnableDuplicateDetection(std::chrono::milliseconds Window, size_t Capacity = 1024);
+			void DisableDuplicateDetection(void);
+			// Returns the duplicate filter to set a key on, NULL when disabled
+			DuplicateFilter* GetDuplicateFilter(void);
+			// Returns the status byte of the last card read or write
+			unsigned char GetLastStatus(void);
+			// Returns how the swipes read so far came out, per track and overall, with
+			// the rolling first swipe success rates. Cheap, safe from any thread. A swipe is counted
+			// shortly after it is read, off the reading thread
+			// NOTE: ReadQuality is defined in lib605_quality.hpp
+			ReadQuality GetReadQuality(void);
+			// Clears the read quality counters
+			void ResetReadQuality(void);
+
+			// Read the ISO card data block into a buffer, returns its length or -1
+			int ReadISOTrackData(unsigned char* buffer, int buffer_size, cmd::CardBlock& block);
+			// Read the raw card data block into a buffer, returns its length or -1
+			int ReadRAWTrackData(unsigned char* buffer, int buffer_size, cmd::CardBlock& block);
 	};
+
+	template<typename C>
+	cmd::Response<typename C::Reply::Result> MSR::Transact(const unsigned char* frame, int frame_len) {
+		typedef typename C::Reply R;
+		cmd::Response<typename R::Result> resp;
+		resp.Ok = false;
+		resp.Value = typename R::Result();
+		// One spare byte so commands without a reply don't declare a zero length array
+		unsigned char reply[R::Length + 1];
+		if(!this->Exchange(frame, frame_len, reply, (int)R::Length, C::WaitsForSwipe)) return resp;
+		resp.Ok = R::Parse(reply, resp.Value);
+		if(!resp.Ok) this->OnCommandFailure();
+		return resp;
+	}
+
+	template<typename C, typename... Args>
+	cmd::Response<typename C::Reply::Result> MSR::Send(Args... args) {
+		unsigned char frame[C::FrameLength];
+		C::Build(frame, args...);
+		return this->Transact<C>(frame, (int)C::FrameLength);
+	}
+
+	template<typename C>
+	int MSR::ReadCardCommand(unsigned char* buffer, int buffer_size, cmd::CardBlock& block) {
+		while(true) {
+			if(!this->Send<C>()) return -1;
+			int len = this->ReadCardBlock(buffer, buffer_size, C::LengthPrefixed, block);
+			// Re-arm the read on the reopened device, the swipe is still to come
+			if(len < 0 && this->RecoverLink()) continue;
+			return len;
+		}
+	}
 }
@@ -0,0 +1,149 @@
+/*
+	lib605_archive.hpp - Compressed archives of captured swipes
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lib605.hpp"
+#include "lib605_capture.hpp"
+
+// Records compressed together, the unit of random access and of parallel decoding
+#if !defined(ARCHIVE_BLOCK_RECORDS)
+#define ARCHIVE_BLOCK_RECORDS 1024
+#endif
+
+namespace lib605 {
+	struct ArchiveBlock;
+
+	/*! \class lib605::ArchiveWriter
+		\brief Writes swipes to a compressed archive file
+
+		Records are gathered into blocks of ARCHIVE_BLOCK_RECORDS, each
+		compressed on its own and stored column by column: device, status
+		and track layout run length coded, timestamps as deltas, and each
+		track in columns of its own. A track is coded against an earlier
+		record of the block starting with the same characters, the same
+		card or at least the same issuer, or for track 2 against what track
+		1 says it holds, keeping only what lies between the prefix and
+		suffix they share. What is left is packed at 4 bits a character for
+		numeric tracks and 6 for alphanumeric ones. A raw track is kept as
+		its ISO characters when encoding them again gives back the exact
+		raw bytes, and as is otherwise.
+
+		The file is written under a temporary name and renamed into place
+		by Close, with an index of the blocks at its end.
+	*/
+	class ArchiveWriter {
+		private:
+			std::string Path;
+			int Fd;
+			uint64_t Offset;
+			uint64_t Records;
+			std::vector<CaptureRecord> Pending;
+			std::vector<ArchiveBlock> Index;
+
+			// Compresses and writes the pending records
+			bool WriteBlock(void);
+		public:
+			ArchiveWriter(void);
+			// Discards an archive that was not closed
+			~ArchiveWriter(void);
+
+			ArchiveWriter(const ArchiveWriter&) = delete;
+			ArchiveWriter& operator= (const ArchiveWriter&) = delete;
+
+			/*!
+				Starts a new archive, replacing Path once closed
+
+				\param Mode Permissions of the archive, it holds whole tracks
+			*/
+			bool Open(std::string Path, mode_t Mode = 0600);
+			/*! Adds a record, in the order they should be read back. A failed write drops the archive */
+			bool Append(const CaptureRecord& Record);
+			/*! Writes the last block and the index and moves the archive into place */
+			bool Close(void);
+			/*! Drops the archive being written */
+			void Abort(void);
+	};
+
+	/*! \class lib605::ArchiveReader
+		\brief Reads an archive written by ArchiveWriter
+
+		The file is mapped and only the blocks a call needs are
+		decompressed. Records are numbered from 0 in the order they were
+		appended. Get fails on a block that fails its checksum. Scan and
+		ForEach skip such a block and still visit the others, reporting it
+		through Intact and the return value.
+	*/
+	class ArchiveReader {
+		public:
+			/*! Called with every record and its number, see ForEach */
+			typedef std::function<void(uint64_t Number, const CaptureRecord& Record)> Callback;
+		private:
+			const unsigned char* Map;
+			size_t MapSize;
+			const ArchiveBlock* Blocks;
+			uint64_t BlockCount;
+			uint64_t RecordCount;
+
+			// Last block decompressed by Get, sequential reads decompress each block once
+			std::mutex CacheLock;
+			uint64_t CachedBlock;
+			std::vector<CaptureRecord> Cached;
+
+			bool DecodeBlock(uint64_t Block, std::vector<CaptureRecord>& Out) const;
+		public:
+			ArchiveReader(void);
+			// Unmaps the archive
+			~ArchiveReader(void);
+
+			ArchiveReader(const ArchiveReader&) = delete;
+			ArchiveReader& operator= (const ArchiveReader&) = delete;
+
+			/*! Maps an archive, false if it is not one or its index is damaged */
+			bool Open(std::string Path);
+			/*! Unmaps the archive */
+			void Close(void);
+
+			/*! Returns the number of records */
+			uint64_t Size(void) const;
+
+			/*! Reads the record with the given number */
+			bool Get(uint64_t Number, CaptureRecord& Record);
+
+			/*!
+				Decompresses every record, blocks are spread over worker threads
+
+				\param cb Receives each record, from several threads at once and in no particular order
+				\param Threads Worker threads, 0 uses one per core
+				\return false if a block is damaged, the records of the others are still visited
+			*/
+			bool ForEach(const Callback& cb, unsigned Threads = 0) const;
+
+			/*!
+				Visits the records from From up to but not including To, in the order they were appended
+
+				\param Visit Called for each record, returning false stops the scan
+				\param Intact Set to false if a damaged block was skipped, as ForEach does, may be NULL
+				\return Records visited
+			*/
+			size_t Scan(std::chrono::system_clock::time_point From, std::chrono::system_clock::time_point To,
+				std::function<bool(const CaptureRecord&)> Visit, bool* Intact = NULL) const;
+	};
+}
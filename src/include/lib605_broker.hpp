@@ -0,0 +1,164 @@
+/*
+	lib605_broker.hpp - Shared memory swipe event ring published by the broker
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "lib605.hpp"
+
+// Unix domain socket the broker accepts commands on
+#if !defined(BROKER_SOCKET)
+#define BROKER_SOCKET "/tmp/lib605-broker.sock"
+#endif
+
+// POSIX shared memory object swipe events are published to
+#if !defined(BROKER_RING)
+#define BROKER_RING "/lib605-swipes"
+#endif
+
+// Events kept in the ring, a power of two
+#if !defined(BROKER_RING_SLOTS)
+#define BROKER_RING_SLOTS 256
+#endif
+
+// Track bytes an event can carry, as much as MSR::ReadCard buffers
+#if !defined(SWIPE_DATA_MAX)
+#define SWIPE_DATA_MAX 1024
+#endif
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the swipe ring needs lock-free 64 bit atomics to be shared between processes");
+
+namespace lib605 {
+	/*! A card read published by the broker */
+	struct SwipeEvent {
+		uint64_t Sequence;		/*!< Event number, the first event is 1 */
+		uint64_t Timestamp;		/*!< Nanoseconds since the epoch */
+		uint32_t Device;		/*!< Index of the device in the broker's command line */
+		uint8_t Format;			/*!< Magstripe::CARD_DATA_FORMAT */
+		uint8_t Status;			/*!< Status byte the device ended the read with */
+		uint8_t Duplicate;		/*!< Non zero if the broker saw the card within its duplicate window */
+		uint8_t Bits[3];		/*!< Track::TRACK_BIT_LEN of each track */
+		uint16_t Length[3];		/*!< Length of each track, the tracks follow each other in Data */
+		unsigned char Data[SWIPE_DATA_MAX];
+	};
+
+	/*! Rebuilds the card carried by an event */
+	Magstripe EventToMagstripe(const SwipeEvent& Event);
+
+	/*
+		Ring layout
+
+		A header followed by BROKER_RING_SLOTS slots. Event n lives in slot
+		(n - 1) % Slots, whose Sequence is 2n - 1 while it is being written
+		and 2n once it is complete. Readers copy the event out and check the
+		sequence did not move while they did.
+	*/
+	struct SwipeRingSlot {
+		std::atomic<uint64_t> Sequence;
+		SwipeEvent Event;
+	};
+
+	struct SwipeRingHeader {
+		char Magic[8];					// "L605RNG"
+		uint32_t Version;
+		uint32_t Slots;
+		std::atomic<uint64_t> Head;		// Last published event
+		std::atomic<uint32_t> Wake;		// Bumped on every publish, readers futex wait on it
+		uint32_t Reserved;
+	};
+
+	/*! \class lib605::SwipeRingWriter
+		\brief Producer side of the swipe ring
+
+		Publishing costs the same no matter how many readers there are: one
+		copy into the slot and one futex wake. There must be a single writer
+		per ring, callers publishing from several threads serialize.
+	*/
+	class SwipeRingWriter {
+		private:
+			std::string Name;
+			SwipeRingHeader* Header;
+			SwipeRingSlot* Slots;
+			size_t MapSize;
+		public:
+			SwipeRingWriter(void);
+			// Unmaps and removes the ring
+			~SwipeRingWriter(void);
+
+			SwipeRingWriter(const SwipeRingWriter&) = delete;
+			SwipeRingWriter& operator= (const SwipeRingWriter&) = delete;
+
+			/*!
+				Creates the ring
+
+				\param Name Name of the shared memory object
+				\param Replace Removes a ring of the same name first, which may be
+					in use by a running broker. Otherwise an existing one fails with EEXIST
+				\param Mode Permissions of the ring, it holds whole tracks
+			*/
+			bool Create(std::string Name = BROKER_RING, bool Replace = false, mode_t Mode = 0600);
+			/*! Unmaps and removes the ring */
+			void Close(void);
+
+			/*!
+				Publishes a card
+
+				\return The event sequence number, 0 if the ring is not open
+			*/
+			uint64_t Publish(uint32_t Device, const Magstripe& Card, unsigned char Status);
+	};
+
+	/*! \class lib605::SwipeRingReader
+		\brief Consumer side of the swipe ring
+
+		Every reader keeps its own cursor in its own process, the ring is
+		mapped read-only. A reader that falls more than the ring size
+		behind skips ahead and counts the events it lost.
+	*/
+	class SwipeRingReader {
+		private:
+			const SwipeRingHeader* Header;
+			const SwipeRingSlot* Slots;
+			size_t MapSize;
+			// Next event to read
+			uint64_t Cursor;
+			uint64_t Lost;
+		public:
+			SwipeRingReader(void);
+			~SwipeRingReader(void);
+
+			SwipeRingReader(const SwipeRingReader&) = delete;
+			SwipeRingReader& operator= (const SwipeRingReader&) = delete;
+
+			/*!
+				Maps the ring
+
+				\param Name Shared memory object of the broker
+				\param FromStart Start at the oldest event still in the ring instead of the next one
+			*/
+			bool Open(std::string Name = BROKER_RING, bool FromStart = false);
+			void Close(void);
+
+			/*! Copies out the next event, false if there is none yet */
+			bool Next(SwipeEvent& Event);
+			/*! Waits until an event may be available, false on timeout, zero waits forever */
+			bool Wait(std::chrono::milliseconds Timeout);
+
+			/*! Returns the number of events overwritten before they were read */
+			uint64_t GetLost(void) const;
+	};
+}
@@ -0,0 +1,45 @@
+/*
+	lib605_cancel.hpp - Cancellation of blocking device operations
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+
+namespace lib605 {
+	/*! \class lib605::CancelToken
+		\brief Wakes up a blocking MSR operation from another thread
+
+		Backed by an eventfd that MSR polls alongside the device. Once
+		cancelled the token stays cancelled, failing every operation it is
+		passed to, until Reset is called.
+	*/
+	class CancelToken {
+		private:
+			// eventfd, -1 if it could not be created
+			int EventFd;
+		public:
+			/*! Construct a token that is not cancelled */
+			CancelToken(void);
+			// Destructor
+			~CancelToken(void);
+
+			CancelToken(const CancelToken&) = delete;
+			CancelToken& operator= (const CancelToken&) = delete;
+
+			/*! Cancels every operation waiting on this token, safe from any thread */
+			void Cancel(void);
+			/*! Clears the cancellation */
+			void Reset(void);
+			/*! Returns whether Cancel has been called since the last Reset */
+			bool IsCancelled(void) const;
+			/*! Returns the eventfd, readable while cancelled */
+			int GetFd(void) const;
+	};
+}
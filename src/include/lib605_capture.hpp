@@ -0,0 +1,135 @@
+/*
+	lib605_capture.hpp - Indexed on-disk store of captured swipes
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lib605.hpp"
+
+// Size a segment is sealed and indexed at
+#if !defined(CAPTURE_SEGMENT_BYTES)
+#define CAPTURE_SEGMENT_BYTES (16 * 1024 * 1024)
+#endif
+
+// Records per entry of the sparse time index
+#if !defined(CAPTURE_BLOCK_RECORDS)
+#define CAPTURE_BLOCK_RECORDS 64
+#endif
+
+namespace lib605 {
+	/*! A swipe kept in a CaptureStore */
+	struct CaptureRecord {
+		std::chrono::system_clock::time_point Timestamp;	/*!< When the swipe happened */
+		uint32_t Device;									/*!< Reader it came from, numbered by the caller */
+		unsigned char Status;								/*!< Status byte the device ended the read with */
+		uint64_t Fingerprint;								/*!< FingerprintMagstripe of the card, unkeyed */
+		Magstripe Card;
+
+		CaptureRecord(void) : Device(0), Status(0), Fingerprint(0), Card(Magstripe::ISO) {}
+	};
+
+	/*! \class lib605::CaptureStore
+		\brief Append-only log of swipes, indexed by card and by time
+
+		Records are appended to the newest segment file of a directory.
+		Once a segment reaches CAPTURE_SEGMENT_BYTES it is sealed: an index
+		file is written next to it holding its fingerprints, bucketed by
+		their top bits, and the time span of every CAPTURE_BLOCK_RECORDS
+		records. Index files are mapped, not read, so a lookup only touches
+		the pages of the buckets and blocks it needs and the records they
+		point at, however many months of segments there are.
+
+		A record torn by a crash is cut off when the store is opened. One
+		process at a time may append to a directory, others can open it read
+		only to query what had been appended by then.
+	*/
+	class CaptureStore {
+		private:
+			struct Segment;
+
+			std::string Dir;
+			// Oldest first, the last one is appended to
+			std::vector<std::unique_ptr<Segment>> Segments;
+			std::mutex Lock;
+			bool ReadOnly;
+			// Of the files created, the directory also gets search permission where they are readable
+			mode_t Mode;
+
+			// Opens an existing segment, indexing it from its records if it has no index
+			bool LoadSegment(uint64_t Id, bool Active);
+			// Starts a new segment to append to
+			bool CreateSegment(uint64_t Id);
+			// Writes the index of the active segment and maps it
+			bool Seal(Segment& Seg);
+			// Reads the record at the given offset of a segment
+			bool ReadRecord(const Segment& Seg, uint64_t Offset, CaptureRecord& Record);
+		public:
+			CaptureStore(void);
+			// Closes the store
+			~CaptureStore(void);
+
+			CaptureStore(const CaptureStore&) = delete;
+			CaptureStore& operator= (const CaptureStore&) = delete;
+
+			/*!
+				Opens the store kept in Dir, creating it if needed
+
+				\param ReadOnly Query a store another process is appending to, Append then fails
+				\param Mode Permissions of the segment and index files, they hold whole tracks
+			*/
+			bool Open(std::string Dir, bool ReadOnly = false, mode_t Mode = 0600);
+			/*! Closes the store, appended records are kept */
+			void Close(void);
+
+			/*!
+				Appends a swipe
+
+				\param Card The card, stored as read
+				\param Device Reader it came from
+				\param Status Status byte of the read
+				\param Timestamp When the swipe happened
+			*/
+			bool Append(const Magstripe& Card, uint32_t Device, unsigned char Status,
+				std::chrono::system_clock::time_point Timestamp = std::chrono::system_clock::now());
+			/*! Flushes appended records to disk */
+			bool Sync(void);
+
+			/*!
+				Visits every record of a card, newest segment first
+
+				\param Visit Called for each record, returning false stops the lookup
+				\return Records visited
+			*/
+			size_t Find(uint64_t Fingerprint, std::function<bool(const CaptureRecord&)> Visit);
+			/*! Visits every record of the card, see above */
+			size_t Find(const Magstripe& Card, std::function<bool(const CaptureRecord&)> Visit);
+			/*! Fetches the record of the card appended last, false if it was never captured */
+			bool LastSeen(const Magstripe& Card, CaptureRecord& Record);
+
+			/*!
+				Visits the records from From up to but not including To, in the order they were appended
+
+				\param Visit Called for each record, returning false stops the scan
+				\return Records visited
+			*/
+			size_t Scan(std::chrono::system_clock::time_point From, std::chrono::system_clock::time_point To,
+				std::function<bool(const CaptureRecord&)> Visit);
+	};
+}
@@ -0,0 +1,265 @@
+/*
+	lib605_commands.hpp - MSR605/606 command descriptors
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <array>
+
+/*! \namespace lib605::cmd
+	\brief Wire protocol of the MSR605/606
+
+	Every command is a type carrying its opcode, how its parameters are laid
+	out in the frame and the shape of the reply the device sends back. Frames
+	are built on the stack by MSR::Send, which also parses the typed reply.
+*/
+namespace lib605 {
+namespace cmd {
+	// Control code, every frame and reply starts with it
+	constexpr unsigned char ESC			= 0x1B;
+
+	// Status byte values
+	constexpr unsigned char OK			= 0x30;
+	constexpr unsigned char RW_ERROR	= 0x31;
+	constexpr unsigned char CFMT_ERROR	= 0x32;
+	constexpr unsigned char INVALID_CMD	= 0x34;
+	constexpr unsigned char INVALID_SWP	= 0x39;
+	// Returned in place of a status by the self tests and set commands on failure
+	constexpr unsigned char FAIL		= 0x41;
+
+	// Card data block framing
+	constexpr unsigned char BLOCK_START	= 0x73;	// 's'
+	constexpr unsigned char BLOCK_END	= 0x3F;	// '?'
+	constexpr unsigned char FS			= 0x1C;
+
+	// LED opcodes indexed by MSR::MSR_LED
+	constexpr unsigned char LEDOpcodes[] = { 0x83, 0x84, 0x85, 0x82, 0x81 };
+	// Set BPI select bytes indexed by [track - 1][Track::TRACK_BPI]
+	constexpr unsigned char BPISelect[3][2] = {
+		{ 0xA1, 0xA0 },
+		{ 0xD2, 0x4B },
+		{ 0xC1, 0xC0 }
+	};
+	// Erase select bytes indexed by MSR::TRACK
+	constexpr unsigned char EraseSelect[] = { 0x00, 0x02, 0x04, 0x03, 0x05, 0x06, 0x07 };
+
+	/*! Empty result for commands that return nothing of interest */
+	struct None {};
+
+	/*! Result of a command sent with MSR::Send */
+	template<typename T>
+	struct Response {
+		bool Ok;	/*!< The exchange succeeded and the reply had the expected shape */
+		T Value;	/*!< Parsed reply, only meaningful when the device answered */
+		explicit operator bool(void) const { return this->Ok; }
+	};
+
+	/*
+		Reply shapes
+
+		Length is the exact number of bytes the device answers with, Parse
+		fills in the Result and returns whether the reply signals success.
+	*/
+
+	// Response: NONE
+	struct NoReply {
+		static constexpr size_t Length = 0;
+		typedef None Result;
+		static bool Parse(const unsigned char*, Result&) { return true; }
+	};
+
+	// Response: ESC [STATUS]
+	struct StatusReply {
+		static constexpr size_t Length = 2;
+		typedef unsigned char Result;
+		static bool Parse(const unsigned char* r, Result& out) {
+			out = r[1];
+			return r[0] == ESC && r[1] == OK;
+		}
+	};
+
+	// Response: ESC [Ack]
+	template<unsigned char Ack>
+	struct AckReply {
+		static constexpr size_t Length = 2;
+		typedef None Result;
+		static bool Parse(const unsigned char* r, Result&) {
+			return r[0] == ESC && r[1] == Ack;
+		}
+	};
+
+	// Response: ESC [Model] S
+	struct ModelReply {
+		static constexpr size_t Length = 3;
+		typedef char Result;
+		static bool Parse(const unsigned char* r, Result& out) {
+			out = (char)r[1];
+			return r[0] == ESC && r[2] == 'S';
+		}
+	};
+
+	// Response: ESC [Version], version is 8 characters e.g. "REV?X.XX"
+	struct VersionReply {
+		static constexpr size_t Length = 9;
+		typedef std::array<char, 8> Result;
+		static bool Parse(const unsigned char* r, Result& out) {
+			for(size_t i = 0; i < out.size(); i++) out[i] = (char)r[i + 1];
+			return r[0] == ESC;
+		}
+	};
+
+	// Response: ESC H/L
+	struct CoercivityReply {
+		static constexpr size_t Length = 2;
+		typedef char Result;
+		static bool Parse(const unsigned char* r, Result& out) {
+			out = (char)r[1];
+			return r[0] == ESC && (r[1] == 'H' || r[1] == 'L');
+		}
+	};
+
+	// Response: ESC [00-FF] [00-FF]
+	struct LeadZeroReply {
+		static constexpr size_t Length = 3;
+		typedef std::array<unsigned char, 2> Result;
+		static bool Parse(const unsigned char* r, Result& out) {
+			out[0] = r[1];
+			out[1] = r[2];
+			return r[0] == ESC;
+		}
+	};
+
+	// Response: ESC 0 [TK1] [TK2] [TK3]
+	struct BPCReply {
+		static constexpr size_t Length = 5;
+		typedef std::array<unsigned char, 3> Result;
+		static bool Parse(const unsigned char* r, Result& out) {
+			out[0] = r[2];
+			out[1] = r[3];
+			out[2] = r[4];
+			return r[0] == ESC && r[1] == OK;
+		}
+	};
+
+	// Packs the command parameters one byte each
+	inline void Pack(unsigned char*) {}
+	template<typename T, typename... Rest>
+	inline void Pack(unsigned char* out, T first, Rest... rest) {
+		*out = (unsigned char)first;
+		Pack(out + 1, rest...);
+	}
+
+	/*!
+		Generic command: ESC [Opcode] followed by Params parameter bytes
+
+		Swipe is set for commands whose reply only comes once a card is
+		swiped, their reply is not bound by MSR::SetTimeout.
+	*/
+	template<unsigned char Op, typename ReplyT, size_t Params = 0, bool Swipe = false>
+	struct Command {
+		static constexpr unsigned char Opcode = Op;
+		static constexpr size_t FrameLength = 2 + Params;
+		static constexpr bool WaitsForSwipe = Swipe;
+		typedef ReplyT Reply;
+
+		template<typename... Args>
+		static void Build(unsigned char* frame, Args... args) {
+			static_assert(sizeof...(Args) == Params, "wrong number of command parameters");
+			frame[0] = ESC;
+			frame[1] = Op;
+			Pack(frame + 2, args...);
+		}
+	};
+
+	struct Reset				: Command<0x61, NoReply> {};
+	struct ComTest				: Command<0x65, AckReply<0x79> > {};
+	// NOTE: Will not return a status unless reset or a card is swiped
+	struct SensorTest			: Command<0x86, StatusReply, 0, true> {};
+	struct RAMTest				: Command<0x87, StatusReply> {};
+	// Parameters: [TK1 & TK3] [TK2], space is [leading zero] X25.4 / BPI (75or210) =mm
+	struct SetLeadZero			: Command<0x7A, StatusReply, 2> {};
+	struct CheckLeadZero		: Command<0x6C, LeadZeroReply> {};
+	// Parameter: one of EraseSelect
+	// NOTE: Waits for a card swipe
+	struct EraseCard			: Command<0x63, StatusReply, 1, true> {};
+	// Parameter: one of BPISelect
+	struct SetBPI				: Command<0x62, StatusReply, 1> {};
+	struct GetModel				: Command<0x74, ModelReply> {};
+	struct GetFirmwareVersion	: Command<0x76, VersionReply> {};
+	// Parameters: [TK1] [TK2] [TK3], between 05-08
+	struct SetBPC				: Command<0x6F, BPCReply, 3> {};
+	struct SetHiCo				: Command<0x78, StatusReply> {};
+	struct SetLoCo				: Command<0x79, StatusReply> {};
+	struct GetCoercivity		: Command<0x64, CoercivityReply> {};
+
+	// Parameter: MSR::MSR_LED, mapped onto the per-LED opcodes
+	struct LED {
+		static constexpr size_t FrameLength = 2;
+		static constexpr bool WaitsForSwipe = false;
+		typedef NoReply Reply;
+		// Build only takes values this accepts
+		static constexpr bool Valid(int led) {
+			return led >= 0 && led < (int)sizeof(LEDOpcodes);
+		}
+		static void Build(unsigned char* frame, int led) {
+			frame[0] = ESC;
+			frame[1] = LEDOpcodes[led];
+		}
+	};
+
+	/*
+		Card commands
+
+		Reads answer with a card data block followed by ESC [STATUS]:
+			ESC s ESC 01 [TK1] ESC 02 [TK2] ESC 03 [TK3] ? FS ESC [STATUS]
+		Writes are followed by a card data block and answer with ESC [STATUS].
+		In raw mode every track is prefixed with its length in bytes.
+	*/
+	template<unsigned char Op, bool Raw, typename ReplyT>
+	struct CardCommand : Command<Op, ReplyT, 0, true> {
+		static constexpr bool LengthPrefixed = Raw;
+	};
+	struct ISORead				: CardCommand<0x72, false, NoReply> {};
+	struct RawRead				: CardCommand<0x6D, true, NoReply> {};
+	struct ISOWrite				: CardCommand<0x77, false, StatusReply> {};
+	struct RawWrite				: CardCommand<0x6E, true, StatusReply> {};
+
+	/*! Location of each track inside a card data block */
+	struct CardBlock {
+		int Offset[3];			/*!< Offset of each track's data */
+		int Length[3];			/*!< Length of each track's data, 0 if absent */
+		unsigned char Status;	/*!< Status byte following the block */
+	};
+
+	/*!
+		Parses a card data block response
+
+		\param data The bytes received so far
+		\param len The number of bytes received
+		\param length_prefixed Whether tracks are prefixed with their length (raw mode)
+		\param block Filled in with the track locations on success
+		\return Bytes consumed when complete, 0 if more bytes are needed, -1 if malformed
+	*/
+	int ParseCardBlock(const unsigned char* data, int len, bool length_prefixed, CardBlock& block);
+
+	/*!
+		Builds a card data block for a write
+
+		\param out Output buffer
+		\param out_size Size of the output buffer
+		\param length_prefixed Whether tracks are prefixed with their length (raw mode)
+		\param tracks Data of each track, NULL or 0 length tracks are left out
+		\param lengths Length of each track
+		\return The block length, -1 if it does not fit
+	*/
+	int BuildCardBlock(unsigned char* out, int out_size, bool length_prefixed, const unsigned char* const tracks[3], const int lengths[3]);
+}
+}
@@ -0,0 +1,163 @@
+/*
+	lib605_decode.hpp - Raw track decoding and the offline batch decoder
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "lib605.hpp"
+
+// Longest decoded track kept, sentinels included (ISO track 3 is 107 characters)
+#if !defined(TRACK_MAX_CHARS)
+#define TRACK_MAX_CHARS 128
+#endif
+
+namespace lib605 {
+	/*! \enum lib605::DECODE_STATUS
+		Outcome of decoding a single track
+	*/
+	enum DECODE_STATUS {
+		DECODE_OK,					/*!< Sentinels found, parity and LRC check out */
+		DECODE_EMPTY,				/*!< No data on the track */
+		DECODE_PARITY_ERROR,		/*!< A character failed its parity check */
+		DECODE_LRC_ERROR,			/*!< The LRC character does not match the data */
+		DECODE_MISSING_SENTINEL,	/*!< No start sentinel, or the data ends before the end sentinel */
+		DECODE_UNSUPPORTED,			/*!< The track density has no ISO character set */
+		DECODE_TRUNCATED,			/*!< More than TRACK_MAX_CHARS characters, the rest was dropped */
+		DECODE_STATUS_COUNT
+	};
+
+	/*! \struct lib605::TrackDecode
+		\brief A decoded track, fixed size so it never allocates
+	*/
+	struct TrackDecode {
+		DECODE_STATUS Status;
+		int Length;					/*!< Characters in Data, sentinels included */
+		bool Reversed;				/*!< The card was swiped backwards */
+		char Data[TRACK_MAX_CHARS + 1];	/*!< ISO characters, NUL terminated */
+	};
+
+	/*!
+		Decodes raw track bits into ISO characters
+
+		Bits are taken least significant bit first from each byte, as the
+		reader sends them. Leading zeros are skipped and a backwards swipe is
+		decoded from the other end.
+
+		\param raw The raw track data
+		\param raw_len The length of the raw data
+		\param bits The density of the track, 5 bit (numeric) or 7 bit (alphanumeric)
+		\param out The decoded track
+		\return out.Status
+	*/
+	DECODE_STATUS DecodeRawTrack(const unsigned char* raw, int raw_len, Track::TRACK_BIT_LEN bits, TrackDecode& out);
+
+	/*!
+		Encodes ISO characters into raw track bits, the inverse of DecodeRawTrack
+
+		Every character gets its odd parity bit and the LRC character is
+		added after the last one. The rest of the raw data is zero.
+
+		\param chars The characters, sentinels included
+		\param len The number of characters
+		\param bits The density of the track, 5 bit (numeric) or 7 bit (alphanumeric)
+		\param lead Zero bits ahead of the start sentinel
+		\param reversed Lay the bits out as a backwards swipe reads them
+		\param raw Output buffer
+		\param raw_len Length of the raw data to produce
+		\return false if a character is not in the character set of the density or the track does not fit
+	*/
+	bool EncodeRawTrack(const char* chars, int len, Track::TRACK_BIT_LEN bits, int lead, bool reversed, unsigned char* raw, int raw_len);
+
+	/*! \struct lib605::DecodedRecord
+		\brief One decoded capture record
+	*/
+	struct DecodedRecord {
+		uint64_t Offset;		/*!< Offset of the record in the capture */
+		bool Malformed;			/*!< The record is not a complete raw card data block */
+		unsigned char Status;	/*!< Device status byte stored with the capture */
+		TrackDecode Tracks[3];
+	};
+
+	/*! \struct lib605::BatchSummary
+		\brief Totals over a batch
+	*/
+	struct BatchSummary {
+		size_t Records;
+		size_t Malformed;
+		size_t TrackStatus[3][DECODE_STATUS_COUNT];	/*!< Outcome counts per track */
+	};
+
+	/*! \class lib605::BatchDecoder
+		\brief Decodes archived raw captures across all cores
+
+		A capture is a sequence of records, each a little endian uint32_t
+		length followed by the raw card data block returned by
+		MSR::ReadRAWTrackData (ESC s ... ESC [STATUS]).
+
+		Records are split into fixed size chunks that worker threads claim
+		from a shared counter. Each worker decodes into its own scratch
+		record and keeps its own totals, so nothing is allocated or shared
+		while decoding.
+	*/
+	class BatchDecoder {
+		public:
+			/*! Called with every decoded record, from several threads at once */
+			typedef std::function<void(size_t Index, const DecodedRecord& Record)> Callback;
+		private:
+			// Number of worker threads
+			unsigned Threads;
+			// Records claimed by a worker at a time
+			size_t ChunkSize;
+			// Density of each track
+			Track::TRACK_BIT_LEN TrackBits[3];
+
+			// Locates every record, false if the capture is truncated
+			static bool IndexRecords(const unsigned char* data, size_t len, std::vector<uint64_t>& offsets);
+			// Decodes the records found by IndexRecords, summary must start zeroed
+			void DecodeIndexed(const unsigned char* data, const std::vector<uint64_t>& offsets, const Callback& cb,
+				BatchSummary& summary) const;
+		public:
+			/*!
+				Construct a batch decoder
+
+				\param Threads Worker threads, 0 uses one per core
+				\param ChunkSize Records claimed by a worker at a time
+			*/
+			BatchDecoder(unsigned Threads = 0, size_t ChunkSize = 1024);
+
+			/*! Sets the density of each track, 7, 5 and 5 bit by default */
+			void SetTrackBits(Track::TRACK_BIT_LEN Track1, Track::TRACK_BIT_LEN Track2, Track::TRACK_BIT_LEN Track3);
+
+			/*! Decodes a single record */
+			void DecodeRecord(const unsigned char* block, int len, DecodedRecord& out) const;
+
+			/*!
+				Decodes every record of a capture held in memory
+
+				\param data The capture
+				\param len The length of the capture
+				\param cb Receives each record, may be empty to only gather totals
+				\param summary Totals over the capture
+				\return false if the capture is truncated, nothing is decoded then
+			*/
+			bool Decode(const unsigned char* data, size_t len, const Callback& cb, BatchSummary& summary) const;
+			/*! Decodes a capture held in memory into a vector indexed like the capture */
+			bool Decode(const unsigned char* data, size_t len, std::vector<DecodedRecord>& out, BatchSummary& summary) const;
+
+			/*! Maps a capture file and decodes it */
+			bool DecodeFile(const std::string& Path, const Callback& cb, BatchSummary& summary) const;
+	};
+}
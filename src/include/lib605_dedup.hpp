@@ -0,0 +1,83 @@
+/*
+	lib605_dedup.hpp - Duplicate swipe detection
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+#include "lib605.hpp"
+
+namespace lib605 {
+	/*!
+		Hashes the format and track bytes of a card
+
+		Raw tracks that decode cleanly are hashed as their characters, so
+		swipes of the same card match however the bits were aligned or
+		whichever way it went through. Others are hashed as they were read.
+
+		\param sMagstripe The card
+		\param Key 16 byte key for SipHash-2-4, NULL for a faster unkeyed hash
+	*/
+	uint64_t FingerprintMagstripe(const Magstripe& sMagstripe, const unsigned char* Key = NULL);
+
+	/*! \class lib605::DuplicateFilter
+		\brief Fixed-memory, time-windowed set of recently seen cards
+
+		Only 64 bit fingerprints are kept, so no track data (and no PAN)
+		is held in memory. Lookups probe a bounded run of slots of an open
+		addressing table; expired slots are reused and when the run is full
+		the oldest entry in it is evicted, so memory never grows.
+	*/
+	class DuplicateFilter {
+		private:
+			// Slot of the table, Hash 0 marks an empty slot
+			struct Entry {
+				uint64_t Hash;
+				std::chrono::steady_clock::time_point Seen;
+			};
+			// Power of two sized table
+			std::vector<Entry> Table;
+			// How long a card counts as a repeat
+			std::chrono::steady_clock::duration Window;
+			// SipHash key
+			unsigned char Key[16];
+			bool Keyed;
+		public:
+			/*!
+				Construct a filter
+
+				\param Window Cards seen again within this interval are duplicates
+				\param Capacity Cards remembered at most, rounded up to a power of two
+			*/
+			DuplicateFilter(std::chrono::milliseconds Window, size_t Capacity = 1024);
+
+			/*! Uses SipHash-2-4 with the given 16 byte key from now on, NULL goes back to unkeyed */
+			void SetKey(const unsigned char* Key);
+
+			/*! Fingerprints the card with this filter's hash */
+			uint64_t Fingerprint(const Magstripe& sMagstripe) const;
+
+			/*!
+				Records a sighting of the card
+
+				\return true if it was seen within the window, the window then restarts
+			*/
+			bool Check(const Magstripe& sMagstripe);
+			/*! Records a sighting of a fingerprint at the given time */
+			bool Check(uint64_t Fingerprint, std::chrono::steady_clock::time_point Now);
+
+			/*! Forgets every card */
+			void Clear(void);
+	};
+}
@@ -0,0 +1,55 @@
+/*
+	lib605_discovery.hpp - Serial port enumeration and reader discovery
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Allows one to change how long a port gets to answer the probe at compile time
+#if !defined(DEFAULT_PROBE_TIMEOUT_MS)
+#define DEFAULT_PROBE_TIMEOUT_MS 500
+#endif
+
+namespace lib605 {
+	/*! \struct lib605::DiscoveredDevice
+		\brief A serial port that answered like an MSR605/606
+	*/
+	struct DiscoveredDevice {
+		std::string Path;				/*!< Stable /dev/serial/by-id path when there is one */
+		std::string Node;				/*!< The /dev/tty* node the path resolves to */
+		std::string Model;				/*!< As returned by MSR::GetModel */
+		std::string FirmwareVersion;	/*!< As returned by MSR::GetFirmwareVersion */
+	};
+
+	/*! Resolves the symlinks of a device path to the node it names, empty if it is dangling */
+	std::string ResolveDevicePath(const std::string& Path);
+
+	/*!
+		Lists the serial ports that could hold a reader
+
+		Each port is listed once, by its /dev/serial/by-id name if it has one
+		and by its /dev/ttyUSB* or /dev/ttyACM* node otherwise.
+	*/
+	std::vector<std::string> EnumerateSerialDevices(void);
+
+	/*!
+		Probes every candidate port at once and returns the ones holding a reader
+
+		Each port is sent MSR_COM_TEST and, when it answers, asked for its model
+		and firmware version. Every reply is bounded by the timeout so ports that
+		are not readers cost no more than the slowest reader.
+
+		\param Timeout How long a port gets to answer each probe command
+	*/
+	std::vector<DiscoveredDevice> DiscoverDevices(std::chrono::milliseconds Timeout = std::chrono::milliseconds(DEFAULT_PROBE_TIMEOUT_MS));
+}
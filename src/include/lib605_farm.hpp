@@ -0,0 +1,150 @@
+/*
+	lib605_farm.hpp - Writing card batches across several writers
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "lib605.hpp"
+
+// Most writers a farm drives, each has a bit in the stations a job was tried on
+#define FARM_MAX_STATIONS 64
+
+namespace lib605 {
+	/*! Outcome of one card of a batch */
+	struct WriteResult {
+		size_t Index;			/*!< Position of the card in the batch */
+		bool Written;
+		size_t Station;			/*!< Writer of the last attempt, in the order they were added */
+		unsigned Attempts;		/*!< Writes tried, 0 if the batch was stopped first */
+		unsigned char Status;	/*!< Status byte of the last attempt */
+	};
+
+	/*! Counters of one writer */
+	struct StationStats {
+		uint64_t Written;
+		uint64_t Failed;		/*!< Failed writes, retried elsewhere or not */
+		uint64_t Stolen;		/*!< Cards taken from another writer's queue */
+		bool Retired;			/*!< Stopped after too many failures in a row */
+	};
+
+	/*! Counters of a WriteFarm */
+	struct FarmStats {
+		uint64_t Cards;			/*!< Cards in the batch */
+		uint64_t Written;
+		uint64_t Failed;		/*!< Cards given up on */
+		uint64_t Retries;		/*!< Failed writes handed to another writer */
+		double CardsPerMinute;	/*!< Written over the time the batch has run */
+		std::vector<StationStats> Stations;
+	};
+
+	/*! \class lib605::WriteFarm
+		\brief Writes a batch of cards on several writers at once
+
+		Every writer gets a thread and a queue of its own, and the batch is
+		dealt out to the queues in runs. A writer takes cards from the front
+		of its own queue and, once that is empty, steals from the back of the
+		longest queue of the others, so a slow station does not hold up the
+		end of the batch. A card that fails to write goes to the front of the
+		queue of a writer that has not tried it yet, until it was tried
+		MaxAttempts times. A writer failing FailureLimit writes in a row is
+		retired and its queue handed to the others.
+
+		The queues share one lock, held for a few instructions per card
+		while a write takes as long as a swipe.
+	*/
+	class WriteFarm {
+		public:
+			/*! Called with the outcome of every card, from several threads at once */
+			typedef std::function<void(const WriteResult&)> Callback;
+		private:
+			struct Job {
+				size_t Index;
+				unsigned Attempts;
+				unsigned char Status;
+				size_t Station;
+				uint64_t Tried;		// Bit per station the card failed on
+			};
+			struct Station {
+				MSR* Device;
+				std::deque<Job> Queue;
+				StationStats Stats;
+				unsigned Streak;	// Failed writes in a row
+			};
+
+			unsigned MaxAttempts;
+			unsigned FailureLimit;
+			std::vector<Station> Stations;
+			const std::vector<Magstripe>* Batch;
+			Callback OnResult;
+			CancelToken Stopper;
+
+			std::mutex Lock;
+			std::condition_variable Changed;
+			bool Running;
+			// Cards not written or given up on yet
+			size_t Pending;
+			FarmStats Stats;
+			std::chrono::steady_clock::time_point Started;
+			std::chrono::steady_clock::time_point Finished;
+
+			void Work(size_t Id);
+			// Takes the next card for a station, stealing if its queue is empty
+			bool Take(size_t Id, Job& Out);
+			// Hands a failed card to a station that has not tried it, false if there is none left
+			bool Requeue(const Job& Failed);
+			// Folds the outcome of a write in, cards done with are added to Report
+			void Finish(size_t Id, Job& Done, bool Written, std::vector<WriteResult>& Report);
+			// Retires a station and moves its queue to the others
+			void Retire(size_t Id, std::vector<WriteResult>& Report);
+			static WriteResult MakeResult(const Job& Done, bool Written);
+		public:
+			/*!
+				Construct a farm without writers
+
+				\param MaxAttempts Writes tried per card, each on another writer
+				\param FailureLimit Failed writes in a row a writer is retired after
+			*/
+			WriteFarm(unsigned MaxAttempts = 3, unsigned FailureLimit = 5);
+
+			WriteFarm(const WriteFarm&) = delete;
+			WriteFarm& operator= (const WriteFarm&) = delete;
+
+			/*!
+				Adds a writer, not while a batch runs
+
+				\param Device A connected, initialized writer, not used by anyone else while a batch runs
+				\return false if running or FARM_MAX_STATIONS writers were added already
+			*/
+			bool AddStation(MSR& Device);
+
+			/*!
+				Writes every card of a batch, returns when all were written, given up on or Stop was called
+
+				\param Cards The batch, each card written in its own format
+				\param OnResult Receives the outcome of every card, may be empty
+				\return true if every card was written, false if one was not or no writer was added
+			*/
+			bool Run(const std::vector<Magstripe>& Cards, Callback OnResult = Callback());
+			/*! Stops a running batch from another thread, cards not written yet are reported as such */
+			void Stop(void);
+
+			/*! Returns a snapshot of the counters, of the running or the last batch */
+			FarmStats GetStats(void);
+	};
+}
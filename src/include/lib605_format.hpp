@@ -0,0 +1,42 @@
+/*
+	lib605_format.hpp - Allocation-free text, hex and JSON renderings of card data
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+
+#include "lib605.hpp"
+
+/*
+	Every function renders into the caller's buffer and behaves like
+	snprintf: the output is always NUL terminated when size > 0, and the
+	return value is the length of the full rendering. A return value of
+	size or more means the output was truncated.
+*/
+namespace lib605 {
+	/*! Renders the track data as upper case hex, e.g. "1B3F" */
+	size_t FormatHex(const Track& sTrack, char* buf, size_t size);
+	/*! Renders the track data as ASCII, bytes outside 0x20-0x7E become \xHH */
+	size_t FormatASCII(const Track& sTrack, char* buf, size_t size);
+	/*!
+		Renders the track as a JSON object
+		{"bits":7,"length":N,"data":"..."} or with "hex" in place of "data" when Hex is set
+	*/
+	size_t FormatJSON(const Track& sTrack, bool Hex, char* buf, size_t size);
+
+	/*! Renders the card as the human-readable text written by operator<< */
+	size_t FormatText(const Magstripe& sMagstripe, char* buf, size_t size);
+	/*!
+		Renders the card as a JSON object
+		{"format":"ISO","tracks":[{...},{...},null]}, raw cards carry hex track data
+	*/
+	size_t FormatJSON(const Magstripe& sMagstripe, char* buf, size_t size);
+}
@@ -0,0 +1,107 @@
+/*
+	lib605_health.hpp - Background health probing of idle readers
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "lib605.hpp"
+
+namespace lib605 {
+	/*! Health of a reader as seen by its HealthMonitor */
+	struct HealthStatus {
+		bool Healthy;				/*!< No failure streak and round trips near the baseline */
+		uint64_t Probes;			/*!< Probes sent */
+		uint64_t Failures;			/*!< Probes that went unanswered */
+		uint64_t Skipped;			/*!< Probes skipped because the reader was busy */
+		unsigned FailureStreak;		/*!< Consecutive failed probes */
+		double RoundTripMs;			/*!< Recent round trip, exponentially weighted */
+		double BaselineMs;			/*!< Long term round trip, exponentially weighted */
+		std::chrono::system_clock::time_point LastProbe;	/*!< When the last probe was answered or failed */
+	};
+
+	/*! \class lib605::HealthMonitor
+		\brief Probes a reader with MSR_COM_TEST while it is idle
+
+		A thread calls MSR::ProbeIfIdle every interval, so a probe never
+		delays a command and is never sent while a card read is armed. A
+		busy reader is tried again shortly instead, a disconnected one counts
+		as a failed probe. The callback is called
+		from the monitor's thread when the reader becomes degraded and again
+		when it recovers.
+	*/
+	class HealthMonitor {
+		public:
+			enum HEALTH_EVENT {
+				HEALTH_FAILING,		/*!< FailureLimit probes in a row went unanswered */
+				HEALTH_SLOW,		/*!< Round trips rose to SlowFactor times the baseline */
+				HEALTH_RECOVERED	/*!< Answering at the usual speed again */
+			};
+			typedef std::function<void(HEALTH_EVENT, const HealthStatus&)> Callback;
+		private:
+			MSR& Device;
+			std::chrono::milliseconds Interval;
+			std::chrono::milliseconds Timeout;
+			unsigned FailureLimit;
+			double SlowFactor;
+			Callback OnChange;
+			HealthStatus Status;
+			bool Failing;
+			bool Slow;
+
+			std::thread Worker;
+			std::mutex Lock;
+			std::condition_variable Wakeup;
+			bool Stopping;
+
+			void Loop(void);
+			// Folds a probe into the status, returns the event to raise or -1
+			int Record(MSR::PROBE_RESULT Result, std::chrono::microseconds RoundTrip);
+		public:
+			/*!
+				Construct a monitor, nothing is sent until Start
+
+				\param Device The reader, shared with the thread using it
+				\param Interval Time between probes
+				\param Timeout How long a probe waits for its answer
+			*/
+			HealthMonitor(MSR& Device, std::chrono::milliseconds Interval = std::chrono::milliseconds(5000),
+				std::chrono::milliseconds Timeout = std::chrono::milliseconds(500));
+			// Stops the monitor
+			~HealthMonitor(void);
+
+			HealthMonitor(const HealthMonitor&) = delete;
+			HealthMonitor& operator= (const HealthMonitor&) = delete;
+
+			/*! Sets the function called on degradation and recovery, before Start */
+			void SetCallback(Callback OnChange);
+			/*!
+				Sets when the reader counts as degraded, before Start
+
+				\param FailureLimit Consecutive failed probes, 3 by default
+				\param SlowFactor Recent over long term round trip, 3.0 by default
+			*/
+			void SetThresholds(unsigned FailureLimit, double SlowFactor);
+
+			/*! Starts probing, false if already running */
+			bool Start(void);
+			/*! Stops probing, waits for a probe in flight */
+			void Stop(void);
+
+			/*! Returns a snapshot of the reader's health */
+			HealthStatus GetStatus(void);
+	};
+}
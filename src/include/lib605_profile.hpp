@@ -0,0 +1,48 @@
+/*
+	lib605_profile.hpp - Persistent per-device profiles for warm restarts
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <string>
+
+#include "lib605.hpp"
+
+namespace lib605 {
+	/*!
+		Returns the /dev/serial/by-id path naming the same port as Device
+
+		Device itself is returned when it already is a by-id path or the
+		port has none, e.g. a bare ttyS node.
+	*/
+	std::string StableDevicePath(const std::string& Device);
+
+	/*!
+		Returns the name of the profile file of a device
+
+		The by-id name when there is one, it carries the adapter's serial
+		number, otherwise the device path with '/' replaced by '_'.
+	*/
+	std::string ProfileKey(const std::string& Device);
+
+	/*!
+		Reads a profile saved by SaveProfile
+
+		\return false if there is none, or it is corrupt or from another version of lib605
+	*/
+	bool LoadProfile(const std::string& Dir, const std::string& Key, MSR::Profile& Profile);
+
+	/*!
+		Writes a profile, atomically replacing the previous one
+
+		Dir is created if it is missing, its parent must exist.
+	*/
+	bool SaveProfile(const std::string& Dir, const std::string& Key, const MSR::Profile& Profile);
+}
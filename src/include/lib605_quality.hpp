@@ -0,0 +1,163 @@
+/*
+	lib605_quality.hpp - Per track read quality counters
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "lib605.hpp"
+#include "lib605_decode.hpp"
+
+// First swipes the rolling success rates are taken over, at most 64
+#if !defined(QUALITY_WINDOW)
+#define QUALITY_WINDOW 64
+#endif
+
+// A swipe this soon after a failed one is taken as a retry of the same card
+#if !defined(QUALITY_RESWIPE_MS)
+#define QUALITY_RESWIPE_MS 10000
+#endif
+
+#if QUALITY_WINDOW < 1 || QUALITY_WINDOW > 64
+#error "QUALITY_WINDOW must be between 1 and 64"
+#endif
+
+namespace lib605 {
+	/*! \enum lib605::READ_OUTCOME
+		How a track, or a whole swipe, was read. The first values match DECODE_STATUS
+	*/
+	enum READ_OUTCOME {
+		READ_OK = DECODE_OK,								/*!< Read and checked */
+		READ_EMPTY = DECODE_EMPTY,							/*!< No data on the track */
+		READ_PARITY_ERROR = DECODE_PARITY_ERROR,			/*!< A character failed its parity check */
+		READ_LRC_ERROR = DECODE_LRC_ERROR,					/*!< The LRC character does not match the data */
+		READ_MISSING_SENTINEL = DECODE_MISSING_SENTINEL,	/*!< Start or end sentinel not found */
+		READ_UNSUPPORTED = DECODE_UNSUPPORTED,				/*!< The track density has no ISO character set */
+		READ_TRUNCATED = DECODE_TRUNCATED,					/*!< Longer than TRACK_MAX_CHARS characters */
+		READ_RW_ERROR = DECODE_STATUS_COUNT,				/*!< The device answered MSR_RW_ERROR */
+		READ_FORMAT_ERROR,									/*!< The device answered MSR_CFMT_ERROR */
+		READ_INVALID_SWIPE,									/*!< The device answered MSR_INVALID_SWP */
+		READ_DEVICE_ERROR,									/*!< Any other error status */
+		READ_OUTCOME_COUNT
+	};
+
+	/*! Quality of one track */
+	struct TrackQuality {
+		uint64_t Outcomes[READ_OUTCOME_COUNT];	/*!< Swipes by how this track was read */
+		unsigned Window;						/*!< Recent first swipes carrying this track, up to QUALITY_WINDOW */
+		double FirstSwipeRate;					/*!< Share of those that read this track, 0 while Window is 0 */
+	};
+
+	/*! Snapshot of the read quality of a reader */
+	struct ReadQuality {
+		uint64_t Swipes;						/*!< Card data blocks received */
+		uint64_t Retries;						/*!< Swipes taken as a retry after a failed one */
+		uint64_t Outcomes[READ_OUTCOME_COUNT];	/*!< Swipes by the device error, else the first failed track, else OK or EMPTY */
+		unsigned Window;						/*!< Recent first swipes, up to QUALITY_WINDOW */
+		double FirstSwipeRate;					/*!< Share of those that read, 0 while Window is 0 */
+		TrackQuality Tracks[3];
+	};
+
+	/*!
+		Classifies one track of a card data block
+
+		Raw tracks are decoded and checked. The device has already checked
+		ISO tracks, so they are OK if present once it answered MSR_OK. A track
+		that gave nothing to decode on a failed read counts the device error.
+
+		\param raw Whether the block came from a raw read
+		\param data The track data
+		\param len Its length
+		\param bits The density of the track
+		\param status Status byte of the read
+	*/
+	READ_OUTCOME ClassifyTrack(bool raw, const unsigned char* data, int len, Track::TRACK_BIT_LEN bits, unsigned char status);
+
+	/*! \class lib605::QualityTracker
+		\brief Counts how the swipes of a reader were read
+
+		Every MSR keeps one and feeds it each card it reads; cancelled reads
+		and reads that got no answer are not swipes. A swipe closely
+		following a failed one is counted as a retry, every other swipe is a
+		first swipe. The outcome of the last QUALITY_WINDOW first swipes is
+		kept as a bit mask, so the rolling rates are a popcount.
+
+		Recording a swipe only queues the card, which shares its data with
+		the one handed to the caller. A thread started with the first swipe
+		decodes and counts the queued ones, so neither reads nor snapshots
+		wait on a decode. A snapshot taken right after a read may not count
+		that swipe yet.
+	*/
+	class QualityTracker {
+		private:
+			struct History {
+				uint64_t Bits;		// 1 for a read, newest in bit 0
+				unsigned Count;
+			};
+			struct Swipe {
+				Magstripe Card;
+				unsigned char Status;
+				std::chrono::steady_clock::time_point At;
+				// Filled in by Classify
+				READ_OUTCOME Outcome;
+				READ_OUTCOME Tracks[3];
+			};
+
+			std::mutex Lock;
+			std::condition_variable Wakeup;
+			std::thread Worker;
+			bool Stopping;
+			// Bumped by Reset, a batch classified across it is dropped
+			uint64_t Generation;
+			std::chrono::milliseconds ReswipeWindow;
+			ReadQuality Counts;
+			History Swipes;
+			History Tracks[3];
+			bool LastFailed;
+			std::chrono::steady_clock::time_point LastSwipe;
+			// Swipes recorded but not classified yet
+			std::vector<Swipe> Pending;
+
+			// Takes the pending swipes, classifies them without Lock and counts them
+			void Loop(void);
+			// Classifies the tracks of a swipe and the swipe itself
+			static void Classify(Swipe& swipe);
+			// Counts a classified swipe, with Lock held
+			void Count(const Swipe& swipe);
+			static void Push(History& h, bool ok);
+			static double Rate(const History& h);
+		public:
+			/*! \param ReswipeWindow How soon after a failed swipe the next one counts as a retry */
+			QualityTracker(std::chrono::milliseconds ReswipeWindow = std::chrono::milliseconds(QUALITY_RESWIPE_MS));
+			// Stops the thread, swipes still queued are not counted
+			~QualityTracker(void);
+
+			QualityTracker(const QualityTracker&) = delete;
+			QualityTracker& operator= (const QualityTracker&) = delete;
+
+			/*!
+				Counts a swipe
+
+				\param Card The card as read, its tracks are empty if the device reported an error
+				\param Status Status byte of the read
+			*/
+			void Record(const Magstripe& Card, unsigned char Status);
+			/*! Returns a copy of the counters */
+			ReadQuality Snapshot(void);
+			/*! Clears the counters and the rolling windows */
+			void Reset(void);
+	};
+}
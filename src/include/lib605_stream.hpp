@@ -0,0 +1,98 @@
+/*
+	lib605_stream.hpp - Continuous swipe reading on a background thread
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "lib605.hpp"
+
+namespace lib605 {
+	/*! A card read by a SwipeStream */
+	struct SwipeRecord {
+		uint64_t Sequence;								/*!< Position in the stream, the first swipe is 1 */
+		std::chrono::system_clock::time_point Timestamp;	/*!< When the card data block came in */
+		unsigned char Status;							/*!< Status byte the device ended the read with */
+		Magstripe Card;									/*!< Tracks are empty unless Status is cmd::OK */
+
+		SwipeRecord(void) : Sequence(0), Status(0), Card(Magstripe::ISO) {}
+	};
+
+	/*! \class lib605::SwipeStream
+		\brief Keeps a reader armed and queues every swipe
+
+		A thread runs MSR::ReadCards, which re-arms the read as soon as a
+		card data block is in, and queues the cards. When the queue is full
+		the thread waits for the consumer. Meanwhile the device holds the one
+		swipe the re-armed read captures, and any swipe after that is lost
+		until the consumer makes room, so size Depth for the longest stall.
+
+		The MSR must not be used by anyone else while the stream runs.
+	*/
+	class SwipeStream {
+		private:
+			MSR& Device;
+			Magstripe::CARD_DATA_FORMAT Format;
+			size_t Depth;
+			std::thread Worker;
+			CancelToken Stopper;
+
+			std::mutex Lock;
+			std::condition_variable Readable;
+			std::condition_variable Writable;
+			std::deque<SwipeRecord> Queue;
+			uint64_t Sequence;
+			bool Running;
+			bool Stopping;
+			bool Failed;
+
+			void Loop(void);
+			// Called by the worker for every card, waits for room in the queue
+			bool Push(const Magstripe& Card, unsigned char Status);
+		public:
+			/*!
+				Construct a stream, nothing is read until Start
+
+				\param Device A connected, initialized reader
+				\param Format Format cards are read in
+				\param Depth Swipes queued before the reader is held off, and swipes start being lost
+			*/
+			SwipeStream(MSR& Device, Magstripe::CARD_DATA_FORMAT Format, size_t Depth = 64);
+			// Stops the stream
+			~SwipeStream(void);
+
+			SwipeStream(const SwipeStream&) = delete;
+			SwipeStream& operator= (const SwipeStream&) = delete;
+
+			/*! Starts reading, false if already running */
+			bool Start(void);
+			/*! Stops reading and disarms the reader, queued swipes can still be taken */
+			void Stop(void);
+
+			/*!
+				Takes the next swipe
+
+				\param Record Filled in with the swipe
+				\param Timeout How long to wait, zero waits until a swipe or the stream ends
+				\return false on timeout or once the stream ended and the queue is empty
+			*/
+			bool Next(SwipeRecord& Record, std::chrono::milliseconds Timeout = std::chrono::milliseconds(0));
+
+			/*! Returns whether the stream ended because the device failed */
+			bool HasFailed(void);
+	};
+}
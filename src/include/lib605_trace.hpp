@@ -0,0 +1,96 @@
+/*
+	lib605_trace.hpp - Binary TX/RX trace ring
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Allows one to resize the per-device trace ring at compile time
+#if !defined(TRACE_RING_SIZE)
+#define TRACE_RING_SIZE 65536
+#endif
+
+namespace lib605 {
+	/*! \class lib605::TraceRing
+		\brief Fixed-size in-memory capture of device traffic
+		Every chunk written to or read from the device is stored with a
+		monotonic timestamp. Once the ring is full the oldest records are
+		dropped, so recording never allocates and never blocks.
+
+		Records are kept in the same layout they are dumped in:
+		a RecordHeader followed by Length bytes of payload.
+	*/
+	class TraceRing {
+		public:
+			/*! \enum lib605::TraceRing::DIRECTION
+				Which way the recorded bytes travelled
+			*/
+			enum DIRECTION {
+				TX,	/*!< Bytes sent to the device */
+				RX	/*!< Bytes received from the device */
+			};
+
+			/*! On-disk and in-ring record header (host byte order) */
+			struct RecordHeader {
+				uint64_t Timestamp;	/*!< steady_clock time in nanoseconds */
+				uint16_t Length;	/*!< Payload length following the header */
+				uint8_t Direction;	/*!< A DIRECTION value */
+				uint8_t Reserved;
+				uint32_t Sequence;	/*!< Running record number, exposes drops */
+			};
+
+			/*! Dump file header, followed by the records oldest first */
+			struct FileHeader {
+				char Magic[8];		/*!< "L605TRC" */
+				uint32_t Version;	/*!< Currently 1 */
+				uint32_t Records;	/*!< Number of records in the dump */
+				uint64_t Timestamp;	/*!< steady_clock time of the dump */
+			};
+		private:
+			// Ring storage
+			unsigned char Buffer[TRACE_RING_SIZE];
+			// Offset of the oldest record
+			size_t Head;
+			// Bytes currently in use
+			size_t Used;
+			// Records currently held
+			uint32_t Records;
+			// Next record number
+			uint32_t Sequence;
+
+			// Copies in and out of the ring handling the wrap
+			void Put(size_t offset, const void* data, size_t len) noexcept;
+			void Get(size_t offset, void* data, size_t len) const noexcept;
+		public:
+			/*! Construct an empty ring */
+			TraceRing(void) noexcept;
+
+			/*!
+				Record a chunk of device traffic
+
+				\param dir The direction the bytes travelled
+				\param data The bytes
+				\param len The number of bytes, only the tail is kept if it exceeds the ring
+			*/
+			void Record(DIRECTION dir, const void* data, size_t len) noexcept;
+
+			/*! Drops all records */
+			void Clear(void) noexcept;
+
+			/*! Returns the number of records held */
+			uint32_t GetRecordCount(void) const noexcept;
+
+			/*! Writes the ring to the given file, returns false on any I/O error */
+			bool Dump(const std::string& Path) const;
+	};
+}
@@ -0,0 +1,117 @@
+/*
+	lib605_uring.hpp - io_uring backend for device exchanges
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Submission queue entries of the shared ring
+#if !defined(URING_ENTRIES)
+#define URING_ENTRIES 256
+#endif
+
+namespace lib605 {
+	/*! Outcome of UringEngine::Exchange */
+	struct UringTransfer {
+		int Written;	/*!< Bytes of the frame written */
+		int Received;	/*!< Bytes of the reply read */
+		int Error;		/*!< 0, ETIME on timeout, EAGAIN if nothing was submitted, otherwise an errno */
+	};
+
+	/*! Counters of a UringEngine */
+	struct UringStats {
+		uint64_t Exchanges;		/*!< Exchanges started */
+		uint64_t Requests;		/*!< Submission queue entries queued */
+		uint64_t Syscalls;		/*!< io_uring_enter calls */
+	};
+
+	/*! \class lib605::UringEngine
+		\brief One io_uring shared by every MSR using the IO_URING backend
+
+		An exchange queues the frame write, the reply read linked to it and,
+		when bounded, a timeout linked to the read, then sends them off with
+		the same io_uring_enter call that waits for their completion. One
+		thread at a time waits in the kernel and hands completions of the
+		others back to them, so exchanges running on several devices at once
+		share submissions and wakeups.
+	*/
+	class UringEngine {
+		private:
+			struct Op;
+
+			int RingFd;
+			// Mapped rings, SqMap and CqMap are the same mapping on kernels with a single mmap
+			void* SqMap;
+			size_t SqMapSize;
+			void* CqMap;
+			size_t CqMapSize;
+			void* SqeMap;
+			size_t SqeMapSize;
+			uint32_t* SqHead;
+			uint32_t* SqTail;
+			uint32_t SqMask;
+			uint32_t SqEntries;
+			uint32_t* CqHead;
+			uint32_t* CqTail;
+			uint32_t CqMask;
+			void* Sqes;
+			void* Cqes;
+			// Entries of the chain being queued, past the tail the kernel sees
+			uint32_t Staged;
+
+			std::mutex Lock;
+			// A thread is waiting for completions in io_uring_enter
+			bool Polling;
+			// Exchanges of the other threads, woken when done or to take over polling
+			std::vector<Op*> Sleepers;
+			UringStats Stats;
+
+			UringEngine(void);
+			bool Setup(void);
+			// Submits what is queued, returns the entries the kernel took
+			int Submit(unsigned min_complete);
+			// Makes room for count entries, false if the submission queue stays full
+			bool Reserve(unsigned count);
+			// Fills in one entry of a chain, room must have been reserved
+			void Queue(uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint8_t flags, Op* op, int index);
+			// Moves the tail past the queued chain, the kernel sees all of it or none
+			void Publish(void);
+			// Hands out every completion in the completion queue
+			void Reap(void);
+			// Waits until every entry of op completed, polling for everyone if no one else does
+			void Wait(std::unique_lock<std::mutex>& guard, Op& op);
+		public:
+			// Unmaps the rings and closes the ring
+			~UringEngine(void);
+
+			UringEngine(const UringEngine&) = delete;
+			UringEngine& operator= (const UringEngine&) = delete;
+
+			/*! Returns the engine, created on first use, NULL if io_uring is unavailable */
+			static std::shared_ptr<UringEngine> Shared(void);
+
+			/*!
+				Writes a frame and reads reply_len bytes back
+
+				\param fd Device to exchange with
+				\param Timeout Bounds the reply, zero waits forever
+			*/
+			UringTransfer Exchange(int fd, const unsigned char* frame, int frame_len, unsigned char* reply, int reply_len, std::chrono::milliseconds Timeout);
+
+			/*! Returns a snapshot of the counters */
+			UringStats GetStats(void);
+	};
+}
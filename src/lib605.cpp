@@ -10,6 +10,12 @@
 	SOFTWARE.
 */
 #include "./include/lib605.hpp"
+#include "./include/lib605_decode.hpp"
+#include "./include/lib605_dedup.hpp"
+#include "./include/lib605_format.hpp"
+#include "./include/lib605_profile.hpp"
+#include "./include/lib605_quality.hpp"
+#include "./include/lib605_uring.hpp"
 
  #include <stdint.h>
  #include <stdio.h>
@@ -23,10 +29,14 @@
  #include <ctype.h>
  #include <sys/ioctl.h>
  #include <signal.h>
+ #include <poll.h>
+ #include <time.h>
 
 
+#include <algorithm>
 #include <chrono>
 #include <thread>
+#include <utility>
 
 
 namespace lib605 {
@@ -34,10 +44,10 @@ namespace lib605 {
 /*	====	  START Track CLASS			====	*/
 
 	// Track constructor
-	Track::Track(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
+	Track::Track(const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
 		// Set all of the class members
-		this->TrackData = data;
-		this->TrackDataLength = data_len;
+		if(data != NULL && data_len > 0)
+			this->TrackData.assign(data, data + data_len);
 		this->TrackBitLength = bit_len;
 	}
 
@@ -46,138 +56,363 @@ namespace lib605 {
 	}
 
 	// Return the raw track data
-	unsigned char* Track::GetTrackData(void) {
-		return this->TrackData;
+	const unsigned char* Track::GetTrackData(void) const {
+		return this->TrackData.data();
 	}
 
 	// Return the length of the track data
-	int Track::GetTrackDataLength(void) {
-		return this->TrackDataLength;
+	int Track::GetTrackDataLength(void) const {
+		return (int)this->TrackData.size();
 	}
 
 	// Returns the track BPC
-	Track::TRACK_BIT_LEN Track::GetTrackBitLength(void) {
+	Track::TRACK_BIT_LEN Track::GetTrackBitLength(void) const {
 		return this->TrackBitLength;
 	}
 
 	// Fancy ostream output
-	std::ostream& operator<< (std::ostream &out, Track &sTrack) {
-		out << "Track bit length: ";
+	std::ostream& operator<< (std::ostream &out, const Track &sTrack) {
+		const char* bits = "?";
 		switch(sTrack.GetTrackBitLength()) {
-			case Track::TRACK_5_BIT: {
-				out << "5" << std::endl;
-				break;
-			} case Track::TRACK_7_BIT: {
-				out << "7" << std::endl;
-				break;
-			} case Track::TRACK_8_BIT: {
-				out << "8" << std::endl;
-				break;
-			} default: break;
+			case Track::TRACK_5_BIT: bits = "5"; break;
+			case Track::TRACK_7_BIT: bits = "7"; break;
+			case Track::TRACK_8_BIT: bits = "8"; break;
+			default: break;
 		}
-		out << "Data length: " << sTrack.GetTrackDataLength();
-		return out;
+		return out << "Track bit length: " << bits << '\n' << "Data length: " << sTrack.GetTrackDataLength();
 	}
 
 /*	==== START Magstripe CLASS ====	*/
 
-	// Create a new track
-	// NOTE: Might remove
-	Track* Magstripe::CreateTrack(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
-		return new Track(data, data_len, bit_len);
+	// Replace a track with a new one holding a copy of the data, dropping whatever was cached for it
+	void Magstripe::ReplaceTrack(int n, const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
+		delete this->Tracks[n].exchange(new Track(data, data_len, bit_len));
+		delete this->Decoded[n].exchange(NULL);
+		this->Length[n] = -1;
 	}
 
 	// Constructor
 	Magstripe::Magstripe(Magstripe::CARD_DATA_FORMAT Format) {
 		// Set class members
 		this->Format = Format;
+		this->Duplicate = false;
+		for(int i = 0; i < 3; i++) {
+			this->Tracks[i] = NULL;
+			this->Decoded[i] = NULL;
+			this->Offset[i] = 0;
+			this->Length[i] = -1;
+			this->Bits[i] = Track::TRACK_8_BIT;
+		}
+	}
+
+	// Copy constructor, tracks are deep copied and the data as read is shared
+	Magstripe::Magstripe(const Magstripe& other) {
+		this->Format = other.Format;
+		this->Duplicate = other.Duplicate;
+		this->Response = other.Response;
+		for(int i = 0; i < 3; i++) {
+			Track* track = other.Tracks[i].load(std::memory_order_acquire);
+			TrackDecode* decoded = other.Decoded[i].load(std::memory_order_acquire);
+			this->Tracks[i] = (track != NULL) ? new Track(*track) : NULL;
+			this->Decoded[i] = (decoded != NULL) ? new TrackDecode(*decoded) : NULL;
+			this->Offset[i] = other.Offset[i];
+			this->Length[i] = other.Length[i];
+			this->Bits[i] = other.Bits[i];
+		}
+	}
+
+	Magstripe& Magstripe::operator= (const Magstripe& other) {
+		if(this == &other) return *this;
+		Magstripe copy(other);
+		std::swap(this->Format, copy.Format);
+		std::swap(this->Duplicate, copy.Duplicate);
+		std::swap(this->Response, copy.Response);
+		for(int i = 0; i < 3; i++) {
+			copy.Tracks[i] = this->Tracks[i].exchange(copy.Tracks[i]);
+			copy.Decoded[i] = this->Decoded[i].exchange(copy.Decoded[i]);
+			std::swap(this->Offset[i], copy.Offset[i]);
+			std::swap(this->Length[i], copy.Length[i]);
+			std::swap(this->Bits[i], copy.Bits[i]);
+		}
+		return *this;
 	}
 
 	// Destructor
 	Magstripe::~Magstripe(void) {
 		// Clean up the tracks
-		delete this->Track1;
-		delete this->Track2;
-		delete this->Track3;
+		for(int i = 0; i < 3; i++) {
+			delete this->Tracks[i].load();
+			delete this->Decoded[i].load();
+		}
+	}
+
+	// Copies a track out of the data as read, the first thread to finish wins and the others drop their copy
+	Track* Magstripe::LoadTrack(int n) const {
+		Track* track = this->Tracks[n].load(std::memory_order_acquire);
+		if(track != NULL || this->Length[n] < 0) return track;
+		Track* made = new Track(this->Response->data() + this->Offset[n], this->Length[n], this->Bits[n]);
+		if(this->Tracks[n].compare_exchange_strong(track, made, std::memory_order_acq_rel)) return made;
+		delete made;
+		return track;
+	}
+
+	const TrackDecode* Magstripe::LoadDecoded(int n) const {
+		TrackDecode* decoded = this->Decoded[n].load(std::memory_order_acquire);
+		if(decoded != NULL) return decoded;
+
+		// Straight from the data as read, the track itself is not copied out for it
+		const unsigned char* data;
+		int len;
+		Track::TRACK_BIT_LEN bits;
+		if(!this->PeekTrack(n + 1, data, len, bits)) return NULL;
+
+		TrackDecode* made = new TrackDecode;
+		if(this->Format == Magstripe::RAW) {
+			DecodeRawTrack(data, len, bits, *made);
+		} else {
+			// The reader decoded and checked ISO data already
+			made->Length = std::min(len, TRACK_MAX_CHARS);
+			made->Reversed = false;
+			made->Status = (len == 0) ? DECODE_EMPTY : (len > TRACK_MAX_CHARS) ? DECODE_TRUNCATED : DECODE_OK;
+			memcpy(made->Data, data, made->Length);
+			made->Data[made->Length] = '\0';
+		}
+		if(this->Decoded[n].compare_exchange_strong(decoded, made, std::memory_order_acq_rel)) return made;
+		delete made;
+		return decoded;
 	}
 
 	// Gets the track object
-	Track* Magstripe::GetTrack1(void) {
-		return this->Track1;
+	Track* Magstripe::GetTrack1(void) const {
+		return this->LoadTrack(0);
+	}
+
+	Track* Magstripe::GetTrack2(void) const {
+		return this->LoadTrack(1);
 	}
 
-	Track* Magstripe::GetTrack2(void) {
-		return this->Track2;
+	Track* Magstripe::GetTrack3(void) const {
+		return this->LoadTrack(2);
 	}
 
-	Track* Magstripe::GetTrack3(void) {
-		return this->Track3;
+	bool Magstripe::PeekTrack(int Number, const unsigned char*& data, int& data_len, Track::TRACK_BIT_LEN& bit_len) const {
+		if(Number < 1 || Number > 3) return false;
+		const int n = Number - 1;
+		const Track* track = this->Tracks[n].load(std::memory_order_acquire);
+		if(track != NULL) {
+			data = track->GetTrackData();
+			data_len = track->GetTrackDataLength();
+			bit_len = track->GetTrackBitLength();
+			return true;
+		}
+		if(this->Length[n] < 0) return false;
+		data = this->Response->data() + this->Offset[n];
+		data_len = this->Length[n];
+		bit_len = this->Bits[n];
+		return true;
 	}
 
 	// Sets the track object
-	void Magstripe::SetTrack1(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
-		this->Track1 = this->CreateTrack(data, data_len, bit_len);
+	void Magstripe::SetTrack1(const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
+		this->ReplaceTrack(0, data, data_len, bit_len);
+	}
+
+	void Magstripe::SetTrack2(const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
+		this->ReplaceTrack(1, data, data_len, bit_len);
+	}
+
+	void Magstripe::SetTrack3(const unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
+		this->ReplaceTrack(2, data, data_len, bit_len);
+	}
+
+	// Keeps one copy of the bytes spanning the tracks, in place of a copy per track
+	void Magstripe::SetCardBlock(const unsigned char* data, const cmd::CardBlock& Block, const Track::TRACK_BIT_LEN Bits[3]) {
+		int start = Block.Offset[0], end = Block.Offset[0] + Block.Length[0];
+		for(int i = 1; i < 3; i++) {
+			start = std::min(start, Block.Offset[i]);
+			end = std::max(end, Block.Offset[i] + Block.Length[i]);
+		}
+		this->Response = std::make_shared<const std::vector<unsigned char> >(data + start, data + end);
+		for(int i = 0; i < 3; i++) {
+			delete this->Tracks[i].exchange(NULL);
+			delete this->Decoded[i].exchange(NULL);
+			this->Offset[i] = Block.Offset[i] - start;
+			this->Length[i] = Block.Length[i];
+			this->Bits[i] = Bits[i];
+		}
+	}
+
+	const TrackDecode* Magstripe::GetDecodedTrack1(void) const {
+		return this->LoadDecoded(0);
+	}
+
+	const TrackDecode* Magstripe::GetDecodedTrack2(void) const {
+		return this->LoadDecoded(1);
+	}
+
+	const TrackDecode* Magstripe::GetDecodedTrack3(void) const {
+		return this->LoadDecoded(2);
+	}
+
+	// Track 2 is ;PAN=YYMMSSS...? and track 1 %BPAN^NAME^YYMMSSS...?, only track 1 has the name
+	bool Magstripe::SplitFields(std::string* PAN, std::string* Name, std::string* Expiry, std::string* ServiceCode) const {
+		for(int n = (Name != NULL) ? 0 : 1; n >= 0; n--) {
+			const TrackDecode* decoded = this->LoadDecoded(n);
+			if(decoded == NULL || decoded->Status != DECODE_OK) continue;
+			const char* data = decoded->Data;
+			const char* end = data + decoded->Length;
+			if(data < end && *data == ((n == 0) ? '%' : ';')) data++;
+			if(end > data && end[-1] == '?') end--;
+			if(n == 0 && (data == end || *data++ != 'B')) continue;
+
+			const char* pan_end = std::find(data, end, (n == 0) ? '^' : '=');
+			if(pan_end == end || pan_end == data) continue;
+			const char* rest = pan_end + 1;
+			const char* name = rest;
+			if(n == 0) {
+				rest = std::find(name, end, '^');
+				if(rest == end) continue;
+				rest++;
+			}
+			// Either may have been left out, with the separator kept
+			if((Expiry != NULL && (end - rest < 4 || *rest == '=')) || (ServiceCode != NULL && end - rest < 7)) continue;
+			if(PAN != NULL) PAN->assign(data, pan_end);
+			if(Name != NULL) Name->assign(name, rest - 1);
+			if(Expiry != NULL) Expiry->assign(rest, rest + 4);
+			if(ServiceCode != NULL) ServiceCode->assign(rest + 4, rest + 7);
+			return true;
+		}
+		return false;
 	}
 
-	void Magstripe::SetTrack2(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
-		this->Track2 = this->CreateTrack(data, data_len, bit_len);
+	std::string Magstripe::GetPAN(void) const {
+		std::string PAN;
+		this->SplitFields(&PAN, NULL, NULL, NULL);
+		return PAN;
 	}
 
-	void Magstripe::SetTrack3(unsigned char* data, int data_len, Track::TRACK_BIT_LEN bit_len) {
-		this->Track3 = this->CreateTrack(data, data_len, bit_len);
+	std::string Magstripe::GetName(void) const {
+		std::string Name;
+		this->SplitFields(NULL, &Name, NULL, NULL);
+		return Name;
+	}
+
+	std::string Magstripe::GetExpiry(void) const {
+		std::string Expiry;
+		this->SplitFields(NULL, NULL, &Expiry, NULL);
+		return Expiry;
+	}
+
+	std::string Magstripe::GetServiceCode(void) const {
+		std::string ServiceCode;
+		this->SplitFields(NULL, NULL, NULL, &ServiceCode);
+		return ServiceCode;
 	}
 
 	// Returns the card format
-	Magstripe::CARD_DATA_FORMAT Magstripe::GetCardDataFormat(void) {
+	Magstripe::CARD_DATA_FORMAT Magstripe::GetCardDataFormat(void) const {
 		return this->Format;
 	}
 
-	// Pretty output
-	std::ostream& operator<< (std::ostream &out, Magstripe &sMagstripe) {
-		out << "Card Format: ";
-		switch(sMagstripe.GetCardDataFormat()) {
-			case Magstripe::ISO: {
-				out << "ISO" << std::endl;
-				break;
-			} case Magstripe::RAW: {
-				out << "Raw" << std::endl;
-				break;
-			} default: break;
-		}
-
-		Track* t = sMagstripe.GetTrack1();
-		if(t->GetTrackDataLength() != 0) {
-			out << "\t" << (*t);
-			if(sMagstripe.Format == Magstripe::RAW)
-				out << "\t Track Data: " << std::hex << t->GetTrackData() << std::endl;
-			else
-				out << "\t Track Data:" << t->GetTrackData() << std::endl;
-		} else {
-			out << "Track 1: EMPTY" << std::endl;
+	bool Magstripe::IsDuplicate(void) const {
+		return this->Duplicate;
+	}
+
+	void Magstripe::SetDuplicate(bool Duplicate) {
+		this->Duplicate = Duplicate;
+	}
+
+	// Pretty output, rendered in one go without flushing
+	std::ostream& operator<< (std::ostream &out, const Magstripe &sMagstripe) {
+		char buf[8192];
+		size_t len = FormatText(sMagstripe, buf, sizeof(buf));
+		return out.write(buf, std::min(len, sizeof(buf) - 1));
+	}
+
+/*	==== START cmd HELPERS ====	*/
+
+namespace cmd {
+	int ParseCardBlock(const unsigned char* data, int len, bool length_prefixed, CardBlock& block) {
+		for(int i = 0; i < 3; i++) {
+			block.Offset[i] = 0;
+			block.Length[i] = 0;
 		}
-		t = sMagstripe.GetTrack2();
-		if(t->GetTrackDataLength() != 0) {
-			out << "\t" << (*t);
-			if(sMagstripe.Format == Magstripe::RAW)
-				out << "\t Track Data: " << std::hex << t->GetTrackData() << std::endl;
-			else
-				out << "\t Track Data:" << t->GetTrackData() << std::endl;
-		} else {
-			out << "Track 2: EMPTY" << std::endl;
+		block.Status = 0;
+
+		if(len < 2) return 0;
+		if(data[0] != ESC) return -1;
+		// Errors are reported with a bare status in place of the block
+		if(data[1] != BLOCK_START) {
+			block.Status = data[1];
+			return 2;
 		}
-		t = sMagstripe.GetTrack3();
-		if(t->GetTrackDataLength() != 0) {
-			out << "\t" << (*t);
-			if(sMagstripe.Format == Magstripe::RAW)
-				out << "\t Track Data: " << std::hex << t->GetTrackData() << std::endl;
-			else
-				out << "\t Track Data:" << t->GetTrackData() << std::endl;
-		} else {
-			out << "Track 3: EMPTY" << std::endl;
+
+		int pos = 2;
+		while(true) {
+			if(pos >= len) return 0;
+			// End of block: ? FS ESC [STATUS]
+			if(data[pos] == BLOCK_END) {
+				if(pos + 4 > len) return 0;
+				if(data[pos + 1] != FS || data[pos + 2] != ESC) return -1;
+				block.Status = data[pos + 3];
+				return pos + 4;
+			}
+			if(data[pos] != ESC) return -1;
+			if(pos + 2 > len) return 0;
+			int track = data[pos + 1];
+			if(track < 1 || track > 3) return -1;
+			pos += 2;
+
+			if(length_prefixed) {
+				if(pos + 1 > len) return 0;
+				int track_len = data[pos++];
+				if(pos + track_len > len) return 0;
+				block.Offset[track - 1] = pos;
+				block.Length[track - 1] = track_len;
+				pos += track_len;
+				continue;
+			}
+
+			// ISO data runs up to the next ESC
+			int end = pos;
+			while(end < len && data[end] != ESC) end++;
+			if(end + 1 >= len) return 0;
+			block.Offset[track - 1] = pos;
+			if(data[end + 1] >= 1 && data[end + 1] <= 3) {
+				block.Length[track - 1] = end - pos;
+				pos = end;
+				continue;
+			}
+			// Last track, the data is followed by ? FS ESC [STATUS]
+			if(end - pos < 2 || data[end - 2] != BLOCK_END || data[end - 1] != FS) return -1;
+			block.Length[track - 1] = end - 2 - pos;
+			block.Status = data[end + 1];
+			return end + 2;
 		}
-		return out;
 	}
 
+	int BuildCardBlock(unsigned char* out, int out_size, bool length_prefixed, const unsigned char* const tracks[3], const int lengths[3]) {
+		int pos = 0;
+		if(out_size < 4) return -1;
+		out[pos++] = ESC;
+		out[pos++] = BLOCK_START;
+		for(int i = 0; i < 3; i++) {
+			if(tracks[i] == NULL || lengths[i] <= 0) continue;
+			if(length_prefixed && lengths[i] > 0xFF) return -1;
+			int need = 2 + (length_prefixed ? 1 : 0) + lengths[i];
+			if(pos + need + 2 > out_size) return -1;
+			out[pos++] = ESC;
+			out[pos++] = (unsigned char)(i + 1);
+			if(length_prefixed) out[pos++] = (unsigned char)lengths[i];
+			memcpy(&out[pos], tracks[i], lengths[i]);
+			pos += lengths[i];
+		}
+		out[pos++] = BLOCK_END;
+		out[pos++] = FS;
+		return pos;
+	}
+}
+
 /*	==== START MSR CLASS ====	*/
 
 	// Cycles all the LEDs
@@ -191,19 +426,62 @@ namespace lib605 {
 		this->SetLED(MSR::MSR_LED::LED_OFF);
 	}
 
+	// Dump the trace so failures in the field leave something to look at
+	void MSR::OnCommandFailure(void) {
+		if(this->TraceDumpPath.empty()) return;
+		if(!this->Trace.Dump(this->TraceDumpPath)) {
+#if defined(DEBUG)
+			std::cout << "[*] Error: unable to dump trace to '" << this->TraceDumpPath << "'" << std::endl;
+#endif
+		}
+	}
+
 	// Constructor
-	MSR::MSR(void) noexcept {
-		// Set the initial state
-		this->MSRConected = false;
-		// Give the default device
-		this->Device = DEFAULT_DEV;
+	MSR::MSR(void) noexcept : MSR(DEFAULT_DEV) {
 	}
 
 	// MSR class with the given device, allowing for multiple devices
-	MSR::MSR(std::string Device) noexcept {
-		// Do the same as above but the user gave us the device
+	MSR::MSR(std::string Device, IO_BACKEND Backend) noexcept {
+		// Set the initial state
 		this->MSRConected = false;
 		this->Device = Device;
+		this->LastStatus = 0;
+		this->Timeout = std::chrono::milliseconds(0);
+		// Power on defaults of the device
+		this->TrackBits[0] = Track::TRACK_7_BIT;
+		this->TrackBits[1] = Track::TRACK_5_BIT;
+		this->TrackBits[2] = Track::TRACK_5_BIT;
+		memset(&this->Applied, 0, sizeof(this->Applied));
+		this->AutoReconnect = false;
+		this->LinkDown = false;
+		this->Reconnecting = false;
+		this->ActiveCancel = NULL;
+		this->Cancelled = false;
+		this->ProfileDir = PROFILE_DIR;
+		memset(&this->Known, 0, sizeof(this->Known));
+		this->ProfileActive = false;
+		this->QueuedReset = false;
+		this->QueuedLED = -1;
+		this->Armed = false;
+		this->Quality.reset(new QualityTracker());
+		if(Backend == IO_URING) this->Uring = UringEngine::Shared();
+	}
+
+	MSR::CancelScope::CancelScope(MSR& Owner, CancelToken* Cancel) : Owner(Owner) {
+		this->Previous = Owner.ActiveCancel;
+		if(Cancel != NULL) Owner.ActiveCancel = Cancel;
+		Owner.Cancelled = false;
+	}
+
+	MSR::CancelScope::~CancelScope(void) {
+		// Only the scope that installed the token cleans up after it
+		if(this->Owner.Cancelled && this->Owner.ActiveCancel != this->Previous) {
+			this->Owner.ActiveCancel = NULL;
+			this->Owner.SendReset();
+			// The device may still answer the aborted command
+			this->Owner.DrainInput(std::chrono::milliseconds(20));
+		}
+		this->Owner.ActiveCancel = this->Previous;
 	}
 
 	// Destructor
@@ -219,31 +497,51 @@ namespace lib605 {
 
 	// Connect to the given device
 	bool MSR::Connect(std::string Device) {
+		std::lock_guard<std::recursive_mutex> io(this->IOLock);
 #if defined(DEBUG)
-		std::cout << "[*] Connecting to device '" << Device <<"'" << std::end;
+		std::cout << "[*] Connecting to device '" << Device <<"'" << std::endl;
 #endif
 		if(Device == "") {
 			std::cout << "[*] Null device name, unable to connect" << std::endl;
 			return false;
 		}
 		struct termios options;
-		if((this->devhndl = open(Device.c_str(), O_RDWR | O_NOCTTY)) < 0) {
+		// Open non-blocking so a port waiting on carrier can't stall us, then go back to blocking I/O
+		if((this->devhndl = open(Device.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0) {
 #if defined(DEBUG)
 			std::cout << "[*] Error opening device for use" << std::endl;
 #endif
 			return false;
 		}
-		tcgetattr(this->devhndl, &options);
+		if(tcgetattr(this->devhndl, &options) != 0) {
+#if defined(DEBUG)
+			std::cout << "[*] Error: '" << Device << "' is not a serial device" << std::endl;
+#endif
+			close(this->devhndl);
+			return false;
+		}
+		fcntl(this->devhndl, F_SETFL, fcntl(this->devhndl, F_GETFL) & ~O_NONBLOCK);
 
 		options.c_cflag = CS8 | CREAD | CLOCAL;
 		options.c_oflag = 0;
 		options.c_iflag = 0;
+		options.c_lflag = 0;
+		options.c_cc[VMIN] = 1;
+		options.c_cc[VTIME] = 0;
 
 		cfsetispeed(&options, B9600);
 		cfsetospeed(&options, B9600);
 
 		tcsetattr(this->devhndl, TCSANOW, &options);
 
+		// The profile and its key belong to the previous device, a reconnect to the same path keeps them
+		if(Device != this->Device) {
+			this->ProfileActive = false;
+			this->DeviceKey.clear();
+		}
+		this->Device = Device;
+		this->LinkDown = false;
+		this->Armed = false;
 		return (this->MSRConected = true);
 	}
 
@@ -255,152 +553,226 @@ namespace lib605 {
 			return false;
 		}
 #if defined(DEBUG)
-		std::cout << "[*] Initializing Device" << std::end;
+		std::cout << "[*] Initializing Device" << std::endl;
 #endif
 		this->CycleLED();
 #if defined(DEBUG)
-		std::cout << "[*] Performing self test" << std::end;
+		std::cout << "[*] Performing self test" << std::endl;
 #endif
 		this->SetLED(MSR::MSR_LED::LED_YELLOW);
 		if(this->TestCommunication() && (this->TestRAM() && this->TestSensor())) {
 #if defined(DEBUG)
-		std::cout << "[*] Self test succeeded" << std::end;
+		std::cout << "[*] Self test succeeded" << std::endl;
 #endif
 			this->SetLED(MSR::MSR_LED::LED_GREEN);
 			this->SendReset();
 			return true;
 		} else {
 #if defined(DEBUG)
-		std::cout << "[*] Self test failed, RAM or Sensor Error" << std::end;
+		std::cout << "[*] Self test failed, RAM or Sensor Error" << std::endl;
 #endif
 			this->SetLED(MSR::MSR_LED::LED_RED);
 			return false;
 		}
 	}
 
-	bool MSR::TestCommunication(void) {
+	bool MSR::WarmInitialize(void) {
 		if(!this->MSRConected) {
 #if defined(DEBUG)
-			std::cout << "[*] Unable to test, not connect to device" << std::endl;
+			std::cout << "[*] Unable to initialize, not connect to device" << std::endl;
 #endif
 			return false;
 		}
+		const std::string& key = this->GetDeviceKey();
+		Profile saved;
+		// Setters called from here on must not save over the profile
+		this->ProfileActive = false;
+		if(LoadProfile(this->ProfileDir, key, saved) && saved.SelfTestPassed && this->TestCommunication()) {
+			// Another reader on the same port, or new firmware, gets a cold start
+			cmd::Response<char> model = this->Send<cmd::GetModel>();
+			cmd::Response<cmd::VersionReply::Result> version = this->Send<cmd::GetFirmwareVersion>();
+			bool same = model && version && model.Value == saved.Model[0]
+				&& memcmp(version.Value.data(), saved.FirmwareVersion, version.Value.size()) == 0;
+			// A power cycle resets the settings, coercivity and leading zeros can be read back to tell
+			const Settings& applied = saved.Applied;
+			COERCIVITY co = applied.HasCoercivity ? applied.Coercivity : saved.Coercivity;
+			const unsigned char* lz = applied.HasLeadZero ? applied.LeadZero : saved.LeadZero;
+			bool kept = same && this->GetCoercivity() == co && this->GetLeadZero() == std::make_tuple(lz[0], lz[1]);
+			// BPC and BPI can't be read back, they are sent again either way
+			Settings replay = saved.Applied;
+			if(kept) replay.HasCoercivity = replay.HasLeadZero = false;
+			if(same && this->ApplySettings(replay)) {
 #if defined(DEBUG)
-		std::cout << "[*] Performing communication test" << std::end;
-#endif
-		char resp[2];
-		this->WriteAutoSize(MSR_COM_TEST);
-		if(this->ReadBytes((char*)&resp, 2) != 2) {
-#if defined(DEBUG)
-			std::cout << "[*] Communication self test failed, expected back 2 bytes" << std::endl;
+				std::cout << "[*] Using saved profile '" << key << "'" << (kept ? "" : ", settings replayed") << std::endl;
 #endif
-			return false;
+				// Picked up as if applied through this object, so a reconnect replays them
+				this->Applied = saved.Applied;
+				if(!kept) {
+					saved.Coercivity = this->GetCoercivity();
+					std::tie(saved.LeadZero[0], saved.LeadZero[1]) = this->GetLeadZero();
+					SaveProfile(this->ProfileDir, key, saved);
+				}
+				this->Known = saved;
+				this->ProfileActive = true;
+				return true;
+			}
 		}
-		if(memcmp(resp, (MSR_ESC "\x79"), 2) != 0) {
+
+		bool ok = this->Initialize();
+		Profile fresh;
+		memset(&fresh, 0, sizeof(fresh));
+		// Straight from the device, GetModel would answer from the old profile
+		cmd::Response<char> model = this->Send<cmd::GetModel>();
+		cmd::Response<cmd::VersionReply::Result> version = this->Send<cmd::GetFirmwareVersion>();
+		if(!model || !version) ok = false;
+		fresh.Model[0] = model.Value;
+		memcpy(fresh.FirmwareVersion, version.Value.data(), version.Value.size());
+		fresh.SelfTestPassed = ok;
+		fresh.SelfTestTime = (int64_t)time(NULL);
+		fresh.Coercivity = this->GetCoercivity();
+		std::tie(fresh.LeadZero[0], fresh.LeadZero[1]) = this->GetLeadZero();
+		fresh.Applied = this->Applied;
+		this->Known = fresh;
+		// A failed self test is saved too, so the next run starts cold
+		if(!SaveProfile(this->ProfileDir, key, fresh)) {
 #if defined(DEBUG)
-			std::cout << "[*] Communication self test failed, expected <ESC>\\x79 got other" << std::endl;
+			std::cout << "[*] Error: unable to save profile '" << key << "'" << std::endl;
 #endif
-			return false;
 		}
-		return true;
+		this->ProfileActive = ok;
+		return ok;
 	}
 
-	bool MSR::TestSensor(void) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Unable to test, not connect to device" << std::endl;
-#endif
-			return false;
-		}
-#if defined(DEBUG)
-		std::cout << "[*] Performing sensor test" << std::end;
-#endif
-		char resp[2];
-		this->WriteAutoSize(MSR_SENS_TEST);
-		// The device wont respond unless a reset is issued
-		this->SendReset();
-		if(this->ReadBytes((char*)&resp, 2) != 2) {
+	void MSR::SetProfileDir(std::string Dir) {
+		this->ProfileDir = Dir;
+	}
+
+	MSR::Profile MSR::GetProfile(void) {
+		return this->Known;
+	}
+
+	void MSR::OnSettingsChanged(void) {
+		// Replaying after a reconnect changes nothing worth saving
+		if(!this->ProfileActive || this->Reconnecting) return;
+		this->Known.Applied = this->Applied;
+		if(this->Applied.HasCoercivity) this->Known.Coercivity = this->Applied.Coercivity;
+		if(this->Applied.HasLeadZero) memcpy(this->Known.LeadZero, this->Applied.LeadZero, 2);
+		SaveProfile(this->ProfileDir, this->GetDeviceKey(), this->Known);
+	}
+
+	const std::string& MSR::GetDeviceKey(void) {
+		// Most users never touch profiles, so Connect and discovery probes don't scan for it
+		if(this->DeviceKey.empty()) this->DeviceKey = ProfileKey(this->Device);
+		return this->DeviceKey;
+	}
+
+	bool MSR::TestCommunication(void) {
 #if defined(DEBUG)
-			std::cout << "[*] Sensor self test failed, expected back 2 bytes" << std::endl;
+		std::cout << "[*] Performing communication test" << std::endl;
 #endif
-			return false;
-		}
-		if(memcmp(resp, MSR_OK, 2) != 0) {
+		return (bool)this->Send<cmd::ComTest>();
+	}
+
+	bool MSR::TestSensor(CancelToken* Cancel) {
 #if defined(DEBUG)
-			std::cout << "[*] Sensor self test failed, expected MSR_OK got something else" << std::endl;
+		std::cout << "[*] Performing sensor test" << std::endl;
 #endif
-			return false;
+		if(Cancel != NULL) {
+			CancelScope scope(*this, Cancel);
+			return (bool)this->Send<cmd::SensorTest>();
 		}
-		return true;
+		// The device wont respond unless a reset is issued, so send both in one go
+		unsigned char frame[cmd::SensorTest::FrameLength + cmd::Reset::FrameLength];
+		cmd::SensorTest::Build(frame);
+		cmd::Reset::Build(&frame[cmd::SensorTest::FrameLength]);
+		return (bool)this->Transact<cmd::SensorTest>(frame, (int)sizeof(frame));
 	}
+
 	bool MSR::TestRAM(void) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Unable to test, not connect to device" << std::endl;
-#endif
-			return false;
-		}
-#if defined(DEBUG)
-		std::cout << "[*] Performing RAM test" << std::end;
-#endif
-		char resp[2];
-		this->WriteAutoSize(MSR_RAM_TEST);
-		if(this->ReadBytes((char*)&resp, 2) != 2) {
-#if defined(DEBUG)
-			std::cout << "[*] Ram self test failed, expected back 2 bytes" << std::endl;
-#endif
-			return false;
-		}
-		if(memcmp(resp, MSR_OK, 2) == 0) {
-			return true;
-		}else if (memcmp(resp, MSR_FAIL, 2) == 0) {
-#if defined(DEBUG)
-			std::cout << "[*] RAM self test failed, got MSR_FAIL" << std::endl;
-#endif
-			return false;
-		} else {
 #if defined(DEBUG)
-			std::cout << "[*] RAM self test failed, expected MSR_OK or MSR_FAIL, got other" << std::endl;
+		std::cout << "[*] Performing RAM test" << std::endl;
 #endif
-			return false;
-		}
+		return (bool)this->Send<cmd::RAMTest>();
 	}
 
 	void MSR::SendReset(void) {
+		this->Send<cmd::Reset>();
+		this->Armed = false;
+	}
+
+	MSR::PROBE_RESULT MSR::ProbeIfIdle(std::chrono::milliseconds Timeout, std::chrono::microseconds& RoundTrip) {
+		std::unique_lock<std::recursive_mutex> io(this->IOLock, std::try_to_lock);
+		if(!io.owns_lock() || this->Armed || this->Reconnecting) return PROBE_SKIPPED;
+		// A reader that dropped off and could not be reconnected is the failure to report
 		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Error: Unable to reset non-connected device" << std::endl;
-#endif
-			return;
+			RoundTrip = std::chrono::microseconds(0);
+			return PROBE_FAILED;
 		}
-		this->WriteAutoSize(MSR_RESET);
+		const std::chrono::milliseconds saved_timeout = this->Timeout;
+		this->Timeout = Timeout;
+		auto start = std::chrono::steady_clock::now();
+		bool ok = this->TestCommunication();
+		RoundTrip = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+		this->Timeout = saved_timeout;
+		if(ok) return PROBE_OK;
+		// A reply coming in late would be taken for the answer to the next command,
+		// give it as long again as it had before letting go of the link
+		this->DrainInput(Timeout);
+		return PROBE_FAILED;
 	}
 
 	void MSR::SetLED(MSR_LED LED) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Error: Unable to reset non-connected device" << std::endl;
-#endif
-			return;
-		}
-		switch(LED) {
-			case LED_GREEN: {
-				this->WriteAutoSize(MSR_GREEN_LED_ON);
-				break;
-			} case LED_YELLOW: {
-				this->WriteAutoSize(MSR_YELLOW_LED_ON);
-				break;
-			} case LED_RED: {
-				this->WriteAutoSize(MSR_RED_LED_ON);
-				break;
-			} case LED_ALL: {
-				this->WriteAutoSize(MSR_ALL_LED_ON);
-				break;
-			} case LED_OFF: {
-				this->WriteAutoSize(MSR_ALL_LED_OFF);
-				break;
-			}default: break;
+		// Not an LED state, nothing to send
+		if(!cmd::LED::Valid((int)LED)) return;
+		this->Send<cmd::LED>((int)LED);
+	}
+
+	void MSR::QueueReset(void) {
+		std::lock_guard<std::mutex> guard(this->QueueLock);
+		this->QueuedReset = true;
+	}
+
+	void MSR::QueueLED(MSR_LED LED) {
+		if(!cmd::LED::Valid((int)LED)) return;
+		std::lock_guard<std::mutex> guard(this->QueueLock);
+		this->QueuedLED = (int)LED;
+	}
+
+	bool MSR::Flush(void) {
+		// Never waits out a swipe, what is queued stays for the next call
+		std::unique_lock<std::recursive_mutex> io(this->IOLock, std::try_to_lock);
+		if(!io.owns_lock() || this->Armed) return false;
+		unsigned char frames[cmd::Reset::FrameLength + cmd::LED::FrameLength];
+		int len = 0;
+		{
+			std::lock_guard<std::mutex> guard(this->QueueLock);
+			if(this->QueuedReset) {
+				cmd::Reset::Build(&frames[len]);
+				len += (int)cmd::Reset::FrameLength;
+			}
+			if(this->QueuedLED >= 0) {
+				cmd::LED::Build(&frames[len], this->QueuedLED);
+				len += (int)cmd::LED::FrameLength;
+			}
+			this->QueuedReset = false;
+			this->QueuedLED = -1;
 		}
+		if(len == 0) return true;
+		return this->WriteBytes((const char*)frames, len) == len;
+	}
+
+	bool MSR::HasQueued(void) {
+		std::lock_guard<std::mutex> guard(this->QueueLock);
+		return this->QueuedReset || this->QueuedLED >= 0;
+	}
+
+	void MSR::SetTimeout(std::chrono::milliseconds Timeout) {
+		std::lock_guard<std::recursive_mutex> io(this->IOLock);
+		this->Timeout = Timeout;
+	}
+
+	MSR::IO_BACKEND MSR::GetIOBackend(void) {
+		return this->Uring ? IO_URING : IO_CLASSIC;
 	}
 
 	bool MSR::IsConnected(void) {
@@ -415,69 +787,92 @@ namespace lib605 {
 			return;
 		}
 #if defined(DEBUG)
-		std::cout << "[*] Disconnecting from device" << std::end;
+		std::cout << "[*] Disconnecting from device" << std::endl;
 #endif
+		std::lock_guard<std::recursive_mutex> io(this->IOLock);
 		this->SendReset();
 		close(this->devhndl);
 		this->MSRConected = false;
 	}
 
+	void MSR::SetTraceDumpPath(std::string Path) {
+		this->TraceDumpPath = Path;
+	}
+
+	const TraceRing& MSR::GetTrace(void) {
+		return this->Trace;
+	}
+
+	bool MSR::DumpTrace(std::string Path) {
+		return this->Trace.Dump(Path);
+	}
+
 	std::string MSR::GetModel(void) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Error: unable to get model from non-connected device" << std::endl;
-#endif
-			return "ERROR";
-		}
-		char* model = new char[3];
-		this->WriteAutoSize(MSR_REQ_MODEL);
-		if(this->ReadBytes(model, 3) != 3) {
-#if defined(DEBUG)
-			std::cout << "[*] Error: unable to read model number, expected 3 bytes" << std::endl;
-#endif
-			return "ERROR";
-		}
-		if((memcmp((char*)model[0], MSR_ESC, 1) == 0) && model[2] == 'S') {
-			model[0] = model[1];
-			model[1] = '\0';
-			std::string mdl(model);
-			delete[] model;
-			return mdl;
-		}
-		return "ERROR";
+		if(this->ProfileActive) return this->Known.Model;
+		cmd::Response<char> model = this->Send<cmd::GetModel>();
+		if(!model) return "ERROR";
+		return std::string(1, model.Value);
 	}
 
 	std::string MSR::GetFirmwareVersion(void) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Error: unable to get firmware version from non-connected device" << std::endl;
-#endif
-			return "ERROR";
-		}
-		char* version = new char[9];
-		this->WriteAutoSize(MSR_REQ_FIRM_VER);
-		if(this->ReadBytes(version, 9) == 9) {
+		if(this->ProfileActive) return this->Known.FirmwareVersion;
+		cmd::Response<cmd::VersionReply::Result> version = this->Send<cmd::GetFirmwareVersion>();
+		if(!version) return "ERROR";
+		return std::string(version.Value.data(), version.Value.size());
+	}
+
+	bool MSR::WaitReadable(std::chrono::steady_clock::time_point deadline, bool bounded) {
+		struct pollfd pfd[2];
+		pfd[0].fd = this->devhndl;
+		pfd[0].events = POLLIN;
+		// Wake up on the cancel token as well
+		pfd[1].fd = (this->ActiveCancel != NULL) ? this->ActiveCancel->GetFd() : -1;
+		pfd[1].events = POLLIN;
+		while(true) {
+			int wait_ms = -1;
+			if(bounded) {
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+				if(left.count() <= 0) return false;
+				wait_ms = (int)left.count();
+			}
+			pfd[0].revents = 0;
+			pfd[1].revents = 0;
+			int ready = poll(pfd, 2, wait_ms);
+			if(ready < 0 && errno == EINTR) continue;
+			if(ready == 0) return false;
+			if(ready > 0 && (pfd[1].revents & POLLIN) != 0) {
 #if defined(DEBUG)
-			std::cout << "[*] Error: unable to get firmware version" << std::endl;
+				std::cout << "[*] Operation cancelled" << std::endl;
 #endif
-			return "ERROR";
-		}
-		if(memcmp((char*)version[0], MSR_ESC, 1) == 0) {
-			version[8] = '\0';
-			memmove(version, version+1, strlen(version));
-			std::string ver(version);
-			delete[] version;
-			return ver;
+				this->Cancelled = true;
+				return false;
+			}
+			// Data still queued on a hung up device is worth reading
+			if(ready > 0 && (pfd[0].revents & POLLIN) != 0) return true;
+			this->LinkDown = true;
+			return false;
 		}
-		return "ERROR";
 	}
 
-
-	int MSR::ReadAutoBytes(char* buffer) {
-		return this->ReadBytes(buffer, (sizeof(buffer)/sizeof(char)));
+	void MSR::DrainInput(std::chrono::milliseconds Quiet) {
+		char junk[64];
+		struct pollfd pfd;
+		pfd.fd = this->devhndl;
+		pfd.events = POLLIN;
+		while(this->MSRConected) {
+			pfd.revents = 0;
+			if(poll(&pfd, 1, (int)Quiet.count()) <= 0 || (pfd.revents & POLLIN) == 0) break;
+			int count = read(this->devhndl, junk, sizeof(junk));
+			if(count <= 0) break;
+			this->Trace.Record(TraceRing::RX, junk, count);
+		}
 	}
 
 	int MSR::ReadBytes(char* buffer, int len) {
+		return this->ReadReply(buffer, len, true);
+	}
+
+	int MSR::ReadReply(char* buffer, int len, bool bounded) {
 		if(!this->MSRConected) {
 #if defined(DEBUG)
 			std::cout << "[*] Error: unable to read from non-connected device" << std::endl;
@@ -489,19 +884,51 @@ namespace lib605 {
 
 		if(buffer == NULL) return -1;
 
+		bounded = bounded && (this->Timeout.count() > 0);
+		auto deadline = std::chrono::steady_clock::now() + this->Timeout;
 		while(temp != len) {
+			if(!this->WaitReadable(deadline, bounded)) {
+#if defined(DEBUG)
+				std::cout << "[*] Error: timed out reading from device" << std::endl;
+#endif
+				return -1;
+			}
 			count = read(this->devhndl, (buffer + temp), (len - temp));
-			if(count < 0) return -1;
-			if(count > 0) temp += count;
+			if(count < 0 && errno == EINTR) continue;
+			// Readable but nothing to read means the device went away
+			if(count <= 0) {
+				this->LinkDown = true;
+				return -1;
+			}
+			this->Trace.Record(TraceRing::RX, (buffer + temp), count);
+			temp += count;
 		}
-    	return count;
+		return temp;
 	}
 
-	int MSR::WriteAutoSize(char* buffer) {
-		return this->WriteBytes(buffer, (sizeof(buffer)/sizeof(char)));
+	int MSR::ReadSome(char* buffer, int len) {
+		if(!this->MSRConected) {
+#if defined(DEBUG)
+			std::cout << "[*] Error: unable to read from non-connected device" << std::endl;
+#endif
+			return -1;
+		}
+		if(buffer == NULL || len <= 0) return -1;
+
+		int count;
+		if(!this->WaitReadable(std::chrono::steady_clock::time_point(), false)) return -1;
+		do {
+			count = read(this->devhndl, buffer, len);
+		} while(count < 0 && errno == EINTR);
+		if(count <= 0) {
+			this->LinkDown = true;
+			return -1;
+		}
+		this->Trace.Record(TraceRing::RX, buffer, count);
+		return count;
 	}
 
-	int MSR::WriteBytes(char* buffer, int len) {
+	int MSR::WriteBytes(const char* buffer, int len) {
 		if(!this->MSRConected) {
 #if defined(DEBUG)
 			std::cout << "[*] Error: unable to write to non-connected device" << std::endl;
@@ -509,274 +936,382 @@ namespace lib605 {
 			return -1;
 		}
 		int count = 0;
-		count = write(this->devhndl, buffer, len);
+		do {
+			count = write(this->devhndl, buffer, len);
+		} while(count < 0 && errno == EINTR);
+		if(count > 0) this->Trace.Record(TraceRing::TX, buffer, count);
+		if(count < 0) this->LinkDown = true;
 		return count;
 	}
 
-	bool MSR::SetBPC(char Track1, char Track2, char Track3) {
-		if(!this->MSRConected) {
+	bool MSR::Exchange(const unsigned char* frame, int frame_len, unsigned char* reply, int reply_len, bool swipe) {
+		std::lock_guard<std::recursive_mutex> io(this->IOLock);
+		bool retried = false;
+		while(true) {
+			if(!this->MSRConected) {
 #if defined(DEBUG)
-			std::cout << "[*] Unable to set BPC, not connect to device" << std::endl;
+				std::cout << "[*] Error: unable to send command to non-connected device" << std::endl;
 #endif
-			return false;
+				return false;
+			}
+			// Swipes and cancellable waits stay on the poll path, which watches the cancel token
+			if(this->Uring && !swipe && reply_len > 0 && this->ActiveCancel == NULL) {
+				UringTransfer transfer = this->Uring->Exchange(this->devhndl, frame, frame_len, reply, reply_len, this->Timeout);
+				if(transfer.Written > 0) this->Trace.Record(TraceRing::TX, frame, transfer.Written);
+				if(transfer.Received > 0) this->Trace.Record(TraceRing::RX, reply, transfer.Received);
+				if(transfer.Error == 0) return true;
+				// The ring was full, nothing went out
+				if(transfer.Error == EAGAIN) {
+					if(this->WriteBytes((const char*)frame, frame_len) == frame_len && this->ReadReply((char*)reply, reply_len, true) == reply_len) return true;
+				} else if(transfer.Error != ETIME) {
+					this->LinkDown = true;
+				}
+			} else if(this->WriteBytes((const char*)frame, frame_len) == frame_len &&
+			   (reply_len == 0 || this->ReadReply((char*)reply, reply_len, !swipe) == reply_len)) {
+				// Card reads answer later, through ReadCardBlock
+				if(swipe && reply_len == 0) this->Armed = true;
+				return true;
+			}
+			if(this->Cancelled) return false;
+#if defined(DEBUG)
+			std::cout << "[*] Error: expected back " << reply_len << " bytes" << std::endl;
+#endif
+			this->OnCommandFailure();
+			if(retried || !this->RecoverLink()) return false;
+			retried = true;
 		}
-		char resp[5];
-		char expt[5];
-		char bpc_data[5];
+	}
+
+	bool MSR::RecoverLink(void) {
+		if(!this->AutoReconnect || !this->LinkDown || this->Reconnecting) return false;
+		return this->Reconnect();
+	}
 
-		memcpy(bpc_data, (void*)MSR_SET_BPC, 2);
-		memcpy(&bpc_data[2], (void*)&Track1, 1);
-		memcpy(&bpc_data[3], (void*)&Track2, 1);
-		memcpy(&bpc_data[4], (void*)&Track3, 1);
+	void MSR::SetAutoReconnect(bool Enable) {
+		this->AutoReconnect = Enable;
+	}
 
-		memcpy(bpc_data, expt, 5);
-		memcpy(&expt[0], MSR_OK, 2);
+	MSR::Settings MSR::GetSettings(void) {
+		return this->Applied;
+	}
 
-		this->WriteBytes(bpc_data, 5);
-		if(this->ReadBytes(resp, 5) != 5) {
+	bool MSR::Reconnect(void) {
+		// Waits for an exchange on another thread, the descriptor is closed under it otherwise
+		std::lock_guard<std::recursive_mutex> io(this->IOLock);
+		if(this->Reconnecting) return false;
+		this->Reconnecting = true;
 #if defined(DEBUG)
-			std::cout << "[*] Error: Unable to set BPC, expected 5 bytes" << std::endl;
+		std::cout << "[*] Reconnecting to device '" << this->Device << "'" << std::endl;
 #endif
-			return false;
+		if(this->MSRConected) {
+			close(this->devhndl);
+			this->MSRConected = false;
 		}
 
-		if(memcmp(resp, expt, 5) != 0) {
+		// Replay from a copy, the setters record into Applied as they go
+		const Settings replay = this->Applied;
+		const std::chrono::milliseconds saved_timeout = this->Timeout;
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RECONNECT_BUDGET_MS);
+		std::chrono::milliseconds backoff(10);
+		bool ok = false;
+		while(true) {
+			// Bound every reply by what is left of the budget so a mute device can't hang us
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			this->Timeout = std::max(left, std::chrono::milliseconds(50));
+			if(this->Connect(this->Device) && this->TestCommunication()) {
+				ok = this->ApplySettings(replay);
+				if(ok) break;
+			}
+			if(this->MSRConected) {
+				close(this->devhndl);
+				this->MSRConected = false;
+			}
+			if(std::chrono::steady_clock::now() + backoff >= deadline) break;
+			std::this_thread::sleep_for(backoff);
+			backoff = std::min(backoff * 2, std::chrono::milliseconds(200));
+		}
+		this->Timeout = saved_timeout;
+		this->Reconnecting = false;
 #if defined(DEBUG)
-			std::cout << "[*] Error: Unable to set BPC, unexpected response" << std::endl;
+		if(!ok) std::cout << "[*] Error: unable to reconnect to device" << std::endl;
 #endif
-			return false;
-		}
-
-		return true;
+		return ok;
+	}
 
+	bool MSR::ApplySettings(const Settings& replay) {
+		bool ok = true;
+		if(replay.HasCoercivity) ok = ok && this->SetCoercivity(replay.Coercivity);
+		for(int i = 0; i < 3; i++)
+			if(replay.HasBPI[i]) ok = ok && this->SetBPI(i + 1, replay.BPI[i]);
+		if(replay.HasBPC) ok = ok && this->SetBPC(replay.BPC[0], replay.BPC[1], replay.BPC[2]);
+		if(replay.HasLeadZero) ok = ok && this->SetLeadingZero(replay.LeadZero[0], replay.LeadZero[1]);
+		return ok;
 	}
 
-	bool MSR::SetBPI(int track, Track::TRACK_BPI TrackBPI) {
-		if(!this->MSRConected) {
+	bool MSR::SetBPC(char Track1, char Track2, char Track3) {
+		cmd::Response<cmd::BPCReply::Result> resp = this->Send<cmd::SetBPC>(Track1, Track2, Track3);
+		if(!resp) return false;
+		// The device echoes back what it applied
+		if(resp.Value[0] != (unsigned char)Track1 || resp.Value[1] != (unsigned char)Track2 || resp.Value[2] != (unsigned char)Track3) {
 #if defined(DEBUG)
-			std::cout << "[*] Unable to set BPI, not connect to device" << std::endl;
+			std::cout << "[*] Error: Unable to set BPC, unexpected response" << std::endl;
 #endif
+			this->OnCommandFailure();
 			return false;
 		}
-		char resp[2];
-		switch(track) {
-			case 1: {
-				switch(TrackBPI){
-					case Track::BPI_210: {
-						this->WriteAutoSize(MSR_SB_TRACK1_210);
-						break;
-					} case Track::BPI_75: {
-						this->WriteAutoSize(MSR_SB_TRACK1_75);
-						break;
-					} default: break;
-				}
-				break;
-			} case 2: {
-				switch(TrackBPI){
-					case Track::BPI_210: {
-						this->WriteAutoSize(MSR_SB_TRACK2_210);
-						break;
-					} case Track::BPI_75: {
-						this->WriteAutoSize(MSR_SB_TRACK2_75);
-						break;
-					} default: break;
-				}
-				break;
-			} case 3: {
-				switch(TrackBPI){
-					case Track::BPI_210: {
-						this->WriteAutoSize(MSR_SB_TRACK3_210);
-						break;
-					} case Track::BPI_75: {
-						this->WriteAutoSize(MSR_SB_TRACK3_75);
-						break;
-					} default: break;
-				}
-				break;
-			} default: break;
-		}
-		// Check Response
-		if(this->ReadBytes((char*)&resp, 2) != 2) {
-#if defined(DEBUG)
-			std::cout << "[*] Set BPI failed, expected back 2 bytes" << std::endl;
-#endif
-			return false;
+		const char bpc[3] = { Track1, Track2, Track3 };
+		this->Applied.HasBPC = true;
+		memcpy(this->Applied.BPC, bpc, 3);
+		this->SetTrackBits(bpc);
+		this->OnSettingsChanged();
+		return true;
+	}
+
+	void MSR::SetTrackBits(const char* bpc) {
+		for(int i = 0; i < 3; i++) {
+			if(bpc[i] <= 5)
+				this->TrackBits[i] = Track::TRACK_5_BIT;
+			else if(bpc[i] <= 7)
+				this->TrackBits[i] = Track::TRACK_7_BIT;
+			else
+				this->TrackBits[i] = Track::TRACK_8_BIT;
 		}
-		if(memcmp(resp, MSR_OK, 2) == 0) {
-			return true;
-		}else if (memcmp(resp, MSR_FAIL, 2) == 0) {
-#if defined(DEBUG)
-			std::cout << "[*] Set BPI failed, got MSR_FAIL" << std::endl;
-#endif
-			return false;
-		} else {
+	}
+
+	bool MSR::SetBPI(int track, Track::TRACK_BPI TrackBPI) {
+		if(track < 1 || track > 3 || (TrackBPI != Track::BPI_210 && TrackBPI != Track::BPI_75)) {
 #if defined(DEBUG)
-			std::cout << "[*] Set BPI failed, expected MSR_OK or MSR_FAIL, got other" << std::endl;
+			std::cout << "[*] Set BPI failed, no such track or density" << std::endl;
 #endif
 			return false;
 		}
-		return false;
+		if(!this->Send<cmd::SetBPI>(cmd::BPISelect[track - 1][TrackBPI])) return false;
+		this->Applied.HasBPI[track - 1] = true;
+		this->Applied.BPI[track - 1] = TrackBPI;
+		this->OnSettingsChanged();
+		return true;
 	}
 
 	bool MSR::SetCoercivity(COERCIVITY co) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Unable to set Coercivity, not connect to device" << std::endl;
-#endif
-			return false;
-		}
-		char resp[2];
+		bool ok;
 		switch(co) {
-			case HI_CO: {
-				this->WriteAutoSize(MSR_SET_HI_CO);
-				break;
-			} case LO_CO: {
-				this->WriteAutoSize(MSR_SET_LO_CO);
-				break;
-			} default: break;
-		}
-		if(this->ReadBytes(resp, 2) != 2) {
-#if defined(DEBUG)
-			std::cout << "[*] Error: Unable to set Coercivity, expected 2 bytes" << std::endl;
-#endif
-			return false;
+			case HI_CO: ok = (bool)this->Send<cmd::SetHiCo>(); break;
+			case LO_CO: ok = (bool)this->Send<cmd::SetLoCo>(); break;
+			default: return false;
 		}
-		if(memcmp(resp, MSR_OK, 2) == 0) {
-			return true;
+		if(ok) {
+			this->Applied.HasCoercivity = true;
+			this->Applied.Coercivity = co;
+			this->OnSettingsChanged();
 		}
-		return false;
+		return ok;
 	}
 
 	MSR::COERCIVITY MSR::GetCoercivity(void) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Unable to get Coercivity, not connect to device" << std::endl;
-#endif
-			return MSR::COERCIVITY::ERR;
-		}
-		char resp[2];
-		this->WriteAutoSize(MSR_GET_CO_STAT);
-		if(this->ReadBytes(resp, 2) != 2) {
-#if defined(DEBUG)
-			std::cout << "[*] Error: Unable to get Coercivity, expected 2 bytes" << std::endl;
-#endif
-			return MSR::COERCIVITY::ERR;
-		}
-		if(memcmp(resp, MSR_ESC "H", 2) == 0) {
-			return MSR::COERCIVITY::HI_CO;
-		} else if(memcmp(resp, MSR_ESC "L", 2) == 0) {
-			return MSR::COERCIVITY::LO_CO;
-		} else {
-#if defined(DEBUG)
-			std::cout << "[*] Error: Unable to get Coercivity, unexpected value" << std::endl;
-#endif
-			return MSR::COERCIVITY::ERR;
-		}
+		cmd::Response<char> co = this->Send<cmd::GetCoercivity>();
+		if(!co) return MSR::COERCIVITY::ERR;
+		return (co.Value == 'H') ? MSR::COERCIVITY::HI_CO : MSR::COERCIVITY::LO_CO;
 	}
 
 	bool MSR::SetLeadingZero(unsigned char Track1_3, unsigned char Track2) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Unable to Set leading zero, not connect to device" << std::endl;
-#endif
-			return false;
-		}
-		char resp[2];
-		char zero_dat[4];
+		if(!this->Send<cmd::SetLeadZero>(Track1_3, Track2)) return false;
+		this->Applied.HasLeadZero = true;
+		this->Applied.LeadZero[0] = Track1_3;
+		this->Applied.LeadZero[1] = Track2;
+		this->OnSettingsChanged();
+		return true;
+	}
 
-		memcpy(zero_dat, (void*)MSR_SET_LEAD_ZERO, 2);
-		memcpy(&zero_dat[2], (void*)&Track1_3, 1);
-		memcpy(&zero_dat[3], (void*)&Track2, 1);
+	std::tuple<unsigned char, unsigned char> MSR::GetLeadZero(void) {
+		cmd::Response<cmd::LeadZeroReply::Result> lz = this->Send<cmd::CheckLeadZero>();
+		if(!lz) return std::make_tuple(0x00, 0x00);
+		return std::make_tuple(lz.Value[0], lz.Value[1]);
+	}
+
+	// CALL A RESET AFTER USING!!!!
+	bool MSR::EraseCard(MSR::TRACK track, CancelToken* Cancel) {
+		if(track < TRACK_1 || track > TRACK_1_2_3) return false;
+		CancelScope scope(*this, Cancel);
+		cmd::Response<unsigned char> resp = this->Send<cmd::EraseCard>(cmd::EraseSelect[track]);
+		this->LastStatus = resp.Value;
+		return (bool)resp;
+	}
 
-		this->WriteBytes(zero_dat, 4);
-		if(this->ReadBytes(resp, 2) != 2) {
+	int MSR::ReadCardBlock(unsigned char* buffer, int buffer_size, bool length_prefixed, cmd::CardBlock& block) {
+		std::lock_guard<std::recursive_mutex> io(this->IOLock);
+		// Answered, cancelled or failed, the read is over either way
+		struct Disarm {
+			std::atomic<bool>& Armed;
+			~Disarm(void) { this->Armed = false; }
+		} disarm = { this->Armed };
+		int len = 0;
+		while(len < buffer_size) {
+			int count = this->ReadSome((char*)&buffer[len], buffer_size - len);
+			if(count < 0) break;
+			len += count;
+			int done = cmd::ParseCardBlock(buffer, len, length_prefixed, block);
+			if(done < 0) break;
+			if(done > 0) {
+				this->LastStatus = block.Status;
+				if(block.Status != cmd::OK) this->OnCommandFailure();
+				return done;
+			}
+		}
+		if(this->Cancelled) return -1;
 #if defined(DEBUG)
-			std::cout << "[*] Error: Unable to set leading zero, expected 2 bytes" << std::endl;
+		std::cout << "[*] Error: Unable to read card data block" << std::endl;
 #endif
-			return false;
-		}
-		if(memcmp(resp, MSR_OK, 2) == 0) {
-			return true;
+		this->OnCommandFailure();
+		return -1;
+	}
+
+	int MSR::ReadISOTrackData(unsigned char* buffer, int buffer_size, cmd::CardBlock& block) {
+		return this->ReadCardCommand<cmd::ISORead>(buffer, buffer_size, block);
+	}
+
+	int MSR::ReadRAWTrackData(unsigned char* buffer, int buffer_size, cmd::CardBlock& block) {
+		return this->ReadCardCommand<cmd::RawRead>(buffer, buffer_size, block);
+	}
+
+	Magstripe MSR::ReadCard(Magstripe::CARD_DATA_FORMAT Format, CancelToken* Cancel) {
+		CancelScope scope(*this, Cancel);
+		Magstripe ms(Format);
+		unsigned char buffer[1024];
+		cmd::CardBlock block;
+		int len = (Format == Magstripe::RAW)
+			? this->ReadRAWTrackData(buffer, sizeof(buffer), block)
+			: this->ReadISOTrackData(buffer, sizeof(buffer), block);
+		this->LastStatus = (len < 0) ? cmd::FAIL : block.Status;
+		if(len < 0) {
+			ms.SetTrack1(NULL, 0, this->TrackBits[0]);
+			ms.SetTrack2(NULL, 0, this->TrackBits[1]);
+			ms.SetTrack3(NULL, 0, this->TrackBits[2]);
+			return ms;
 		}
-		return false;
+		ms = this->MakeCard(Format, buffer, block);
+		this->Quality->Record(ms, block.Status);
+		return ms;
 	}
 
-	std::tuple<unsigned char, unsigned char> MSR::GetLeadZero(void) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Unable to get leading zero, not connect to device" << std::endl;
-#endif
-			return std::make_tuple(0x00, 0x00);
+	Magstripe MSR::MakeCard(Magstripe::CARD_DATA_FORMAT Format, const unsigned char* buffer, const cmd::CardBlock& block) {
+		Magstripe ms(Format);
+		if(block.Status != cmd::OK) {
+			ms.SetTrack1(NULL, 0, this->TrackBits[0]);
+			ms.SetTrack2(NULL, 0, this->TrackBits[1]);
+			ms.SetTrack3(NULL, 0, this->TrackBits[2]);
+			return ms;
 		}
-		char resp[3];
-		this->WriteAutoSize(MSR_CHECK_LEAD_ZERO);
-		if(this->ReadBytes(resp, 3) != 3) {
-#if defined(DEBUG)
-			std::cout << "[*] Unable to get leading zero, expected 3 bytes" << std::endl;
-#endif
-			return std::make_tuple(0x00, 0x00);
+		ms.SetCardBlock(buffer, block, this->TrackBits);
+		if(this->Duplicates && (block.Length[0] > 0 || block.Length[1] > 0 || block.Length[2] > 0))
+			ms.SetDuplicate(this->Duplicates->Check(ms));
+		return ms;
+	}
+
+	bool MSR::ReadCards(Magstripe::CARD_DATA_FORMAT Format, std::function<bool(const Magstripe&, unsigned char)> Handler, CancelToken* Cancel) {
+		CancelScope scope(*this, Cancel);
+		if(Format == Magstripe::RAW)
+			return this->StreamCardCommand<cmd::RawRead>(Format, Handler);
+		return this->StreamCardCommand<cmd::ISORead>(Format, Handler);
+	}
+
+	template<typename C>
+	bool MSR::StreamCardCommand(Magstripe::CARD_DATA_FORMAT Format, const std::function<bool(const Magstripe&, unsigned char)>& Handler) {
+		unsigned char buffer[1024];
+		cmd::CardBlock block;
+		bool armed = (bool)this->Send<C>();
+		while(true) {
+			if(!armed) return this->Cancelled;
+			int len;
+			{
+				// Nothing gets in between the card and the next read
+				std::lock_guard<std::recursive_mutex> io(this->IOLock);
+				len = this->ReadCardBlock(buffer, sizeof(buffer), C::LengthPrefixed, block);
+				// Arm the next read first, the device only buffers the swipe once it is armed.
+				// Queued LED changes go out on the way, the only time no read is armed
+				if(len >= 0) {
+					this->Flush();
+					armed = (bool)this->Send<C>();
+				}
+			}
+			if(len < 0) {
+				if(this->Cancelled) return true;
+				// Re-arm on the reopened device, the swipe is still to come
+				if(!this->RecoverLink()) return false;
+				armed = (bool)this->Send<C>();
+				continue;
+			}
+			Magstripe card = this->MakeCard(Format, buffer, block);
+			bool more = Handler(card, block.Status);
+			// Counted once the card is handed over, with whatever the handler decoded
+			this->Quality->Record(card, block.Status);
+			if(!more) break;
+			if(!armed && !this->Cancelled && this->RecoverLink()) armed = (bool)this->Send<C>();
 		}
-		return std::make_tuple(resp[1], resp[2]);
+		// Disarm the read queued for the next card
+		this->SendReset();
+		this->DrainInput(std::chrono::milliseconds(20));
+		return true;
 	}
 
-	// CALL A RESET AFTER USING!!!!
-	bool MSR::EraseCard(MSR::TRACK track) {
-		if(!this->MSRConected) {
-#if defined(DEBUG)
-			std::cout << "[*] Unable to set erase mode, not connect to device" << std::endl;
-#endif
-			return false;
+	bool MSR::WriteCard(const Magstripe& Card, CancelToken* Cancel) {
+		CancelScope scope(*this, Cancel);
+		const unsigned char* data[3];
+		int lengths[3];
+		for(int i = 0; i < 3; i++) {
+			Track::TRACK_BIT_LEN bits;
+			if(!Card.PeekTrack(i + 1, data[i], lengths[i], bits)) {
+				data[i] = NULL;
+				lengths[i] = 0;
+			}
 		}
-		char resp[2];
-		char erase_dat[3];
-
-		memcpy(erase_dat, MSR_ERASE_CARD, 2);
-		switch(track) {
-			case MSR::TRACK::TRACK_1: {
-				memcpy(&erase_dat[2], MSR_EC_TRACK1, 1);
-				break;
-			} case MSR::TRACK::TRACK_2: {
-				memcpy(&erase_dat[2], MSR_EC_TRACK2, 1);
-				break;
-			} case MSR::TRACK::TRACK_3: {
-				memcpy(&erase_dat[2], MSR_EC_TRACK3, 1);
-				break;
-			} case MSR::TRACK::TRACK_1_2: {
-				memcpy(&erase_dat[2], MSR_EC_TRACK1_2, 1);
-				break;
-			} case MSR::TRACK::TRACK_1_3: {
-				memcpy(&erase_dat[2], MSR_EC_TRACK1_3, 1);
-				break;
-			} case MSR::TRACK::TRACK_2_3: {
-				memcpy(&erase_dat[2], MSR_EC_TRACK2_3, 1);
-				break;
-			} case MSR::TRACK::TRACK_1_2_3: {
-				memcpy(&erase_dat[2], MSR_EC_TRACK1_2_3, 1);
-				break;
-			} default: break;
-		}
-		this->WriteBytes(erase_dat, 3);
-		if(this->ReadBytes(resp, 2) != 2) {
+
+		unsigned char frame[1024];
+		bool raw = (Card.GetCardDataFormat() == Magstripe::RAW);
+		int len = cmd::BuildCardBlock(&frame[2], sizeof(frame) - 2, raw, data, lengths);
+		if(len < 0) {
 #if defined(DEBUG)
-			std::cout << "[*] Error: Unable to set erase, expected 2 bytes" << std::endl;
+			std::cout << "[*] Error: Unable to write card, track data too long" << std::endl;
 #endif
 			return false;
 		}
-		if(memcmp(resp, MSR_OK, 2) == 0) {
-			return true;
+
+		cmd::Response<unsigned char> resp;
+		if(raw) {
+			cmd::RawWrite::Build(frame);
+			resp = this->Transact<cmd::RawWrite>(frame, len + 2);
+		} else {
+			cmd::ISOWrite::Build(frame);
+			resp = this->Transact<cmd::ISOWrite>(frame, len + 2);
 		}
-		return false;
+		this->LastStatus = resp.Value;
+		return (bool)resp;
 	}
-	Magstripe MSR::ReadCard(Magstripe::CARD_DATA_FORMAT Format) {
-		Magstripe ms(Format);
+
+	void MSR::EnableDuplicateDetection(std::chrono::milliseconds Window, size_t Capacity) {
+		this->Duplicates.reset(new DuplicateFilter(Window, Capacity));
 	}
 
-	bool MSR::ReadISOTrackData(unsigned char* buffer, int buffer_size, Track::TRACK_BIT_LEN trackFmt) {
+	void MSR::DisableDuplicateDetection(void) {
+		this->Duplicates.reset();
+	}
 
+	DuplicateFilter* MSR::GetDuplicateFilter(void) {
+		return this->Duplicates.get();
 	}
 
-	bool MSR::ReadRAWTrackData(unsigned char* buffer, int buffer_size, Track::TRACK_BIT_LEN trackFmt) {
+	bool MSR::WasCancelled(void) {
+		return this->Cancelled;
+	}
+
+	unsigned char MSR::GetLastStatus(void) {
+		return this->LastStatus;
+	}
 
+	ReadQuality MSR::GetReadQuality(void) {
+		return this->Quality->Snapshot();
 	}
 
+	void MSR::ResetReadQuality(void) {
+		this->Quality->Reset();
+	}
 }
@@ -0,0 +1,823 @@
+/*
+	lib605_archive.cpp - Compressed archives of captured swipes
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_archive.hpp"
+#include "./include/lib605_decode.hpp"
+#include "./include/lib605_dedup.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
+namespace lib605 {
+
+	/*
+		Archive layout
+
+		An ArchiveHeader, the blocks, one ArchiveBlock per block from an 8
+		byte boundary on, and an ArchiveFooter. A block is a BlockHeader
+		followed by its columns: META runs of (count, shape, status), DEVICE
+		runs of (count, device), TIME deltas, then FRAME, CHARS and LITERAL
+		of each track. Integers in columns are LEB128 varints, signed ones
+		zigzag coded.
+
+		The shape of a record holds its format in bit 0, the density of
+		each track in bits 1 to 6 and how each track is kept in bits 7 to 15.
+		A FRAME entry of a track kept as text names what it is coded
+		against: 0 for nothing, 1 for track 2 as rebuilt from track 1 of the
+		same record, otherwise the distance back to an earlier record plus
+		one. The prefix and suffix taken from it follow, then the characters
+		in between, and for a raw track its length and the leading zero bits
+		times two plus one if reversed.
+	*/
+	struct ArchiveHeader {
+		char Magic[8];		// "L605ARC"
+		uint32_t Version;
+		uint32_t Reserved;
+	};
+
+	struct ArchiveBlock {
+		uint64_t Offset;
+		uint64_t First;		// Number of its first record
+		int64_t MinTime;	// Nanoseconds since the epoch
+		int64_t MaxTime;
+		uint32_t Length;
+		uint32_t Records;
+		uint32_t Checksum;	// FNV-1a of the block
+		uint32_t Reserved;
+	};
+
+	struct ArchiveFooter {
+		uint64_t IndexOffset;
+		uint64_t Blocks;
+		uint64_t Records;
+		uint32_t Checksum;	// FNV-1a of the index
+		uint32_t Version;
+		char Magic[8];		// "L605END"
+	};
+
+	enum ARCHIVE_COLUMN {
+		COLUMN_META,
+		COLUMN_DEVICE,
+		COLUMN_TIME,
+		COLUMN_TRACKS,		// FRAME, CHARS and LITERAL of each track
+		COLUMN_COUNT = COLUMN_TRACKS + 9
+	};
+
+	struct BlockHeader {
+		uint32_t Records;
+		uint8_t Width[3];	// Bits per character in CHARS of each track
+		uint8_t Reserved;
+		int64_t FirstTime;	// Timestamps are deltas from here
+		uint32_t Length[COLUMN_COUNT];
+	};
+
+	// How a track of a record is kept
+	enum TRACK_KIND {
+		KIND_ABSENT,		// Never set
+		KIND_EMPTY,			// Set without data
+		KIND_TEXT,			// Its characters
+		KIND_SYMBOLIC,		// A raw track kept as the characters it decodes to
+		KIND_LITERAL		// A raw track kept as is
+	};
+
+	static const uint32_t ArchiveVersion = 1;
+	// Characters looked up to find a record to code a track against: the sentinel and
+	// issuer number, and enough to tell cards apart by their account number
+	static const size_t KeyChars[2] = { 7, 18 };
+	// Bounds what a damaged block can make the reader allocate
+	static const uint64_t MaxTrackBytes = 65536;
+
+	static int ColumnOf(int Track, int Part) {
+		return COLUMN_TRACKS + Track * 3 + Part;
+	}
+
+	static uint32_t Checksum(const unsigned char* data, size_t len) {
+		uint32_t h = 2166136261u;
+		for(size_t i = 0; i < len; i++) {
+			h ^= data[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	static int64_t ToNanoseconds(std::chrono::system_clock::time_point Time) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Time.time_since_epoch()).count();
+	}
+
+	static std::chrono::system_clock::time_point FromNanoseconds(int64_t Time) {
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(Time)));
+	}
+
+	static bool WriteAll(int fd, const void* data, size_t len) {
+		const char* p = (const char*)data;
+		while(len > 0) {
+			ssize_t count = write(fd, p, len);
+			if(count < 0 && errno == EINTR) continue;
+			if(count <= 0) return false;
+			p += count;
+			len -= count;
+		}
+		return true;
+	}
+
+	static void SetTrack(Magstripe& Card, int t, const unsigned char* data, int len, Track::TRACK_BIT_LEN bits) {
+		if(t == 0) Card.SetTrack1(data, len, bits);
+		if(t == 1) Card.SetTrack2(data, len, bits);
+		if(t == 2) Card.SetTrack3(data, len, bits);
+	}
+
+	// Track 2 as ISO 7813 lays it out from track 1: ;PAN=expiry, service code and discretionary data?
+	static std::string TrackTwoOf(const std::string& Track1) {
+		if(Track1.size() < 2 || Track1[0] != '%') return std::string();
+		size_t name = Track1.find('^', 2);
+		size_t rest = (name == std::string::npos) ? name : Track1.find('^', name + 1);
+		if(rest == std::string::npos) return std::string();
+		return ";" + Track1.substr(2, name - 2) + "=" + Track1.substr(rest + 1);
+	}
+
+	// ASCII value of character 0 in CHARS packed width bits a character
+	static unsigned char WidthBase(unsigned width) {
+		return (width == 4) ? '0' : (width == 6) ? ' ' : 0;
+	}
+
+/*	==== START column coding ====	*/
+
+	struct ColumnWriter {
+		std::vector<unsigned char> Data;
+
+		void Byte(unsigned char b) {
+			this->Data.push_back(b);
+		}
+
+		void Varint(uint64_t v) {
+			while(v >= 0x80) {
+				this->Data.push_back((unsigned char)(v | 0x80));
+				v >>= 7;
+			}
+			this->Data.push_back((unsigned char)v);
+		}
+
+		void Signed(int64_t v) {
+			this->Varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+		}
+
+		void Bytes(const unsigned char* p, size_t len) {
+			this->Data.insert(this->Data.end(), p, p + len);
+		}
+	};
+
+	// Reads a column, Ok turns false once a read runs past its end
+	struct ColumnReader {
+		const unsigned char* P;
+		const unsigned char* End;
+		bool Ok;
+
+		ColumnReader(void) : P(NULL), End(NULL), Ok(true) {}
+		ColumnReader(const unsigned char* data, size_t len) : P(data), End(data + len), Ok(true) {}
+
+		unsigned char Byte(void) {
+			if(this->P >= this->End) {
+				this->Ok = false;
+				return 0;
+			}
+			return *this->P++;
+		}
+
+		uint64_t Varint(void) {
+			uint64_t v = 0;
+			for(int shift = 0; shift < 64; shift += 7) {
+				if(this->P >= this->End) break;
+				unsigned char b = *this->P++;
+				v |= (uint64_t)(b & 0x7F) << shift;
+				if(!(b & 0x80)) return v;
+			}
+			this->Ok = false;
+			return 0;
+		}
+
+		int64_t Signed(void) {
+			uint64_t v = this->Varint();
+			return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+		}
+
+		const unsigned char* Bytes(size_t len) {
+			if((size_t)(this->End - this->P) < len) {
+				this->Ok = false;
+				return NULL;
+			}
+			const unsigned char* p = this->P;
+			this->P += len;
+			return p;
+		}
+	};
+
+	// Packs characters LSB first at a fixed width
+	struct CharPacker {
+		std::vector<unsigned char>& Out;
+		uint64_t Acc;
+		unsigned Count;
+
+		CharPacker(std::vector<unsigned char>& Out) : Out(Out), Acc(0), Count(0) {}
+
+		void Put(unsigned value, unsigned width) {
+			this->Acc |= (uint64_t)value << this->Count;
+			this->Count += width;
+			while(this->Count >= 8) {
+				this->Out.push_back((unsigned char)this->Acc);
+				this->Acc >>= 8;
+				this->Count -= 8;
+			}
+		}
+
+		void Flush(void) {
+			if(this->Count > 0) this->Out.push_back((unsigned char)this->Acc);
+			this->Acc = 0;
+			this->Count = 0;
+		}
+	};
+
+	struct CharUnpacker {
+		ColumnReader& In;
+		uint64_t Acc;
+		unsigned Count;
+
+		CharUnpacker(ColumnReader& In) : In(In), Acc(0), Count(0) {}
+
+		unsigned Get(unsigned width) {
+			while(this->Count < width) {
+				this->Acc |= (uint64_t)this->In.Byte() << this->Count;
+				this->Count += 8;
+			}
+			unsigned value = (unsigned)(this->Acc & ((1u << width) - 1));
+			this->Acc >>= width;
+			this->Count -= width;
+			return value;
+		}
+	};
+
+	// Fills text with the characters of a raw track if encoding them again gives back the same bytes
+	static bool Symbolic(const unsigned char* raw, int len, Track::TRACK_BIT_LEN bits, std::string& text, int& lead, bool& reversed) {
+		TrackDecode decoded;
+		if(len <= 0 || DecodeRawTrack(raw, len, bits, decoded) != DECODE_OK) return false;
+		reversed = decoded.Reversed;
+
+		// Zero bits ahead of the start sentinel, in swipe order
+		const int total = len * 8;
+		lead = 0;
+		while(lead < total) {
+			int b = reversed ? (total - 1 - lead) : lead;
+			if((raw[b >> 3] >> (b & 7)) & 1) break;
+			lead++;
+		}
+
+		std::vector<unsigned char> again(len);
+		if(!EncodeRawTrack(decoded.Data, decoded.Length, bits, lead, reversed, again.data(), len)) return false;
+		if(memcmp(again.data(), raw, len) != 0) return false;
+		text.assign(decoded.Data, decoded.Length);
+		return true;
+	}
+
+/*	==== START ArchiveWriter CLASS ====	*/
+
+	ArchiveWriter::ArchiveWriter(void) {
+		this->Fd = -1;
+		this->Offset = 0;
+		this->Records = 0;
+	}
+
+	ArchiveWriter::~ArchiveWriter(void) {
+		this->Abort();
+	}
+
+	bool ArchiveWriter::Open(std::string Path, mode_t Mode) {
+		this->Abort();
+		std::string tmp = Path + ".tmp";
+		this->Fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, Mode);
+		// Not narrowed by the umask, group access has to be asked for
+		if(this->Fd >= 0 && fchmod(this->Fd, Mode) != 0) {
+			close(this->Fd);
+			unlink(tmp.c_str());
+			this->Fd = -1;
+		}
+		if(this->Fd < 0) {
+#if defined(DEBUG)
+			std::cout << "[*] Error: unable to create archive '" << tmp << "'" << std::endl;
+#endif
+			return false;
+		}
+		this->Path = Path;
+
+		ArchiveHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.Magic, "L605ARC", 8);
+		header.Version = ArchiveVersion;
+		if(!WriteAll(this->Fd, &header, sizeof(header))) {
+			this->Abort();
+			return false;
+		}
+		this->Offset = sizeof(header);
+		return true;
+	}
+
+	void ArchiveWriter::Abort(void) {
+		if(this->Fd >= 0) {
+			close(this->Fd);
+			unlink((this->Path + ".tmp").c_str());
+		}
+		this->Fd = -1;
+		this->Offset = 0;
+		this->Records = 0;
+		this->Pending.clear();
+		this->Index.clear();
+	}
+
+	bool ArchiveWriter::Append(const CaptureRecord& Record) {
+		if(this->Fd < 0) return false;
+		this->Pending.push_back(Record);
+		this->Records++;
+		if(this->Pending.size() < ARCHIVE_BLOCK_RECORDS) return true;
+		if(this->WriteBlock()) return true;
+		// Part of the block may be in the file past Offset, whatever follows would be indexed
+		// at the wrong place. The archive is dropped, Append and Close fail from now on
+		this->Abort();
+		return false;
+	}
+
+	bool ArchiveWriter::WriteBlock(void) {
+		if(this->Pending.empty()) return true;
+		const size_t count = this->Pending.size();
+		ColumnWriter columns[COLUMN_COUNT];
+
+		BlockHeader header;
+		memset(&header, 0, sizeof(header));
+		header.Records = (uint32_t)count;
+		header.FirstTime = ToNanoseconds(this->Pending[0].Timestamp);
+
+		ArchiveBlock entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.Offset = this->Offset;
+		entry.First = this->Records - count;
+		entry.Records = (uint32_t)count;
+		entry.MinTime = entry.MaxTime = header.FirstTime;
+
+		// Characters of every track kept as text, later records are coded against them
+		std::vector<std::string> text[3];
+		std::vector<unsigned char> kinds[3];
+		// Record, start and length of the characters left to pack
+		struct Middle {
+			size_t Record;
+			size_t Start;
+			size_t Length;
+		};
+		std::vector<Middle> middles[3];
+		std::unordered_map<std::string, size_t> keys[2][3];
+		for(int t = 0; t < 3; t++) {
+			text[t].resize(count);
+			kinds[t].resize(count, KIND_ABSENT);
+		}
+
+		uint64_t run = 0, device_run = 0;
+		uint64_t run_shape = 0;
+		unsigned char run_status = 0;
+		uint32_t run_device = 0;
+		int64_t previous = header.FirstTime;
+		for(size_t i = 0; i < count; i++) {
+			const CaptureRecord& record = this->Pending[i];
+			const bool raw = (record.Card.GetCardDataFormat() == Magstripe::RAW);
+			uint64_t shape = raw ? 1 : 0;
+
+			for(int t = 0; t < 3; t++) {
+				const unsigned char* data;
+				int len;
+				Track::TRACK_BIT_LEN bits;
+				if(!record.Card.PeekTrack(t + 1, data, len, bits)) continue;
+				ColumnWriter& frame = columns[ColumnOf(t, 0)];
+				int lead = 0;
+				bool reversed = false;
+				unsigned kind = KIND_TEXT;
+				if(len == 0) {
+					kind = KIND_EMPTY;
+				} else if(raw && !Symbolic(data, len, bits, text[t][i], lead, reversed)) {
+					kind = KIND_LITERAL;
+					frame.Varint(len);
+					columns[ColumnOf(t, 2)].Bytes(data, len);
+				} else {
+					if(raw) kind = KIND_SYMBOLIC;
+					else text[t][i].assign((const char*)data, len);
+					const std::string& s = text[t][i];
+
+					// Against track 1 of the record, the previous record or the last one starting
+					// the same way, whichever shares more
+					uint64_t best = 0;
+					size_t prefix = 0, suffix = 0;
+					auto consider = [&](uint64_t ref, const std::string& r) {
+						size_t limit = std::min(s.size(), r.size());
+						size_t p = 0;
+						while(p < limit && s[p] == r[p]) p++;
+						size_t q = 0;
+						while(p + q < limit && s[s.size() - 1 - q] == r[r.size() - 1 - q]) q++;
+						if(p + q > prefix + suffix) {
+							best = ref;
+							prefix = p;
+							suffix = q;
+						}
+					};
+					auto earlier = [&](size_t j) {
+						if(kinds[t][j] == KIND_TEXT || kinds[t][j] == KIND_SYMBOLIC) consider(i - j + 1, text[t][j]);
+					};
+					if(t > 0 && (kinds[0][i] == KIND_TEXT || kinds[0][i] == KIND_SYMBOLIC)) consider(1, TrackTwoOf(text[0][i]));
+					if(i > 0) earlier(i - 1);
+					for(int k = 0; k < 2; k++) {
+						if(s.size() < KeyChars[k]) break;
+						std::string key = s.substr(0, KeyChars[k]);
+						auto it = keys[k][t].find(key);
+						if(it != keys[k][t].end() && it->second != i - 1) earlier(it->second);
+						keys[k][t][key] = i;
+					}
+
+					frame.Varint(best);
+					if(best != 0) {
+						frame.Varint(prefix);
+						frame.Varint(suffix);
+					}
+					Middle middle = { i, prefix, s.size() - prefix - suffix };
+					frame.Varint(middle.Length);
+					middles[t].push_back(middle);
+					if(kind == KIND_SYMBOLIC) {
+						frame.Varint(len);
+						frame.Varint((uint64_t)lead * 2 + (reversed ? 1 : 0));
+					}
+				}
+				kinds[t][i] = (unsigned char)kind;
+				shape |= (uint64_t)bits << (1 + 2 * t);
+				shape |= (uint64_t)kind << (7 + 3 * t);
+			}
+
+			if(run > 0 && (shape != run_shape || record.Status != run_status)) {
+				columns[COLUMN_META].Varint(run);
+				columns[COLUMN_META].Varint(run_shape);
+				columns[COLUMN_META].Byte(run_status);
+				run = 0;
+			}
+			run_shape = shape;
+			run_status = record.Status;
+			run++;
+			if(device_run > 0 && record.Device != run_device) {
+				columns[COLUMN_DEVICE].Varint(device_run);
+				columns[COLUMN_DEVICE].Varint(run_device);
+				device_run = 0;
+			}
+			run_device = record.Device;
+			device_run++;
+
+			int64_t time = ToNanoseconds(record.Timestamp);
+			columns[COLUMN_TIME].Signed(time - previous);
+			previous = time;
+			entry.MinTime = std::min(entry.MinTime, time);
+			entry.MaxTime = std::max(entry.MaxTime, time);
+		}
+		columns[COLUMN_META].Varint(run);
+		columns[COLUMN_META].Varint(run_shape);
+		columns[COLUMN_META].Byte(run_status);
+		columns[COLUMN_DEVICE].Varint(device_run);
+		columns[COLUMN_DEVICE].Varint(run_device);
+
+		// Narrowest width that holds every character left of the track
+		for(int t = 0; t < 3; t++) {
+			bool numeric = true, alpha = true;
+			for(const Middle& m : middles[t]) {
+				const std::string& s = text[t][m.Record];
+				for(size_t c = m.Start; c < m.Start + m.Length; c++) {
+					unsigned char ch = (unsigned char)s[c];
+					if(ch < '0' || ch > '?') numeric = false;
+					if(ch < ' ' || ch > '_') alpha = false;
+				}
+			}
+			unsigned width = numeric ? 4 : alpha ? 6 : 8;
+			header.Width[t] = (uint8_t)width;
+			const unsigned char base = WidthBase(width);
+			CharPacker packer(columns[ColumnOf(t, 1)].Data);
+			for(const Middle& m : middles[t]) {
+				const std::string& s = text[t][m.Record];
+				for(size_t c = m.Start; c < m.Start + m.Length; c++) packer.Put((unsigned char)s[c] - base, width);
+			}
+			packer.Flush();
+		}
+
+		std::vector<unsigned char> block(sizeof(header));
+		for(int c = 0; c < COLUMN_COUNT; c++) {
+			header.Length[c] = (uint32_t)columns[c].Data.size();
+			block.insert(block.end(), columns[c].Data.begin(), columns[c].Data.end());
+		}
+		memcpy(block.data(), &header, sizeof(header));
+		entry.Length = (uint32_t)block.size();
+		entry.Checksum = Checksum(block.data(), block.size());
+		if(!WriteAll(this->Fd, block.data(), block.size())) return false;
+
+		this->Offset += block.size();
+		this->Index.push_back(entry);
+		this->Pending.clear();
+		return true;
+	}
+
+	bool ArchiveWriter::Close(void) {
+		if(this->Fd < 0) return false;
+		bool ok = this->WriteBlock();
+
+		// The index is read in place from the mapping
+		static const unsigned char padding[8] = { 0 };
+		size_t pad = (size_t)((8 - (this->Offset & 7)) & 7);
+		ok = ok && WriteAll(this->Fd, padding, pad);
+		ArchiveFooter footer;
+		memset(&footer, 0, sizeof(footer));
+		footer.IndexOffset = this->Offset + pad;
+		footer.Blocks = this->Index.size();
+		footer.Records = this->Records;
+		footer.Checksum = Checksum((const unsigned char*)this->Index.data(), this->Index.size() * sizeof(ArchiveBlock));
+		footer.Version = ArchiveVersion;
+		memcpy(footer.Magic, "L605END", 8);
+		ok = ok && WriteAll(this->Fd, this->Index.data(), this->Index.size() * sizeof(ArchiveBlock));
+		ok = ok && WriteAll(this->Fd, &footer, sizeof(footer));
+		ok = ok && fdatasync(this->Fd) == 0;
+
+		std::string tmp = this->Path + ".tmp";
+		if(close(this->Fd) != 0) ok = false;
+		this->Fd = -1;
+		if(ok) ok = (rename(tmp.c_str(), this->Path.c_str()) == 0);
+		if(!ok) unlink(tmp.c_str());
+		this->Abort();
+		return ok;
+	}
+
+/*	==== START ArchiveReader CLASS ====	*/
+
+	ArchiveReader::ArchiveReader(void) {
+		this->Map = NULL;
+		this->MapSize = 0;
+		this->Blocks = NULL;
+		this->BlockCount = 0;
+		this->RecordCount = 0;
+		this->CachedBlock = UINT64_MAX;
+	}
+
+	ArchiveReader::~ArchiveReader(void) {
+		this->Close();
+	}
+
+	void ArchiveReader::Close(void) {
+		if(this->Map != NULL) munmap((void*)this->Map, this->MapSize);
+		this->Map = NULL;
+		this->MapSize = 0;
+		this->Blocks = NULL;
+		this->BlockCount = 0;
+		this->RecordCount = 0;
+		std::lock_guard<std::mutex> guard(this->CacheLock);
+		this->CachedBlock = UINT64_MAX;
+		this->Cached.clear();
+	}
+
+	bool ArchiveReader::Open(std::string Path) {
+		this->Close();
+		int fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ArchiveHeader) + sizeof(ArchiveFooter)) {
+			close(fd);
+			return false;
+		}
+		void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED) return false;
+		this->Map = (const unsigned char*)map;
+		this->MapSize = st.st_size;
+
+		ArchiveHeader header;
+		ArchiveFooter footer;
+		memcpy(&header, this->Map, sizeof(header));
+		memcpy(&footer, this->Map + this->MapSize - sizeof(footer), sizeof(footer));
+		const size_t index_end = this->MapSize - sizeof(footer);
+		bool ok = memcmp(header.Magic, "L605ARC", 8) == 0 && header.Version == ArchiveVersion &&
+			memcmp(footer.Magic, "L605END", 8) == 0 && footer.Version == ArchiveVersion &&
+			footer.IndexOffset >= sizeof(header) && (footer.IndexOffset & 7) == 0 && footer.IndexOffset <= index_end &&
+			footer.Blocks == (index_end - footer.IndexOffset) / sizeof(ArchiveBlock) &&
+			(index_end - footer.IndexOffset) % sizeof(ArchiveBlock) == 0 &&
+			footer.Checksum == Checksum(this->Map + footer.IndexOffset, index_end - footer.IndexOffset);
+
+		// Blocks must lie ahead of the index and number their records without gaps
+		const ArchiveBlock* blocks = (const ArchiveBlock*)(this->Map + footer.IndexOffset);
+		uint64_t records = 0;
+		for(uint64_t i = 0; ok && i < footer.Blocks; i++) {
+			const ArchiveBlock& b = blocks[i];
+			// Not as Offset + Length, that can wrap around on a crafted index
+			ok = b.Offset >= sizeof(header) && b.Length <= footer.IndexOffset && b.Offset <= footer.IndexOffset - b.Length &&
+				b.First == records;
+			records += b.Records;
+		}
+		if(!ok || records != footer.Records) {
+#if defined(DEBUG)
+			std::cout << "[*] Error: '" << Path << "' is not an archive or its index is damaged" << std::endl;
+#endif
+			this->Close();
+			return false;
+		}
+		this->Blocks = blocks;
+		this->BlockCount = footer.Blocks;
+		this->RecordCount = footer.Records;
+		return true;
+	}
+
+	uint64_t ArchiveReader::Size(void) const {
+		return this->RecordCount;
+	}
+
+	bool ArchiveReader::DecodeBlock(uint64_t Block, std::vector<CaptureRecord>& Out) const {
+		const ArchiveBlock& entry = this->Blocks[Block];
+		const unsigned char* data = this->Map + entry.Offset;
+		BlockHeader header;
+		if(entry.Length < sizeof(header) || Checksum(data, entry.Length) != entry.Checksum) return false;
+		memcpy(&header, data, sizeof(header));
+		if(header.Records != entry.Records) return false;
+
+		ColumnReader columns[COLUMN_COUNT];
+		size_t pos = sizeof(header);
+		for(int c = 0; c < COLUMN_COUNT; c++) {
+			if(header.Length[c] > entry.Length - pos) return false;
+			columns[c] = ColumnReader(data + pos, header.Length[c]);
+			pos += header.Length[c];
+		}
+		for(int t = 0; t < 3; t++)
+			if(header.Width[t] != 4 && header.Width[t] != 6 && header.Width[t] != 8) return false;
+		CharUnpacker chars[3] = { CharUnpacker(columns[ColumnOf(0, 1)]), CharUnpacker(columns[ColumnOf(1, 1)]), CharUnpacker(columns[ColumnOf(2, 1)]) };
+
+		const size_t count = header.Records;
+		Out.resize(count);
+		std::vector<std::string> text[3];
+		for(int t = 0; t < 3; t++) text[t].resize(count);
+		std::vector<unsigned char> raw;
+
+		uint64_t run = 0, shape = 0, device_run = 0, device = 0;
+		unsigned char status = 0;
+		int64_t time = header.FirstTime;
+		for(size_t i = 0; i < count; i++) {
+			if(run == 0) {
+				run = columns[COLUMN_META].Varint();
+				shape = columns[COLUMN_META].Varint();
+				status = columns[COLUMN_META].Byte();
+				if(run == 0 || !columns[COLUMN_META].Ok) return false;
+			}
+			run--;
+			if(device_run == 0) {
+				device_run = columns[COLUMN_DEVICE].Varint();
+				device = columns[COLUMN_DEVICE].Varint();
+				if(device_run == 0 || !columns[COLUMN_DEVICE].Ok) return false;
+			}
+			device_run--;
+			time += columns[COLUMN_TIME].Signed();
+
+			CaptureRecord& record = Out[i];
+			record.Timestamp = FromNanoseconds(time);
+			record.Device = (uint32_t)device;
+			record.Status = status;
+			record.Card = Magstripe((shape & 1) ? Magstripe::RAW : Magstripe::ISO);
+			for(int t = 0; t < 3; t++) {
+				Track::TRACK_BIT_LEN bits = (Track::TRACK_BIT_LEN)((shape >> (1 + 2 * t)) & 3);
+				unsigned kind = (unsigned)((shape >> (7 + 3 * t)) & 7);
+				ColumnReader& frame = columns[ColumnOf(t, 0)];
+				if(kind == KIND_ABSENT) continue;
+				if(kind > KIND_LITERAL) return false;
+				if(kind == KIND_EMPTY) {
+					SetTrack(record.Card, t, NULL, 0, bits);
+					continue;
+				}
+				if(kind == KIND_LITERAL) {
+					uint64_t len = frame.Varint();
+					const unsigned char* bytes = (len <= MaxTrackBytes) ? columns[ColumnOf(t, 2)].Bytes(len) : NULL;
+					if(bytes == NULL && len > 0) return false;
+					SetTrack(record.Card, t, bytes, (int)len, bits);
+					continue;
+				}
+
+				uint64_t ref = frame.Varint(), prefix = 0, suffix = 0;
+				std::string derived;
+				const std::string* base = &derived;
+				if(ref != 0) {
+					prefix = frame.Varint();
+					suffix = frame.Varint();
+					if(ref == 1) derived = TrackTwoOf(text[0][i]);
+					else if(ref - 1 <= i) base = &text[t][i - (ref - 1)];
+					else return false;
+				}
+				uint64_t middle = frame.Varint();
+				if(prefix + suffix > base->size() || middle > MaxTrackBytes) return false;
+
+				std::string& s = text[t][i];
+				s.reserve(prefix + middle + suffix);
+				s.assign(*base, 0, prefix);
+				const unsigned width = header.Width[t];
+				const unsigned char offset = WidthBase(width);
+				for(uint64_t c = 0; c < middle; c++) s.push_back((char)(offset + chars[t].Get(width)));
+				s.append(*base, base->size() - suffix, suffix);
+
+				if(kind == KIND_SYMBOLIC) {
+					uint64_t len = frame.Varint();
+					uint64_t lead = frame.Varint();
+					if(len > MaxTrackBytes || lead / 2 > len * 8) return false;
+					raw.resize(len);
+					if(!EncodeRawTrack(s.data(), (int)s.size(), bits, (int)(lead / 2), (lead & 1) != 0, raw.data(), (int)len)) return false;
+					SetTrack(record.Card, t, raw.data(), (int)len, bits);
+				} else {
+					SetTrack(record.Card, t, (const unsigned char*)s.data(), (int)s.size(), bits);
+				}
+			}
+			record.Fingerprint = FingerprintMagstripe(record.Card);
+		}
+		for(int c = 0; c < COLUMN_COUNT; c++)
+			if(!columns[c].Ok) return false;
+		return true;
+	}
+
+	bool ArchiveReader::Get(uint64_t Number, CaptureRecord& Record) {
+		if(Number >= this->RecordCount) return false;
+		// The last block starting at or before the record
+		const ArchiveBlock* end = this->Blocks + this->BlockCount;
+		const ArchiveBlock* b = std::upper_bound(this->Blocks, end, Number, [](uint64_t n, const ArchiveBlock& block) {
+			return n < block.First;
+		}) - 1;
+		uint64_t block = b - this->Blocks;
+
+		std::lock_guard<std::mutex> guard(this->CacheLock);
+		if(this->CachedBlock != block) {
+			this->CachedBlock = UINT64_MAX;
+			if(!this->DecodeBlock(block, this->Cached)) return false;
+			this->CachedBlock = block;
+		}
+		Record = this->Cached[Number - b->First];
+		return true;
+	}
+
+	bool ArchiveReader::ForEach(const ArchiveReader::Callback& cb, unsigned Threads) const {
+		if(Threads == 0) Threads = std::thread::hardware_concurrency();
+		const unsigned workers = (unsigned)std::min<uint64_t>(std::max(Threads, 1u), this->BlockCount);
+		std::atomic<uint64_t> next_block(0);
+		std::atomic<bool> ok(true);
+
+		auto work = [&](void) {
+			std::vector<CaptureRecord> records;
+			uint64_t block;
+			while((block = next_block.fetch_add(1, std::memory_order_relaxed)) < this->BlockCount) {
+				if(!this->DecodeBlock(block, records)) {
+					ok = false;
+					continue;
+				}
+				for(size_t i = 0; i < records.size(); i++) cb(this->Blocks[block].First + i, records[i]);
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for(unsigned i = 1; i < workers; i++) pool.push_back(std::thread(work));
+		if(workers > 0) work();
+		for(std::thread& t : pool) t.join();
+		return ok;
+	}
+
+	size_t ArchiveReader::Scan(std::chrono::system_clock::time_point From, std::chrono::system_clock::time_point To,
+		std::function<bool(const CaptureRecord&)> Visit, bool* Intact) const {
+		const int64_t from = ToNanoseconds(From), to = ToNanoseconds(To);
+		size_t visited = 0;
+		if(Intact != NULL) *Intact = true;
+		std::vector<CaptureRecord> records;
+		for(uint64_t block = 0; block < this->BlockCount; block++) {
+			const ArchiveBlock& b = this->Blocks[block];
+			if(b.MaxTime < from || b.MinTime >= to) continue;
+			if(!this->DecodeBlock(block, records)) {
+				if(Intact != NULL) *Intact = false;
+				continue;
+			}
+			for(const CaptureRecord& record : records) {
+				int64_t time = ToNanoseconds(record.Timestamp);
+				if(time < from || time >= to) continue;
+				visited++;
+				if(!Visit(record)) return visited;
+			}
+		}
+		return visited;
+	}
+}
@@ -0,0 +1,253 @@
+/*
+	lib605_broker.cpp - Shared memory swipe event ring published by the broker
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_broker.hpp"
+
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace lib605 {
+
+	static const char RingMagic[8] = "L605RNG";
+	static const uint32_t RingVersion = 1;
+
+	static_assert((BROKER_RING_SLOTS & (BROKER_RING_SLOTS - 1)) == 0, "BROKER_RING_SLOTS must be a power of two");
+
+	// Not FUTEX_PRIVATE, the word is shared between processes
+	static void FutexWake(std::atomic<uint32_t>* word) {
+		syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+	}
+
+	static void FutexWait(const std::atomic<uint32_t>* word, uint32_t expected, const struct timespec* timeout) {
+		syscall(SYS_futex, (const uint32_t*)word, FUTEX_WAIT, expected, timeout, NULL, 0);
+	}
+
+	static size_t RingSize(uint32_t slots) {
+		return sizeof(SwipeRingHeader) + (size_t)slots * sizeof(SwipeRingSlot);
+	}
+
+	Magstripe EventToMagstripe(const SwipeEvent& Event) {
+		Magstripe ms((Magstripe::CARD_DATA_FORMAT)Event.Format);
+		size_t offset = 0;
+		for(int i = 0; i < 3; i++) {
+			size_t len = Event.Length[i];
+			// A corrupt length can't read past the event
+			if(offset + len > sizeof(Event.Data)) len = sizeof(Event.Data) - offset;
+			const unsigned char* data = &Event.Data[offset];
+			Track::TRACK_BIT_LEN bits = (Track::TRACK_BIT_LEN)Event.Bits[i];
+			if(i == 0) ms.SetTrack1(data, (int)len, bits);
+			if(i == 1) ms.SetTrack2(data, (int)len, bits);
+			if(i == 2) ms.SetTrack3(data, (int)len, bits);
+			offset += len;
+		}
+		ms.SetDuplicate(Event.Duplicate != 0);
+		return ms;
+	}
+
+/*	==== START SwipeRingWriter CLASS ====	*/
+
+	SwipeRingWriter::SwipeRingWriter(void) {
+		this->Header = NULL;
+		this->Slots = NULL;
+		this->MapSize = 0;
+	}
+
+	SwipeRingWriter::~SwipeRingWriter(void) {
+		this->Close();
+	}
+
+	bool SwipeRingWriter::Create(std::string Name, bool Replace, mode_t Mode) {
+		this->Close();
+		// A ring left behind by a crashed broker may have another layout, but so
+		// may one a running broker still publishes to, only the caller can tell
+		if(Replace) shm_unlink(Name.c_str());
+		int fd = shm_open(Name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, Mode);
+		if(fd < 0) return false;
+		size_t size = RingSize(BROKER_RING_SLOTS);
+		// Not narrowed by the umask, group access has to be asked for
+		if(fchmod(fd, Mode) != 0 || ftruncate(fd, (off_t)size) != 0) {
+			close(fd);
+			shm_unlink(Name.c_str());
+			return false;
+		}
+		void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED) {
+			shm_unlink(Name.c_str());
+			return false;
+		}
+		// ftruncate zero filled the object, so every slot reads as never written
+		this->Header = (SwipeRingHeader*)map;
+		this->Slots = (SwipeRingSlot*)((unsigned char*)map + sizeof(SwipeRingHeader));
+		this->MapSize = size;
+		this->Name = Name;
+		this->Header->Version = RingVersion;
+		this->Header->Slots = BROKER_RING_SLOTS;
+		// Readers check the magic last
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(this->Header->Magic, RingMagic, sizeof(RingMagic));
+		return true;
+	}
+
+	void SwipeRingWriter::Close(void) {
+		if(this->Header == NULL) return;
+		munmap(this->Header, this->MapSize);
+		shm_unlink(this->Name.c_str());
+		this->Header = NULL;
+		this->Slots = NULL;
+		this->MapSize = 0;
+	}
+
+	uint64_t SwipeRingWriter::Publish(uint32_t Device, const Magstripe& Card, unsigned char Status) {
+		if(this->Header == NULL) return 0;
+		uint64_t seq = this->Header->Head.load(std::memory_order_relaxed) + 1;
+		SwipeRingSlot& slot = this->Slots[(seq - 1) & (BROKER_RING_SLOTS - 1)];
+
+		slot.Sequence.store(2 * seq - 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		SwipeEvent& e = slot.Event;
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		e.Sequence = seq;
+		e.Timestamp = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+		e.Device = Device;
+		e.Format = (uint8_t)Card.GetCardDataFormat();
+		e.Status = Status;
+		e.Duplicate = Card.IsDuplicate() ? 1 : 0;
+		size_t offset = 0;
+		for(int i = 0; i < 3; i++) {
+			const unsigned char* data;
+			int data_len;
+			Track::TRACK_BIT_LEN bits;
+			size_t len = 0;
+			if(Card.PeekTrack(i + 1, data, data_len, bits))
+				len = (size_t)data_len;
+			else
+				bits = Track::TRACK_8_BIT;
+			if(offset + len > sizeof(e.Data)) len = sizeof(e.Data) - offset;
+			if(len > 0) memcpy(&e.Data[offset], data, len);
+			e.Bits[i] = (uint8_t)bits;
+			e.Length[i] = (uint16_t)len;
+			offset += len;
+		}
+
+		slot.Sequence.store(2 * seq, std::memory_order_release);
+		this->Header->Head.store(seq, std::memory_order_release);
+		this->Header->Wake.fetch_add(1, std::memory_order_release);
+		FutexWake(&this->Header->Wake);
+		return seq;
+	}
+
+/*	==== START SwipeRingReader CLASS ====	*/
+
+	SwipeRingReader::SwipeRingReader(void) {
+		this->Header = NULL;
+		this->Slots = NULL;
+		this->MapSize = 0;
+		this->Cursor = 1;
+		this->Lost = 0;
+	}
+
+	SwipeRingReader::~SwipeRingReader(void) {
+		this->Close();
+	}
+
+	bool SwipeRingReader::Open(std::string Name, bool FromStart) {
+		this->Close();
+		int fd = shm_open(Name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+		if(fd < 0) return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SwipeRingHeader)) {
+			close(fd);
+			return false;
+		}
+		void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED) return false;
+
+		const SwipeRingHeader* header = (const SwipeRingHeader*)map;
+		bool valid = (memcmp(header->Magic, RingMagic, sizeof(RingMagic)) == 0);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		valid = valid && header->Version == RingVersion && header->Slots == BROKER_RING_SLOTS &&
+			(size_t)st.st_size >= RingSize(header->Slots);
+		if(!valid) {
+			munmap(map, (size_t)st.st_size);
+			return false;
+		}
+		this->Header = header;
+		this->Slots = (const SwipeRingSlot*)((const unsigned char*)map + sizeof(SwipeRingHeader));
+		this->MapSize = (size_t)st.st_size;
+		this->Lost = 0;
+		uint64_t head = header->Head.load(std::memory_order_acquire);
+		if(!FromStart)
+			this->Cursor = head + 1;
+		else
+			this->Cursor = (head > BROKER_RING_SLOTS) ? head - BROKER_RING_SLOTS + 1 : 1;
+		return true;
+	}
+
+	void SwipeRingReader::Close(void) {
+		if(this->Header == NULL) return;
+		munmap((void*)this->Header, this->MapSize);
+		this->Header = NULL;
+		this->Slots = NULL;
+		this->MapSize = 0;
+	}
+
+	bool SwipeRingReader::Next(SwipeEvent& Event) {
+		if(this->Header == NULL) return false;
+		while(true) {
+			const SwipeRingSlot& slot = this->Slots[(this->Cursor - 1) & (BROKER_RING_SLOTS - 1)];
+			uint64_t before = slot.Sequence.load(std::memory_order_acquire);
+			// Not published yet, or being written for the first time
+			if(before < 2 * this->Cursor) return false;
+			if(before == 2 * this->Cursor) {
+				memcpy(&Event, &slot.Event, sizeof(Event));
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if(slot.Sequence.load(std::memory_order_relaxed) == before) {
+					this->Cursor++;
+					return true;
+				}
+			}
+			// The writer lapped us, resume at the oldest event still in the ring
+			uint64_t head = this->Header->Head.load(std::memory_order_acquire);
+			uint64_t oldest = (head > BROKER_RING_SLOTS) ? head - BROKER_RING_SLOTS + 1 : 1;
+			// Leave room so the slot isn't overwritten again while we copy
+			if(oldest < head) oldest++;
+			if(oldest > this->Cursor) {
+				this->Lost += oldest - this->Cursor;
+				this->Cursor = oldest;
+			}
+		}
+	}
+
+	bool SwipeRingReader::Wait(std::chrono::milliseconds Timeout) {
+		if(this->Header == NULL) return false;
+		uint32_t wake = this->Header->Wake.load(std::memory_order_acquire);
+		if(this->Header->Head.load(std::memory_order_acquire) >= this->Cursor) return true;
+		struct timespec ts;
+		ts.tv_sec = (time_t)(Timeout.count() / 1000);
+		ts.tv_nsec = (long)(Timeout.count() % 1000) * 1000000L;
+		FutexWait(&this->Header->Wake, wake, (Timeout.count() > 0) ? &ts : NULL);
+		return this->Header->Head.load(std::memory_order_acquire) >= this->Cursor;
+	}
+
+	uint64_t SwipeRingReader::GetLost(void) const {
+		return this->Lost;
+	}
+}
@@ -0,0 +1,56 @@
+/*
+	lib605_cancel.cpp - Cancellation of blocking device operations
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_cancel.hpp"
+
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+namespace lib605 {
+
+	CancelToken::CancelToken(void) {
+		this->EventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	}
+
+	CancelToken::~CancelToken(void) {
+		if(this->EventFd >= 0) close(this->EventFd);
+	}
+
+	void CancelToken::Cancel(void) {
+		uint64_t one = 1;
+		if(this->EventFd < 0) return;
+		// Can only fail if the counter would overflow, it is readable either way
+		ssize_t ret = write(this->EventFd, &one, sizeof(one));
+		(void)ret;
+	}
+
+	void CancelToken::Reset(void) {
+		uint64_t count;
+		if(this->EventFd < 0) return;
+		ssize_t ret = read(this->EventFd, &count, sizeof(count));
+		(void)ret;
+	}
+
+	bool CancelToken::IsCancelled(void) const {
+		struct pollfd pfd;
+		if(this->EventFd < 0) return false;
+		pfd.fd = this->EventFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		return poll(&pfd, 1, 0) > 0;
+	}
+
+	int CancelToken::GetFd(void) const {
+		return this->EventFd;
+	}
+}
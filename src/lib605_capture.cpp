@@ -0,0 +1,570 @@
+/*
+	lib605_capture.cpp - Indexed on-disk store of captured swipes
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_capture.hpp"
+#include "./include/lib605_dedup.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace lib605 {
+
+	/*
+		Segment layout
+
+		NNNNNNNNNNNNNNNN.seg holds a SegmentHeader followed by records, each
+		a RecordHeader followed by the bytes of tracks 1, 2 and 3. Once
+		sealed, NNNNNNNNNNNNNNNN.idx holds an IndexHeader, 2^BucketBits + 1
+		bucket starts, the postings sorted by fingerprint and offset, and
+		one IndexBlock per CAPTURE_BLOCK_RECORDS records.
+	*/
+	struct SegmentHeader {
+		char Magic[8];		// "L605CAP"
+		uint32_t Version;
+		uint32_t Reserved;
+		uint64_t Id;
+	};
+
+	struct RecordHeader {
+		uint32_t Magic;
+		uint32_t Checksum;	// FNV-1a of the rest of the header and the track bytes
+		int64_t Timestamp;	// Nanoseconds since the epoch
+		uint64_t Fingerprint;
+		uint32_t Device;
+		uint16_t Length[3];
+		uint8_t Format;
+		uint8_t Status;
+		uint8_t Bits[3];
+		uint8_t Reserved[9];
+	};
+
+	struct IndexHeader {
+		char Magic[8];		// "L605IDX"
+		uint32_t Version;
+		uint32_t Records;
+		uint64_t Size;		// Bytes of the segment covered
+		int64_t MinTime;
+		int64_t MaxTime;
+		uint32_t BucketBits;
+		uint32_t Blocks;
+	};
+
+	struct IndexPosting {
+		uint64_t Fingerprint;
+		uint64_t Offset;
+	};
+
+	struct IndexBlock {
+		uint64_t Offset;	// First record of the block, it ends where the next one starts
+		int64_t MinTime;
+		int64_t MaxTime;
+	};
+
+	static_assert(sizeof(RecordHeader) == 48, "record header layout changed");
+
+	static const uint32_t SegmentVersion = 1;
+	static const uint32_t IndexVersion = 1;
+	static const uint32_t RecordMagic = 0x52353036;	// "605R"
+
+	struct CaptureStore::Segment {
+		uint64_t Id;
+		int Fd;
+		uint64_t Size;
+		uint32_t Records;
+		int64_t MinTime;
+		int64_t MaxTime;
+		// Index of a sealed segment, mapped
+		void* Map;
+		size_t MapSize;
+		uint32_t BucketBits;
+		const uint32_t* Buckets;
+		const IndexPosting* Postings;
+		const IndexBlock* Blocks;
+		uint32_t BlockCount;
+		// Index of the active segment, postings in offset order
+		std::vector<IndexPosting> PendingPostings;
+		std::vector<IndexBlock> PendingBlocks;
+
+		Segment(uint64_t Id) : Id(Id), Fd(-1), Size(sizeof(SegmentHeader)), Records(0), MinTime(0), MaxTime(0),
+			Map(NULL), MapSize(0), BucketBits(0), Buckets(NULL), Postings(NULL), Blocks(NULL), BlockCount(0) {}
+		~Segment(void) {
+			if(this->Map != NULL) munmap(this->Map, this->MapSize);
+			if(this->Fd >= 0) close(this->Fd);
+		}
+		bool Sealed(void) const {
+			return this->Map != NULL;
+		}
+		const IndexBlock* GetBlocks(void) const {
+			return this->Sealed() ? this->Blocks : this->PendingBlocks.data();
+		}
+		uint32_t GetBlockCount(void) const {
+			return this->Sealed() ? this->BlockCount : (uint32_t)this->PendingBlocks.size();
+		}
+		// Maps the index of a sealed segment, false if it is damaged or does not match the records
+		bool MapIndex(const std::string& Path);
+		// Folds a record into the in-memory index
+		void Add(uint64_t Fingerprint, uint64_t Offset, int64_t Timestamp) {
+			if(this->Records % CAPTURE_BLOCK_RECORDS == 0) {
+				IndexBlock block = { Offset, Timestamp, Timestamp };
+				this->PendingBlocks.push_back(block);
+			}
+			IndexBlock& block = this->PendingBlocks.back();
+			block.MinTime = std::min(block.MinTime, Timestamp);
+			block.MaxTime = std::max(block.MaxTime, Timestamp);
+			if(this->Records == 0) this->MinTime = this->MaxTime = Timestamp;
+			this->MinTime = std::min(this->MinTime, Timestamp);
+			this->MaxTime = std::max(this->MaxTime, Timestamp);
+			IndexPosting posting = { Fingerprint, Offset };
+			this->PendingPostings.push_back(posting);
+			this->Records++;
+		}
+	};
+
+	static uint32_t Checksum(uint32_t h, const void* data, size_t len) {
+		const unsigned char* p = (const unsigned char*)data;
+		for(size_t i = 0; i < len; i++) {
+			h ^= p[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	static uint32_t RecordChecksum(const RecordHeader& header, const unsigned char* data, size_t len) {
+		const size_t skip = offsetof(RecordHeader, Timestamp);
+		uint32_t h = Checksum(2166136261u, (const unsigned char*)&header + skip, sizeof(header) - skip);
+		return Checksum(h, data, len);
+	}
+
+	static size_t RecordLength(const RecordHeader& header) {
+		return sizeof(header) + header.Length[0] + header.Length[1] + header.Length[2];
+	}
+
+	static int64_t ToNanoseconds(std::chrono::system_clock::time_point Time) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Time.time_since_epoch()).count();
+	}
+
+	static std::chrono::system_clock::time_point FromNanoseconds(int64_t Time) {
+		return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(Time)));
+	}
+
+	// Parses the record at the start of data, false if it is torn or not a record
+	static bool DecodeRecord(const unsigned char* data, size_t avail, bool verify, CaptureRecord* Record, size_t& used) {
+		RecordHeader header;
+		if(avail < sizeof(header)) return false;
+		memcpy(&header, data, sizeof(header));
+		used = RecordLength(header);
+		if(header.Magic != RecordMagic || used > avail) return false;
+		const unsigned char* tracks = data + sizeof(header);
+		if(verify && header.Checksum != RecordChecksum(header, tracks, used - sizeof(header))) return false;
+		if(Record == NULL) return true;
+
+		Record->Timestamp = FromNanoseconds(header.Timestamp);
+		Record->Device = header.Device;
+		Record->Status = header.Status;
+		Record->Fingerprint = header.Fingerprint;
+		Record->Card = Magstripe((Magstripe::CARD_DATA_FORMAT)header.Format);
+		for(int i = 0; i < 3; i++) {
+			Track::TRACK_BIT_LEN bits = (Track::TRACK_BIT_LEN)header.Bits[i];
+			if(i == 0) Record->Card.SetTrack1(tracks, header.Length[i], bits);
+			if(i == 1) Record->Card.SetTrack2(tracks, header.Length[i], bits);
+			if(i == 2) Record->Card.SetTrack3(tracks, header.Length[i], bits);
+			tracks += header.Length[i];
+		}
+		return true;
+	}
+
+	static bool WriteAll(int fd, const void* data, size_t len) {
+		const char* p = (const char*)data;
+		while(len > 0) {
+			ssize_t count = write(fd, p, len);
+			if(count < 0 && errno == EINTR) continue;
+			if(count <= 0) return false;
+			p += count;
+			len -= count;
+		}
+		return true;
+	}
+
+	static bool ReadAll(int fd, void* data, size_t len, uint64_t offset) {
+		char* p = (char*)data;
+		while(len > 0) {
+			ssize_t count = pread(fd, p, len, offset);
+			if(count < 0 && errno == EINTR) continue;
+			if(count <= 0) return false;
+			p += count;
+			len -= count;
+			offset += count;
+		}
+		return true;
+	}
+
+	static std::string SegmentPath(const std::string& Dir, uint64_t Id, const char* ext) {
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.%s", (unsigned long long)Id, ext);
+		return Dir + name;
+	}
+
+	static size_t BucketsOffset(void) {
+		return sizeof(IndexHeader);
+	}
+
+	static size_t PostingsOffset(uint32_t BucketBits) {
+		size_t end = BucketsOffset() + (((size_t)1 << BucketBits) + 1) * sizeof(uint32_t);
+		return (end + 7) & ~(size_t)7;
+	}
+
+	static uint32_t BucketOf(uint64_t Fingerprint, uint32_t BucketBits) {
+		return (BucketBits == 0) ? 0 : (uint32_t)(Fingerprint >> (64 - BucketBits));
+	}
+
+	bool CaptureStore::Segment::MapIndex(const std::string& Path) {
+		int fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) return false;
+		struct stat st;
+		void* map = MAP_FAILED;
+		if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(IndexHeader)) map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED) return false;
+
+		const IndexHeader* header = (const IndexHeader*)map;
+		struct stat data;
+		bool valid = memcmp(header->Magic, "L605IDX", 8) == 0 && header->Version == IndexVersion &&
+			header->BucketBits <= 24 && fstat(this->Fd, &data) == 0 && (uint64_t)data.st_size == header->Size &&
+			(size_t)st.st_size == PostingsOffset(header->BucketBits) + (size_t)header->Records * sizeof(IndexPosting) + (size_t)header->Blocks * sizeof(IndexBlock);
+		const char* base = (const char*)map;
+		// Lookups index the postings with the bucket starts and Scan reads each block up to the
+		// next one, so they must rise and stay within the postings and the segment. Postings
+		// need no check, ReadRecord bounds the offset of each
+		if(valid) {
+			const uint32_t* buckets = (const uint32_t*)(base + BucketsOffset());
+			const uint32_t last = (uint32_t)1 << header->BucketBits;
+			valid = buckets[0] == 0 && buckets[last] == header->Records;
+			for(uint32_t i = 0; valid && i < last; i++) valid = buckets[i] <= buckets[i + 1];
+			const IndexBlock* blocks = (const IndexBlock*)(base + PostingsOffset(header->BucketBits) + (size_t)header->Records * sizeof(IndexPosting));
+			uint64_t start = sizeof(SegmentHeader);
+			for(uint32_t b = 0; valid && b < header->Blocks; b++) {
+				valid = blocks[b].Offset >= start && blocks[b].Offset <= header->Size;
+				start = blocks[b].Offset;
+			}
+		}
+		if(!valid) {
+			munmap(map, st.st_size);
+			return false;
+		}
+		this->Map = map;
+		this->MapSize = st.st_size;
+		this->Size = header->Size;
+		this->Records = header->Records;
+		this->MinTime = header->MinTime;
+		this->MaxTime = header->MaxTime;
+		this->BucketBits = header->BucketBits;
+		this->Buckets = (const uint32_t*)(base + BucketsOffset());
+		this->Postings = (const IndexPosting*)(base + PostingsOffset(header->BucketBits));
+		this->Blocks = (const IndexBlock*)(this->Postings + header->Records);
+		this->BlockCount = header->Blocks;
+		// The mapped index replaces the one built in memory
+		std::vector<IndexPosting>().swap(this->PendingPostings);
+		std::vector<IndexBlock>().swap(this->PendingBlocks);
+		return true;
+	}
+
+/*	==== START CaptureStore CLASS ====	*/
+
+	CaptureStore::CaptureStore(void) {
+		this->ReadOnly = false;
+		this->Mode = 0600;
+	}
+
+	CaptureStore::~CaptureStore(void) {
+		this->Close();
+	}
+
+	bool CaptureStore::Open(std::string Dir, bool ReadOnly, mode_t Mode) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		this->Segments.clear();
+		if(!ReadOnly && mkdir(Dir.c_str(), Mode | ((Mode & 0444) >> 2)) != 0 && errno != EEXIST) return false;
+		this->Dir = Dir;
+		this->ReadOnly = ReadOnly;
+		this->Mode = Mode;
+
+		std::vector<uint64_t> ids;
+		DIR* dir = opendir(Dir.c_str());
+		if(dir == NULL) return false;
+		struct dirent* entry;
+		while((entry = readdir(dir)) != NULL) {
+			const char* name = entry->d_name;
+			if(strlen(name) != 20 || strcmp(name + 16, ".seg") != 0) continue;
+			char* end;
+			uint64_t id = strtoull(name, &end, 16);
+			if(end == name + 16) ids.push_back(id);
+		}
+		closedir(dir);
+		std::sort(ids.begin(), ids.end());
+
+		bool ok = true;
+		for(size_t i = 0; i < ids.size() && ok; i++) ok = this->LoadSegment(ids[i], i + 1 == ids.size());
+		if(ok && ids.empty() && !ReadOnly) ok = this->CreateSegment(1);
+		if(!ok) this->Segments.clear();
+		return ok;
+	}
+
+	void CaptureStore::Close(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		this->Segments.clear();
+	}
+
+	bool CaptureStore::LoadSegment(uint64_t Id, bool Active) {
+		std::unique_ptr<Segment> seg(new Segment(Id));
+		std::string path = SegmentPath(this->Dir, Id, "seg");
+		seg->Fd = open(path.c_str(), (Active && !this->ReadOnly ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+		if(seg->Fd < 0) return false;
+
+		if(!Active) {
+			// A sealed segment is only trusted with an index matching its size
+			if(seg->MapIndex(SegmentPath(this->Dir, Id, "idx"))) {
+				this->Segments.push_back(std::move(seg));
+				return true;
+			}
+			// Sealing was interrupted, index it again
+			if(this->ReadOnly) Active = true;
+			close(seg->Fd);
+			seg->Fd = open(path.c_str(), (this->ReadOnly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+			if(seg->Fd < 0) return false;
+		}
+
+		// Walk the records, cutting off a torn one at the end. Read only, a record
+		// being appended is left alone and later ones are not seen
+		struct stat st;
+		if(fstat(seg->Fd, &st) != 0) return false;
+		std::vector<unsigned char> data(st.st_size);
+		if(!data.empty() && !ReadAll(seg->Fd, data.data(), data.size(), 0)) return false;
+		SegmentHeader header;
+		if(data.size() < sizeof(header)) return false;
+		memcpy(&header, data.data(), sizeof(header));
+		if(memcmp(header.Magic, "L605CAP", 8) != 0 || header.Version != SegmentVersion) return false;
+		size_t offset = sizeof(header);
+		size_t used;
+		while(DecodeRecord(data.data() + offset, data.size() - offset, true, NULL, used)) {
+			RecordHeader record;
+			memcpy(&record, data.data() + offset, sizeof(record));
+			seg->Add(record.Fingerprint, offset, record.Timestamp);
+			offset += used;
+		}
+		seg->Size = offset;
+		if(!this->ReadOnly && offset != data.size() && ftruncate(seg->Fd, offset) != 0) return false;
+
+		if(!Active && !this->Seal(*seg)) return false;
+		if(Active) lseek(seg->Fd, 0, SEEK_END);
+		this->Segments.push_back(std::move(seg));
+		return true;
+	}
+
+	bool CaptureStore::CreateSegment(uint64_t Id) {
+		std::unique_ptr<Segment> seg(new Segment(Id));
+		seg->Fd = open(SegmentPath(this->Dir, Id, "seg").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, this->Mode);
+		// Not narrowed by the umask, group access has to be asked for
+		if(seg->Fd < 0 || fchmod(seg->Fd, this->Mode) != 0) return false;
+		SegmentHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.Magic, "L605CAP", 8);
+		header.Version = SegmentVersion;
+		header.Id = Id;
+		if(!WriteAll(seg->Fd, &header, sizeof(header))) return false;
+		this->Segments.push_back(std::move(seg));
+		return true;
+	}
+
+	bool CaptureStore::Seal(Segment& Seg) {
+		// About four fingerprints a bucket
+		uint32_t bits = 0;
+		while(bits < 24 && ((uint64_t)4 << bits) < Seg.Records) bits++;
+
+		std::vector<IndexPosting> postings = Seg.PendingPostings;
+		std::sort(postings.begin(), postings.end(), [](const IndexPosting& a, const IndexPosting& b) {
+			return (a.Fingerprint != b.Fingerprint) ? (a.Fingerprint < b.Fingerprint) : (a.Offset < b.Offset);
+		});
+		std::vector<uint32_t> buckets(((size_t)1 << bits) + 1, 0);
+		for(const IndexPosting& p : postings) buckets[BucketOf(p.Fingerprint, bits) + 1]++;
+		for(size_t i = 1; i < buckets.size(); i++) buckets[i] += buckets[i - 1];
+
+		IndexHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.Magic, "L605IDX", 8);
+		header.Version = IndexVersion;
+		header.Records = Seg.Records;
+		header.Size = Seg.Size;
+		header.MinTime = Seg.MinTime;
+		header.MaxTime = Seg.MaxTime;
+		header.BucketBits = bits;
+		header.Blocks = (uint32_t)Seg.PendingBlocks.size();
+
+		std::vector<char> index(PostingsOffset(bits) + postings.size() * sizeof(IndexPosting) + Seg.PendingBlocks.size() * sizeof(IndexBlock), 0);
+		memcpy(index.data(), &header, sizeof(header));
+		memcpy(index.data() + BucketsOffset(), buckets.data(), buckets.size() * sizeof(uint32_t));
+		if(!postings.empty()) memcpy(index.data() + PostingsOffset(bits), postings.data(), postings.size() * sizeof(IndexPosting));
+		if(!Seg.PendingBlocks.empty())
+			memcpy(index.data() + PostingsOffset(bits) + postings.size() * sizeof(IndexPosting), Seg.PendingBlocks.data(), Seg.PendingBlocks.size() * sizeof(IndexBlock));
+
+		// The records must be on disk before an index pointing at them
+		if(fdatasync(Seg.Fd) != 0) return false;
+		std::string path = SegmentPath(this->Dir, Seg.Id, "idx");
+		std::string tmp = path + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, this->Mode);
+		if(fd < 0) return false;
+		bool ok = fchmod(fd, this->Mode) == 0 && WriteAll(fd, index.data(), index.size()) && fdatasync(fd) == 0;
+		if(close(fd) != 0) ok = false;
+		if(ok) ok = (rename(tmp.c_str(), path.c_str()) == 0);
+		if(!ok) {
+			unlink(tmp.c_str());
+			return false;
+		}
+
+		return Seg.MapIndex(path);
+	}
+
+	bool CaptureStore::ReadRecord(const Segment& Seg, uint64_t Offset, CaptureRecord& Record) {
+		RecordHeader header;
+		if(!ReadAll(Seg.Fd, &header, sizeof(header), Offset)) return false;
+		std::vector<unsigned char> data(RecordLength(header));
+		if(header.Magic != RecordMagic || Offset + data.size() > Seg.Size) return false;
+		memcpy(data.data(), &header, sizeof(header));
+		if(!ReadAll(Seg.Fd, data.data() + sizeof(header), data.size() - sizeof(header), Offset + sizeof(header))) return false;
+		size_t used;
+		return DecodeRecord(data.data(), data.size(), false, &Record, used);
+	}
+
+	bool CaptureStore::Append(const Magstripe& Card, uint32_t Device, unsigned char Status, std::chrono::system_clock::time_point Timestamp) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		if(this->Segments.empty() || this->ReadOnly) return false;
+
+		RecordHeader header;
+		memset(&header, 0, sizeof(header));
+		header.Magic = RecordMagic;
+		header.Timestamp = ToNanoseconds(Timestamp);
+		header.Fingerprint = FingerprintMagstripe(Card);
+		header.Device = Device;
+		header.Format = (uint8_t)Card.GetCardDataFormat();
+		header.Status = Status;
+		std::vector<unsigned char> record(sizeof(header));
+		for(int i = 0; i < 3; i++) {
+			const unsigned char* data;
+			int len;
+			Track::TRACK_BIT_LEN bits;
+			if(!Card.PeekTrack(i + 1, data, len, bits)) continue;
+			len = std::min(len, 0xFFFF);
+			header.Length[i] = (uint16_t)len;
+			header.Bits[i] = (uint8_t)bits;
+			record.insert(record.end(), data, data + len);
+		}
+		header.Checksum = RecordChecksum(header, record.data() + sizeof(header), record.size() - sizeof(header));
+		memcpy(record.data(), &header, sizeof(header));
+
+		Segment* seg = this->Segments.back().get();
+		if(seg->Records > 0 && seg->Size + record.size() > CAPTURE_SEGMENT_BYTES) {
+			if(!this->Seal(*seg) || !this->CreateSegment(seg->Id + 1)) return false;
+			seg = this->Segments.back().get();
+		}
+		if(!WriteAll(seg->Fd, record.data(), record.size())) {
+			// Don't leave a torn record for the next append to follow
+			if(ftruncate(seg->Fd, seg->Size) == 0) lseek(seg->Fd, 0, SEEK_END);
+			return false;
+		}
+		seg->Add(header.Fingerprint, seg->Size, header.Timestamp);
+		seg->Size += record.size();
+		return true;
+	}
+
+	bool CaptureStore::Sync(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		if(this->Segments.empty() || this->ReadOnly) return false;
+		return fdatasync(this->Segments.back()->Fd) == 0;
+	}
+
+	size_t CaptureStore::Find(uint64_t Fingerprint, std::function<bool(const CaptureRecord&)> Visit) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		size_t visited = 0;
+		CaptureRecord record;
+		for(auto it = this->Segments.rbegin(); it != this->Segments.rend(); ++it) {
+			const Segment& seg = **it;
+			// Newest record of the segment first
+			if(seg.Sealed()) {
+				uint32_t bucket = BucketOf(Fingerprint, seg.BucketBits);
+				for(uint32_t i = seg.Buckets[bucket + 1]; i > seg.Buckets[bucket]; i--) {
+					const IndexPosting& p = seg.Postings[i - 1];
+					if(p.Fingerprint != Fingerprint) continue;
+					if(!this->ReadRecord(seg, p.Offset, record)) continue;
+					visited++;
+					if(!Visit(record)) return visited;
+				}
+			} else {
+				for(size_t i = seg.PendingPostings.size(); i > 0; i--) {
+					const IndexPosting& p = seg.PendingPostings[i - 1];
+					if(p.Fingerprint != Fingerprint) continue;
+					if(!this->ReadRecord(seg, p.Offset, record)) continue;
+					visited++;
+					if(!Visit(record)) return visited;
+				}
+			}
+		}
+		return visited;
+	}
+
+	size_t CaptureStore::Find(const Magstripe& Card, std::function<bool(const CaptureRecord&)> Visit) {
+		return this->Find(FingerprintMagstripe(Card), Visit);
+	}
+
+	bool CaptureStore::LastSeen(const Magstripe& Card, CaptureRecord& Record) {
+		return this->Find(Card, [&Record](const CaptureRecord& r) {
+			Record = r;
+			return false;
+		}) > 0;
+	}
+
+	size_t CaptureStore::Scan(std::chrono::system_clock::time_point From, std::chrono::system_clock::time_point To,
+		std::function<bool(const CaptureRecord&)> Visit) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		const int64_t from = ToNanoseconds(From);
+		const int64_t to = ToNanoseconds(To);
+		size_t visited = 0;
+		CaptureRecord record;
+		std::vector<unsigned char> data;
+		for(const std::unique_ptr<Segment>& seg : this->Segments) {
+			if(seg->Records == 0 || seg->MaxTime < from || seg->MinTime >= to) continue;
+			const IndexBlock* blocks = seg->GetBlocks();
+			uint32_t count = seg->GetBlockCount();
+			for(uint32_t b = 0; b < count; b++) {
+				if(blocks[b].MaxTime < from || blocks[b].MinTime >= to) continue;
+				uint64_t end = (b + 1 < count) ? blocks[b + 1].Offset : seg->Size;
+				data.resize(end - blocks[b].Offset);
+				if(!ReadAll(seg->Fd, data.data(), data.size(), blocks[b].Offset)) continue;
+				size_t offset = 0;
+				size_t used;
+				while(offset < data.size() && DecodeRecord(data.data() + offset, data.size() - offset, false, &record, used)) {
+					offset += used;
+					int64_t ts = ToNanoseconds(record.Timestamp);
+					if(ts < from || ts >= to) continue;
+					visited++;
+					if(!Visit(record)) return visited;
+				}
+			}
+		}
+		return visited;
+	}
+}
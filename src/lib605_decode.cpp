@@ -0,0 +1,308 @@
+/*
+	lib605_decode.cpp - Raw track decoding and the offline batch decoder
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_decode.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace lib605 {
+
+/*	==== START track decoding ====	*/
+
+	// ISO 7811 character set of a density
+	struct CharSet {
+		int DataBits;		// Data bits per character, the parity bit follows
+		char Base;			// ASCII value of the all-zero character
+		unsigned Start;		// Start sentinel value
+		unsigned End;		// End sentinel value
+	};
+
+	// 5 bit: ';' to '?' from '0', 7 bit: '%' to '?' from ' '
+	static const CharSet Numeric = { 4, '0', 0x0B, 0x0F };
+	static const CharSet Alpha = { 6, ' ', 0x05, 0x1F };
+
+	// Reads the track bits in swipe order, from either end of the data
+	class BitReader {
+		private:
+			const unsigned char* Raw;
+			int Bits;
+			bool Reverse;
+		public:
+			BitReader(const unsigned char* raw, int raw_len, bool reverse)
+				: Raw(raw), Bits(raw_len * 8), Reverse(reverse) {}
+
+			int Size(void) const { return this->Bits; }
+
+			int At(int i) const {
+				int b = this->Reverse ? (this->Bits - 1 - i) : i;
+				return (this->Raw[b >> 3] >> (b & 7)) & 1;
+			}
+
+			// Reads width bits LSB first, sets odd_parity to whether they hold an odd count of ones
+			unsigned Word(int pos, int width, bool& odd_parity) const {
+				unsigned value = 0;
+				int ones = 0;
+				for(int i = 0; i < width; i++) {
+					int bit = this->At(pos + i);
+					value |= (unsigned)bit << i;
+					ones += bit;
+				}
+				odd_parity = (ones & 1) != 0;
+				return value;
+			}
+	};
+
+	// Decodes from the first set bit onwards, false if that is not a start sentinel
+	static bool DecodeDirection(const BitReader& bits, const CharSet& cs, TrackDecode& out) {
+		const int width = cs.DataBits + 1;
+		const unsigned mask = (1u << cs.DataBits) - 1;
+		int pos = 0;
+		while(pos < bits.Size() && bits.At(pos) == 0) pos++;
+		if(pos + width > bits.Size()) return false;
+
+		bool odd;
+		unsigned word = bits.Word(pos, width, odd);
+		if((word & mask) != cs.Start || !odd) return false;
+
+		bool parity_ok = true;
+		unsigned lrc = 0;
+		out.Length = 0;
+		while(true) {
+			if(pos + width > bits.Size()) {
+				out.Status = DECODE_MISSING_SENTINEL;
+				break;
+			}
+			if(out.Length >= TRACK_MAX_CHARS) {
+				out.Status = DECODE_TRUNCATED;
+				break;
+			}
+			word = bits.Word(pos, width, odd);
+			pos += width;
+			unsigned value = word & mask;
+			if(!odd) parity_ok = false;
+			lrc ^= value;
+			out.Data[out.Length++] = (char)(cs.Base + value);
+			if(value != cs.End) continue;
+
+			// The LRC character follows the end sentinel
+			if(pos + width > bits.Size()) {
+				out.Status = parity_ok ? DECODE_LRC_ERROR : DECODE_PARITY_ERROR;
+				break;
+			}
+			word = bits.Word(pos, width, odd);
+			if(!parity_ok)
+				out.Status = DECODE_PARITY_ERROR;
+			else if((word & mask) != lrc || !odd)
+				out.Status = DECODE_LRC_ERROR;
+			else
+				out.Status = DECODE_OK;
+			break;
+		}
+		out.Data[out.Length] = '\0';
+		return true;
+	}
+
+	DECODE_STATUS DecodeRawTrack(const unsigned char* raw, int raw_len, Track::TRACK_BIT_LEN bits, TrackDecode& out) {
+		out.Length = 0;
+		out.Reversed = false;
+		out.Data[0] = '\0';
+
+		const CharSet* cs;
+		switch(bits) {
+			case Track::TRACK_5_BIT: cs = &Numeric; break;
+			case Track::TRACK_7_BIT: cs = &Alpha; break;
+			default: return (out.Status = DECODE_UNSUPPORTED);
+		}
+
+		bool blank = true;
+		for(int i = 0; raw != NULL && i < raw_len && blank; i++)
+			if(raw[i] != 0) blank = false;
+		if(blank) return (out.Status = DECODE_EMPTY);
+
+		if(DecodeDirection(BitReader(raw, raw_len, false), *cs, out)) return out.Status;
+		if(DecodeDirection(BitReader(raw, raw_len, true), *cs, out)) {
+			out.Reversed = true;
+			return out.Status;
+		}
+		out.Length = 0;
+		out.Data[0] = '\0';
+		return (out.Status = DECODE_MISSING_SENTINEL);
+	}
+
+	bool EncodeRawTrack(const char* chars, int len, Track::TRACK_BIT_LEN bits, int lead, bool reversed, unsigned char* raw, int raw_len) {
+		const CharSet* cs;
+		switch(bits) {
+			case Track::TRACK_5_BIT: cs = &Numeric; break;
+			case Track::TRACK_7_BIT: cs = &Alpha; break;
+			default: return false;
+		}
+		const int width = cs->DataBits + 1;
+		const unsigned mask = (1u << cs->DataBits) - 1;
+		const int total = raw_len * 8;
+		if(lead < 0 || len < 0 || (long)lead + (long)(len + 1) * width > total) return false;
+
+		memset(raw, 0, raw_len);
+		unsigned lrc = 0;
+		int pos = lead;
+		for(int i = 0; i <= len; i++) {
+			unsigned value = lrc;
+			if(i < len) {
+				value = (unsigned)((unsigned char)chars[i] - (unsigned char)cs->Base);
+				if((unsigned char)chars[i] < (unsigned char)cs->Base || value > mask) return false;
+				lrc ^= value;
+			}
+			int ones = 0;
+			for(int b = 0; b < width; b++) {
+				// The parity bit makes the count of ones odd
+				int bit = (b < cs->DataBits) ? (int)((value >> b) & 1) : !(ones & 1);
+				ones += bit;
+				if(!bit) continue;
+				int at = reversed ? (total - 1 - (pos + b)) : (pos + b);
+				raw[at >> 3] |= (unsigned char)(1 << (at & 7));
+			}
+			pos += width;
+		}
+		return true;
+	}
+
+/*	==== START BatchDecoder CLASS ====	*/
+
+	BatchDecoder::BatchDecoder(unsigned Threads, size_t ChunkSize) {
+		if(Threads == 0) Threads = std::thread::hardware_concurrency();
+		this->Threads = (Threads == 0) ? 1 : Threads;
+		this->ChunkSize = (ChunkSize == 0) ? 1 : ChunkSize;
+		this->SetTrackBits(Track::TRACK_7_BIT, Track::TRACK_5_BIT, Track::TRACK_5_BIT);
+	}
+
+	void BatchDecoder::SetTrackBits(Track::TRACK_BIT_LEN Track1, Track::TRACK_BIT_LEN Track2, Track::TRACK_BIT_LEN Track3) {
+		this->TrackBits[0] = Track1;
+		this->TrackBits[1] = Track2;
+		this->TrackBits[2] = Track3;
+	}
+
+	bool BatchDecoder::IndexRecords(const unsigned char* data, size_t len, std::vector<uint64_t>& offsets) {
+		size_t pos = 0;
+		while(pos < len) {
+			if(len - pos < 4) return false;
+			uint32_t rec_len = (uint32_t)data[pos] | ((uint32_t)data[pos + 1] << 8) |
+				((uint32_t)data[pos + 2] << 16) | ((uint32_t)data[pos + 3] << 24);
+			if(len - pos - 4 < rec_len) return false;
+			offsets.push_back(pos);
+			pos += 4 + (size_t)rec_len;
+		}
+		return true;
+	}
+
+	void BatchDecoder::DecodeRecord(const unsigned char* block, int len, DecodedRecord& out) const {
+		cmd::CardBlock cb;
+		out.Malformed = (cmd::ParseCardBlock(block, len, true, cb) <= 0);
+		out.Status = cb.Status;
+		for(int t = 0; t < 3; t++) {
+			if(out.Malformed)
+				DecodeRawTrack(NULL, 0, this->TrackBits[t], out.Tracks[t]);
+			else
+				DecodeRawTrack(&block[cb.Offset[t]], cb.Length[t], this->TrackBits[t], out.Tracks[t]);
+		}
+	}
+
+	bool BatchDecoder::Decode(const unsigned char* data, size_t len, const BatchDecoder::Callback& cb, BatchSummary& summary) const {
+		memset(&summary, 0, sizeof(summary));
+		std::vector<uint64_t> offsets;
+		if(!IndexRecords(data, len, offsets)) return false;
+		this->DecodeIndexed(data, offsets, cb, summary);
+		return true;
+	}
+
+	void BatchDecoder::DecodeIndexed(const unsigned char* data, const std::vector<uint64_t>& offsets, const BatchDecoder::Callback& cb,
+		BatchSummary& summary) const {
+		const size_t records = offsets.size();
+		const size_t chunks = (records + this->ChunkSize - 1) / this->ChunkSize;
+		const unsigned workers = (unsigned)std::min<size_t>(this->Threads, chunks);
+		std::atomic<size_t> next_chunk(0);
+		std::vector<BatchSummary> partial(workers);
+
+		auto work = [&](unsigned id) {
+			// Totals stay on the worker's stack, partial is only written once at the end
+			BatchSummary sum;
+			memset(&sum, 0, sizeof(sum));
+			DecodedRecord rec;
+			size_t chunk;
+			while((chunk = next_chunk.fetch_add(1, std::memory_order_relaxed)) < chunks) {
+				size_t end = std::min(records, (chunk + 1) * this->ChunkSize);
+				for(size_t i = chunk * this->ChunkSize; i < end; i++) {
+					const unsigned char* rec_data = data + offsets[i];
+					uint32_t rec_len = (uint32_t)rec_data[0] | ((uint32_t)rec_data[1] << 8) |
+						((uint32_t)rec_data[2] << 16) | ((uint32_t)rec_data[3] << 24);
+					rec.Offset = offsets[i];
+					this->DecodeRecord(rec_data + 4, (int)std::min<uint32_t>(rec_len, INT32_MAX), rec);
+
+					sum.Records++;
+					if(rec.Malformed) sum.Malformed++;
+					for(int t = 0; t < 3; t++) sum.TrackStatus[t][rec.Tracks[t].Status]++;
+					if(cb) cb(i, rec);
+				}
+			}
+			partial[id] = sum;
+		};
+
+		std::vector<std::thread> pool;
+		for(unsigned i = 1; i < workers; i++) pool.push_back(std::thread(work, i));
+		if(workers > 0) work(0);
+		for(std::thread& t : pool) t.join();
+
+		for(const BatchSummary& sum : partial) {
+			summary.Records += sum.Records;
+			summary.Malformed += sum.Malformed;
+			for(int t = 0; t < 3; t++)
+				for(int s = 0; s < DECODE_STATUS_COUNT; s++)
+					summary.TrackStatus[t][s] += sum.TrackStatus[t][s];
+		}
+	}
+
+	bool BatchDecoder::Decode(const unsigned char* data, size_t len, std::vector<DecodedRecord>& out, BatchSummary& summary) const {
+		memset(&summary, 0, sizeof(summary));
+		// Count first so the output is allocated once and every slot has a single writer
+		std::vector<uint64_t> offsets;
+		if(!IndexRecords(data, len, offsets)) return false;
+		out.resize(offsets.size());
+		this->DecodeIndexed(data, offsets, [&out](size_t i, const DecodedRecord& rec) { out[i] = rec; }, summary);
+		return true;
+	}
+
+	bool BatchDecoder::DecodeFile(const std::string& Path, const BatchDecoder::Callback& cb, BatchSummary& summary) const {
+		int fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) return false;
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			close(fd);
+			return false;
+		}
+		if(st.st_size == 0) {
+			close(fd);
+			return this->Decode(NULL, 0, cb, summary);
+		}
+		void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if(map == MAP_FAILED) return false;
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		bool ok = this->Decode((const unsigned char*)map, st.st_size, cb, summary);
+		munmap(map, st.st_size);
+		return ok;
+	}
+}
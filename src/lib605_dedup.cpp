@@ -0,0 +1,209 @@
+/*
+	lib605_dedup.cpp - Duplicate swipe detection
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_dedup.hpp"
+#include "./include/lib605_decode.hpp"
+
+#include <string.h>
+
+namespace lib605 {
+
+	// Slots probed per lookup
+	static const size_t ProbeLength = 8;
+
+/*	==== START hashing ====	*/
+
+	static inline uint64_t Rotl(uint64_t x, int b) {
+		return (x << b) | (x >> (64 - b));
+	}
+
+	static inline uint64_t Load64(const unsigned char* p) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		return v;
+	}
+
+	// Incremental SipHash-2-4
+	class SipHash {
+		private:
+			uint64_t V0, V1, V2, V3;
+			unsigned char Tail[8];
+			size_t TailLen;
+			uint64_t Total;
+
+			void Round(void) {
+				V0 += V1; V1 = Rotl(V1, 13); V1 ^= V0; V0 = Rotl(V0, 32);
+				V2 += V3; V3 = Rotl(V3, 16); V3 ^= V2;
+				V0 += V3; V3 = Rotl(V3, 21); V3 ^= V0;
+				V2 += V1; V1 = Rotl(V1, 17); V1 ^= V2; V2 = Rotl(V2, 32);
+			}
+
+			void Block(uint64_t m) {
+				V3 ^= m;
+				this->Round();
+				this->Round();
+				V0 ^= m;
+			}
+		public:
+			SipHash(const unsigned char* key) : TailLen(0), Total(0) {
+				uint64_t k0 = Load64(key), k1 = Load64(key + 8);
+				V0 = k0 ^ 0x736f6d6570736575ULL;
+				V1 = k1 ^ 0x646f72616e646f6dULL;
+				V2 = k0 ^ 0x6c7967656e657261ULL;
+				V3 = k1 ^ 0x7465646279746573ULL;
+			}
+
+			void Update(const unsigned char* data, size_t len) {
+				this->Total += len;
+				while(len > 0) {
+					this->Tail[this->TailLen++] = *data++;
+					len--;
+					if(this->TailLen == 8) {
+						this->Block(Load64(this->Tail));
+						this->TailLen = 0;
+					}
+				}
+			}
+
+			uint64_t Final(void) {
+				uint64_t b = this->Total << 56;
+				for(size_t i = 0; i < this->TailLen; i++) b |= (uint64_t)this->Tail[i] << (8 * i);
+				this->Block(b);
+				V2 ^= 0xff;
+				for(int i = 0; i < 4; i++) this->Round();
+				return V0 ^ V1 ^ V2 ^ V3;
+			}
+	};
+
+	// Unkeyed 64 bit FNV-1a with a final avalanche, tracks are short
+	class FastHash {
+		private:
+			uint64_t H;
+		public:
+			FastHash(void) : H(0xcbf29ce484222325ULL) {}
+
+			void Update(const unsigned char* data, size_t len) {
+				for(size_t i = 0; i < len; i++) {
+					this->H ^= data[i];
+					this->H *= 0x100000001b3ULL;
+				}
+			}
+
+			uint64_t Final(void) {
+				uint64_t h = this->H;
+				h ^= h >> 33;
+				h *= 0xff51afd7ed558ccdULL;
+				h ^= h >> 33;
+				h *= 0xc4ceb9fe1a85ec53ULL;
+				h ^= h >> 33;
+				return h;
+			}
+	};
+
+	// Feeds the format and each track, length first so tracks can't run into each other.
+	// Raw bits of the same card differ from swipe to swipe in their leading zeros and
+	// direction, so a raw track that decodes is fed as its characters instead
+	template<typename H>
+	static uint64_t HashMagstripe(H& h, const Magstripe& sMagstripe) {
+		unsigned char format = (unsigned char)sMagstripe.GetCardDataFormat();
+		bool raw = (sMagstripe.GetCardDataFormat() == Magstripe::RAW);
+		h.Update(&format, 1);
+		for(int i = 0; i < 3; i++) {
+			const unsigned char* data;
+			int data_len;
+			Track::TRACK_BIT_LEN bits;
+			uint32_t len = sMagstripe.PeekTrack(i + 1, data, data_len, bits) ? (uint32_t)data_len : 0;
+			unsigned char kind = 0;
+			if(raw && len > 0) {
+				const TrackDecode* decoded = (i == 0) ? sMagstripe.GetDecodedTrack1()
+					: (i == 1) ? sMagstripe.GetDecodedTrack2() : sMagstripe.GetDecodedTrack3();
+				if(decoded != NULL && decoded->Status == DECODE_OK) {
+					kind = 1;
+					data = (const unsigned char*)decoded->Data;
+					len = (uint32_t)decoded->Length;
+				}
+			}
+			unsigned char len_bytes[5] = { kind, (unsigned char)len, (unsigned char)(len >> 8), (unsigned char)(len >> 16), (unsigned char)(len >> 24) };
+			h.Update(len_bytes, 5);
+			if(len > 0) h.Update(data, len);
+		}
+		return h.Final();
+	}
+
+	uint64_t FingerprintMagstripe(const Magstripe& sMagstripe, const unsigned char* Key) {
+		if(Key != NULL) {
+			SipHash h(Key);
+			return HashMagstripe(h, sMagstripe);
+		}
+		FastHash h;
+		return HashMagstripe(h, sMagstripe);
+	}
+
+/*	==== START DuplicateFilter CLASS ====	*/
+
+	DuplicateFilter::DuplicateFilter(std::chrono::milliseconds Window, size_t Capacity) {
+		size_t size = ProbeLength;
+		while(size < Capacity) size <<= 1;
+		this->Table.resize(size);
+		this->Window = Window;
+		this->Keyed = false;
+		memset(this->Key, 0, sizeof(this->Key));
+		this->Clear();
+	}
+
+	void DuplicateFilter::SetKey(const unsigned char* Key) {
+		this->Keyed = (Key != NULL);
+		if(this->Keyed) memcpy(this->Key, Key, sizeof(this->Key));
+		// Fingerprints from the old hash would never match again
+		this->Clear();
+	}
+
+	uint64_t DuplicateFilter::Fingerprint(const Magstripe& sMagstripe) const {
+		return FingerprintMagstripe(sMagstripe, this->Keyed ? this->Key : NULL);
+	}
+
+	bool DuplicateFilter::Check(const Magstripe& sMagstripe) {
+		return this->Check(this->Fingerprint(sMagstripe), std::chrono::steady_clock::now());
+	}
+
+	bool DuplicateFilter::Check(uint64_t Fingerprint, std::chrono::steady_clock::time_point Now) {
+		if(Fingerprint == 0) Fingerprint = 1;
+		const size_t mask = this->Table.size() - 1;
+		size_t start = (size_t)(Fingerprint ^ (Fingerprint >> 32)) & mask;
+		Entry* victim = NULL;
+		int victim_rank = 0;
+
+		for(size_t i = 0; i < ProbeLength; i++) {
+			Entry& e = this->Table[(start + i) & mask];
+			bool live = (e.Hash != 0 && Now - e.Seen <= this->Window);
+			if(live && e.Hash == Fingerprint) {
+				e.Seen = Now;
+				return true;
+			}
+			// Reuse an empty slot first, then an expired one, then the oldest in the run
+			int rank = (e.Hash == 0) ? 0 : (live ? 2 : 1);
+			if(victim == NULL || rank < victim_rank || (rank == 2 && victim_rank == 2 && e.Seen < victim->Seen)) {
+				victim = &e;
+				victim_rank = rank;
+			}
+		}
+		victim->Hash = Fingerprint;
+		victim->Seen = Now;
+		return false;
+	}
+
+	void DuplicateFilter::Clear(void) {
+		for(Entry& e : this->Table) {
+			e.Hash = 0;
+			e.Seen = std::chrono::steady_clock::time_point();
+		}
+	}
+}
@@ -0,0 +1,110 @@
+/*
+	lib605_discovery.cpp - Serial port enumeration and reader discovery
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_discovery.hpp"
+#include "./include/lib605.hpp"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+#include <thread>
+
+namespace lib605 {
+
+	// Serial nodes created by the usbserial drivers readers show up under
+	static const char* const SerialPrefixes[] = { "ttyUSB", "ttyACM" };
+
+	std::string ResolveDevicePath(const std::string& Path) {
+		char resolved[PATH_MAX];
+		if(realpath(Path.c_str(), resolved) == NULL) return "";
+		return resolved;
+	}
+
+	// Lists the entries of a directory accepted by the filter, sorted
+	template<typename F>
+	static std::vector<std::string> ListDirectory(const std::string& dir, F filter) {
+		std::vector<std::string> entries;
+		DIR* d = opendir(dir.c_str());
+		if(d == NULL) return entries;
+		struct dirent* ent;
+		while((ent = readdir(d)) != NULL) {
+			if(ent->d_name[0] == '.') continue;
+			if(filter(ent->d_name)) entries.push_back(dir + "/" + ent->d_name);
+		}
+		closedir(d);
+		std::sort(entries.begin(), entries.end());
+		return entries;
+	}
+
+	std::vector<std::string> EnumerateSerialDevices(void) {
+		std::vector<std::string> devices;
+		std::set<std::string> seen;
+
+		// Stable names first so they win over the tty node they point at
+		auto by_id = ListDirectory("/dev/serial/by-id", [](const char*) { return true; });
+		for(const std::string& path : by_id) {
+			std::string node = ResolveDevicePath(path);
+			if(node.empty() || !seen.insert(node).second) continue;
+			devices.push_back(path);
+		}
+
+		auto nodes = ListDirectory("/dev", [](const char* name) {
+			for(const char* prefix : SerialPrefixes)
+				if(strncmp(name, prefix, strlen(prefix)) == 0) return true;
+			return false;
+		});
+		for(const std::string& node : nodes) {
+			if(!seen.insert(node).second) continue;
+			devices.push_back(node);
+		}
+		return devices;
+	}
+
+	// Probes a single port, leaves Model empty if it is not a reader
+	static void ProbeDevice(DiscoveredDevice& dev, std::chrono::milliseconds Timeout) {
+		MSR msr(dev.Path);
+		msr.SetTimeout(Timeout);
+		if(!msr.Connect()) return;
+		if(msr.TestCommunication()) {
+			std::string model = msr.GetModel();
+			std::string version = msr.GetFirmwareVersion();
+			if(model != "ERROR" && version != "ERROR") {
+				dev.Model = model;
+				dev.FirmwareVersion = version;
+			}
+		}
+		msr.Disconnect();
+	}
+
+	std::vector<DiscoveredDevice> DiscoverDevices(std::chrono::milliseconds Timeout) {
+		std::vector<std::string> paths = EnumerateSerialDevices();
+		std::vector<DiscoveredDevice> candidates(paths.size());
+		std::vector<std::thread> probes;
+		probes.reserve(paths.size());
+
+		// Each probe only touches its own slot
+		for(size_t i = 0; i < paths.size(); i++) {
+			candidates[i].Path = paths[i];
+			candidates[i].Node = ResolveDevicePath(paths[i]);
+			probes.push_back(std::thread(ProbeDevice, std::ref(candidates[i]), Timeout));
+		}
+		for(std::thread& t : probes) t.join();
+
+		std::vector<DiscoveredDevice> found;
+		for(DiscoveredDevice& dev : candidates)
+			if(!dev.Model.empty()) found.push_back(dev);
+		return found;
+	}
+}
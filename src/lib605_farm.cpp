@@ -0,0 +1,232 @@
+/*
+	lib605_farm.cpp - Writing card batches across several writers
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_farm.hpp"
+
+#include <algorithm>
+#include <thread>
+
+namespace lib605 {
+
+	WriteFarm::WriteFarm(unsigned MaxAttempts, unsigned FailureLimit) {
+		this->MaxAttempts = std::max(MaxAttempts, 1u);
+		this->FailureLimit = std::max(FailureLimit, 1u);
+		this->Batch = NULL;
+		this->Running = false;
+		this->Pending = 0;
+		this->Stats = FarmStats();
+	}
+
+	bool WriteFarm::AddStation(MSR& Device) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		if(this->Running || this->Stations.size() >= FARM_MAX_STATIONS) return false;
+		Station station;
+		station.Device = &Device;
+		station.Stats = StationStats();
+		station.Streak = 0;
+		this->Stations.push_back(station);
+		return true;
+	}
+
+	WriteResult WriteFarm::MakeResult(const Job& Done, bool Written) {
+		WriteResult result;
+		result.Index = Done.Index;
+		result.Written = Written;
+		result.Station = Done.Station;
+		result.Attempts = Done.Attempts;
+		result.Status = Done.Status;
+		return result;
+	}
+
+	bool WriteFarm::Run(const std::vector<Magstripe>& Cards, Callback OnResult) {
+		{
+			std::lock_guard<std::mutex> guard(this->Lock);
+			if(this->Running || this->Stations.empty()) return false;
+			this->Running = true;
+			this->Batch = &Cards;
+			this->OnResult = OnResult;
+			this->Stopper.Reset();
+			this->Pending = Cards.size();
+			this->Stats = FarmStats();
+			this->Stats.Cards = Cards.size();
+			// Dealt out in runs, so stealing from the back leaves each writer's run in order
+			const size_t count = this->Stations.size();
+			for(Station& station : this->Stations) {
+				station.Queue.clear();
+				station.Stats = StationStats();
+				station.Streak = 0;
+			}
+			for(size_t i = 0; i < Cards.size(); i++) {
+				Job job = { i, 0, 0, i * count / Cards.size(), 0 };
+				this->Stations[job.Station].Queue.push_back(job);
+			}
+			this->Started = std::chrono::steady_clock::now();
+		}
+
+		std::vector<std::thread> workers;
+		for(size_t i = 1; i < this->Stations.size(); i++) workers.push_back(std::thread(&WriteFarm::Work, this, i));
+		this->Work(0);
+		for(std::thread& worker : workers) worker.join();
+
+		// Whatever is left was stopped before it was written
+		std::vector<WriteResult> report;
+		bool ok;
+		{
+			std::lock_guard<std::mutex> guard(this->Lock);
+			for(Station& station : this->Stations) {
+				for(const Job& job : station.Queue) report.push_back(MakeResult(job, false));
+				station.Queue.clear();
+			}
+			this->Finished = std::chrono::steady_clock::now();
+			this->Running = false;
+			ok = (this->Stats.Written == Cards.size());
+		}
+		if(OnResult)
+			for(const WriteResult& result : report) OnResult(result);
+		return ok;
+	}
+
+	void WriteFarm::Stop(void) {
+		this->Stopper.Cancel();
+		// Taken so a worker can't miss the wakeup between checking the token and waiting
+		{
+			std::lock_guard<std::mutex> guard(this->Lock);
+		}
+		this->Changed.notify_all();
+	}
+
+	void WriteFarm::Work(size_t Id) {
+		Station& station = this->Stations[Id];
+		std::vector<WriteResult> report;
+		while(true) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> guard(this->Lock);
+				while(true) {
+					if(this->Pending == 0 || this->Stopper.IsCancelled() || station.Stats.Retired) return;
+					if(this->Take(Id, job)) break;
+					this->Changed.wait(guard);
+				}
+			}
+
+			bool written = station.Device->WriteCard((*this->Batch)[job.Index], &this->Stopper);
+			{
+				std::lock_guard<std::mutex> guard(this->Lock);
+				if(station.Device->WasCancelled()) {
+					// Not tried, reported with the rest of the queue
+					station.Queue.push_front(job);
+					return;
+				}
+				job.Status = station.Device->GetLastStatus();
+				this->Finish(Id, job, written, report);
+			}
+			this->Changed.notify_all();
+			if(this->OnResult)
+				for(const WriteResult& result : report) this->OnResult(result);
+			report.clear();
+		}
+	}
+
+	bool WriteFarm::Take(size_t Id, Job& Out) {
+		std::deque<Job>& own = this->Stations[Id].Queue;
+		if(!own.empty()) {
+			Out = own.front();
+			own.pop_front();
+			return true;
+		}
+
+		// From the back of the longest queue, skipping cards that already failed here
+		const uint64_t self = (uint64_t)1 << Id;
+		std::deque<Job>* victim = NULL;
+		size_t pick = 0;
+		for(size_t i = 0; i < this->Stations.size(); i++) {
+			std::deque<Job>& queue = this->Stations[i].Queue;
+			if(i == Id || (victim != NULL && queue.size() <= victim->size())) continue;
+			for(size_t j = queue.size(); j > 0; j--) {
+				if(!(queue[j - 1].Tried & self)) {
+					victim = &queue;
+					pick = j - 1;
+					break;
+				}
+			}
+		}
+		if(victim == NULL) return false;
+		Out = (*victim)[pick];
+		victim->erase(victim->begin() + pick);
+		this->Stations[Id].Stats.Stolen++;
+		return true;
+	}
+
+	bool WriteFarm::Requeue(const Job& Failed) {
+		Station* target = NULL;
+		for(size_t i = 0; i < this->Stations.size(); i++) {
+			Station& station = this->Stations[i];
+			if(station.Stats.Retired || (Failed.Tried & ((uint64_t)1 << i))) continue;
+			if(target == NULL || station.Queue.size() < target->Queue.size()) target = &station;
+		}
+		if(target == NULL) return false;
+		// Ahead of the cards queued there, so the batch doesn't end waiting on retries
+		target->Queue.push_front(Failed);
+		return true;
+	}
+
+	void WriteFarm::Finish(size_t Id, Job& Done, bool Written, std::vector<WriteResult>& Report) {
+		Station& station = this->Stations[Id];
+		Done.Attempts++;
+		Done.Station = Id;
+		if(Written) {
+			station.Stats.Written++;
+			station.Streak = 0;
+			this->Stats.Written++;
+			this->Pending--;
+			Report.push_back(MakeResult(Done, true));
+			return;
+		}
+
+		station.Stats.Failed++;
+		station.Streak++;
+		Done.Tried |= (uint64_t)1 << Id;
+		if(Done.Attempts < this->MaxAttempts && this->Requeue(Done)) {
+			this->Stats.Retries++;
+		} else {
+			this->Stats.Failed++;
+			this->Pending--;
+			Report.push_back(MakeResult(Done, false));
+		}
+		if(station.Streak >= this->FailureLimit) this->Retire(Id, Report);
+	}
+
+	void WriteFarm::Retire(size_t Id, std::vector<WriteResult>& Report) {
+		Station& station = this->Stations[Id];
+		station.Stats.Retired = true;
+#if defined(DEBUG)
+		std::cout << "[*] Write farm: retiring station " << Id << " after " << station.Streak << " failed writes" << std::endl;
+#endif
+		std::deque<Job> queue;
+		queue.swap(station.Queue);
+		for(const Job& job : queue) {
+			if(this->Requeue(job)) continue;
+			this->Stats.Failed++;
+			this->Pending--;
+			Report.push_back(MakeResult(job, false));
+		}
+	}
+
+	FarmStats WriteFarm::GetStats(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		FarmStats stats = this->Stats;
+		for(const Station& station : this->Stations) stats.Stations.push_back(station.Stats);
+		std::chrono::steady_clock::time_point end = this->Running ? std::chrono::steady_clock::now() : this->Finished;
+		double minutes = std::chrono::duration<double>(end - this->Started).count() / 60;
+		stats.CardsPerMinute = (minutes > 0) ? stats.Written / minutes : 0;
+		return stats;
+	}
+}
@@ -0,0 +1,185 @@
+/*
+	lib605_format.cpp - Allocation-free text, hex and JSON renderings of card data
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_format.hpp"
+
+#include <string.h>
+
+namespace lib605 {
+
+	static const char HexDigits[] = "0123456789ABCDEF";
+
+	// Appends to a fixed buffer, counting what would not fit
+	class Writer {
+		private:
+			char* Buf;
+			size_t Size;
+			size_t Pos;
+		public:
+			Writer(char* buf, size_t size) : Buf(buf), Size(size), Pos(0) {}
+
+			void Put(char c) {
+				if(this->Pos + 1 < this->Size) this->Buf[this->Pos] = c;
+				this->Pos++;
+			}
+
+			void Put(const char* s) {
+				while(*s) this->Put(*s++);
+			}
+
+			void PutHex(unsigned char b) {
+				this->Put(HexDigits[b >> 4]);
+				this->Put(HexDigits[b & 0x0F]);
+			}
+
+			void PutInt(int v) {
+				char digits[12];
+				int n = 0;
+				unsigned u = (v < 0) ? 0u - (unsigned)v : (unsigned)v;
+				do {
+					digits[n++] = (char)('0' + u % 10);
+					u /= 10;
+				} while(u != 0);
+				if(v < 0) this->Put('-');
+				while(n > 0) this->Put(digits[--n]);
+			}
+
+			// Terminates the output and returns the full length
+			size_t Finish(void) {
+				if(this->Size > 0) this->Buf[(this->Pos < this->Size) ? this->Pos : this->Size - 1] = '\0';
+				return this->Pos;
+			}
+	};
+
+	static int BitCount(Track::TRACK_BIT_LEN bits) {
+		switch(bits) {
+			case Track::TRACK_5_BIT: return 5;
+			case Track::TRACK_7_BIT: return 7;
+			case Track::TRACK_8_BIT: return 8;
+			default: return 0;
+		}
+	}
+
+	static void PutHex(Writer& w, const unsigned char* data, int len) {
+		for(int i = 0; i < len; i++) w.PutHex(data[i]);
+	}
+
+	static void PutASCII(Writer& w, const unsigned char* data, int len) {
+		for(int i = 0; i < len; i++) {
+			if(data[i] >= 0x20 && data[i] < 0x7F) {
+				w.Put((char)data[i]);
+			} else {
+				w.Put("\\x");
+				w.PutHex(data[i]);
+			}
+		}
+	}
+
+	// JSON string contents, control characters and non-ASCII bytes are \u escaped
+	static void PutJSONString(Writer& w, const unsigned char* data, int len) {
+		for(int i = 0; i < len; i++) {
+			unsigned char c = data[i];
+			if(c == '"' || c == '\\') {
+				w.Put('\\');
+				w.Put((char)c);
+			} else if(c >= 0x20 && c < 0x7F) {
+				w.Put((char)c);
+			} else {
+				w.Put("\\u00");
+				w.PutHex(c);
+			}
+		}
+	}
+
+	static void PutJSON(Writer& w, const unsigned char* data, int len, Track::TRACK_BIT_LEN bits, bool hex) {
+		w.Put("{\"bits\":");
+		w.PutInt(BitCount(bits));
+		w.Put(",\"length\":");
+		w.PutInt(len);
+		if(hex) {
+			w.Put(",\"hex\":\"");
+			PutHex(w, data, len);
+		} else {
+			w.Put(",\"data\":\"");
+			PutJSONString(w, data, len);
+		}
+		w.Put("\"}");
+	}
+
+	size_t FormatHex(const Track& sTrack, char* buf, size_t size) {
+		Writer w(buf, size);
+		PutHex(w, sTrack.GetTrackData(), sTrack.GetTrackDataLength());
+		return w.Finish();
+	}
+
+	size_t FormatASCII(const Track& sTrack, char* buf, size_t size) {
+		Writer w(buf, size);
+		PutASCII(w, sTrack.GetTrackData(), sTrack.GetTrackDataLength());
+		return w.Finish();
+	}
+
+	size_t FormatJSON(const Track& sTrack, bool Hex, char* buf, size_t size) {
+		Writer w(buf, size);
+		PutJSON(w, sTrack.GetTrackData(), sTrack.GetTrackDataLength(), sTrack.GetTrackBitLength(), Hex);
+		return w.Finish();
+	}
+
+	size_t FormatText(const Magstripe& sMagstripe, char* buf, size_t size) {
+		Writer w(buf, size);
+		bool raw = (sMagstripe.GetCardDataFormat() == Magstripe::RAW);
+		w.Put("Card Format: ");
+		w.Put(raw ? "Raw\n" : "ISO\n");
+
+		for(int i = 0; i < 3; i++) {
+			const unsigned char* data;
+			int len;
+			Track::TRACK_BIT_LEN bits;
+			if(!sMagstripe.PeekTrack(i + 1, data, len, bits) || len == 0) {
+				w.Put("Track ");
+				w.PutInt(i + 1);
+				w.Put(": EMPTY\n");
+				continue;
+			}
+			w.Put("\tTrack bit length: ");
+			w.PutInt(BitCount(bits));
+			w.Put("\n\tData length: ");
+			w.PutInt(len);
+			w.Put("\n\tTrack Data: ");
+			if(raw)
+				PutHex(w, data, len);
+			else
+				PutASCII(w, data, len);
+			w.Put('\n');
+		}
+		return w.Finish();
+	}
+
+	size_t FormatJSON(const Magstripe& sMagstripe, char* buf, size_t size) {
+		Writer w(buf, size);
+		bool raw = (sMagstripe.GetCardDataFormat() == Magstripe::RAW);
+		w.Put("{\"format\":");
+		w.Put(raw ? "\"RAW\"" : "\"ISO\"");
+		w.Put(",\"tracks\":[");
+
+		for(int i = 0; i < 3; i++) {
+			const unsigned char* data;
+			int len;
+			Track::TRACK_BIT_LEN bits;
+			if(i > 0) w.Put(',');
+			if(!sMagstripe.PeekTrack(i + 1, data, len, bits))
+				w.Put("null");
+			else
+				PutJSON(w, data, len, bits, raw);
+		}
+		w.Put("]}");
+		return w.Finish();
+	}
+}
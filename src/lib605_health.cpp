@@ -0,0 +1,139 @@
+/*
+	lib605_health.cpp - Background health probing of idle readers
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_health.hpp"
+
+#include <algorithm>
+
+namespace lib605 {
+
+	// Weight of a new round trip in the recent and long term averages
+	static const double RecentWeight = 0.3;
+	static const double BaselineWeight = 0.05;
+	// Answered probes before round trips are compared against the baseline
+	static const uint64_t WarmupProbes = 5;
+
+	HealthMonitor::HealthMonitor(MSR& Device, std::chrono::milliseconds Interval, std::chrono::milliseconds Timeout) : Device(Device) {
+		this->Interval = Interval;
+		this->Timeout = Timeout;
+		this->FailureLimit = 3;
+		this->SlowFactor = 3.0;
+		this->Status = HealthStatus();
+		this->Status.Healthy = true;
+		this->Failing = false;
+		this->Slow = false;
+		this->Stopping = false;
+	}
+
+	HealthMonitor::~HealthMonitor(void) {
+		this->Stop();
+	}
+
+	void HealthMonitor::SetCallback(Callback OnChange) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		this->OnChange = OnChange;
+	}
+
+	void HealthMonitor::SetThresholds(unsigned FailureLimit, double SlowFactor) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		this->FailureLimit = std::max(FailureLimit, 1u);
+		this->SlowFactor = SlowFactor;
+	}
+
+	bool HealthMonitor::Start(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		if(this->Worker.joinable()) return false;
+		this->Stopping = false;
+		this->Worker = std::thread(&HealthMonitor::Loop, this);
+		return true;
+	}
+
+	void HealthMonitor::Stop(void) {
+		{
+			std::lock_guard<std::mutex> guard(this->Lock);
+			this->Stopping = true;
+		}
+		this->Wakeup.notify_all();
+		if(this->Worker.joinable()) this->Worker.join();
+	}
+
+	HealthStatus HealthMonitor::GetStatus(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		return this->Status;
+	}
+
+	void HealthMonitor::Loop(void) {
+		// A busy reader is tried again sooner than a full interval
+		const std::chrono::milliseconds retry = std::max(this->Interval / 10, std::chrono::milliseconds(50));
+		std::chrono::milliseconds wait = this->Interval;
+		std::unique_lock<std::mutex> guard(this->Lock);
+		while(true) {
+			this->Wakeup.wait_for(guard, wait, [this] { return this->Stopping; });
+			if(this->Stopping) break;
+
+			// The probe can take up to Timeout, don't hold up GetStatus meanwhile
+			guard.unlock();
+			std::chrono::microseconds rtt(0);
+			MSR::PROBE_RESULT result = this->Device.ProbeIfIdle(this->Timeout, rtt);
+			guard.lock();
+
+			wait = (result == MSR::PROBE_SKIPPED) ? retry : this->Interval;
+			int event = this->Record(result, rtt);
+			if(event < 0 || !this->OnChange) continue;
+			Callback callback = this->OnChange;
+			HealthStatus status = this->Status;
+			guard.unlock();
+			callback((HEALTH_EVENT)event, status);
+			guard.lock();
+		}
+	}
+
+	int HealthMonitor::Record(MSR::PROBE_RESULT Result, std::chrono::microseconds RoundTrip) {
+		HealthStatus& s = this->Status;
+		if(Result == MSR::PROBE_SKIPPED) {
+			s.Skipped++;
+			return -1;
+		}
+		s.Probes++;
+		s.LastProbe = std::chrono::system_clock::now();
+		bool was_healthy = s.Healthy;
+		int event = -1;
+
+		if(Result == MSR::PROBE_FAILED) {
+			s.Failures++;
+			s.FailureStreak++;
+			if(!this->Failing && s.FailureStreak >= this->FailureLimit) {
+				this->Failing = true;
+				event = HEALTH_FAILING;
+			}
+		} else {
+			s.FailureStreak = 0;
+			this->Failing = false;
+			double ms = RoundTrip.count() / 1000.0;
+			uint64_t answered = s.Probes - s.Failures;
+			if(answered == 1) {
+				s.RoundTripMs = ms;
+				s.BaselineMs = ms;
+			} else {
+				s.RoundTripMs += RecentWeight * (ms - s.RoundTripMs);
+				// Held while slow, so the baseline doesn't drift up to the degraded speed
+				if(!this->Slow) s.BaselineMs += BaselineWeight * (ms - s.BaselineMs);
+			}
+			bool slow = answered > WarmupProbes && s.RoundTripMs > this->SlowFactor * s.BaselineMs;
+			if(slow && !this->Slow) event = HEALTH_SLOW;
+			this->Slow = slow;
+		}
+
+		s.Healthy = !this->Failing && !this->Slow;
+		if(s.Healthy && !was_healthy) event = HEALTH_RECOVERED;
+		return event;
+	}
+}
@@ -0,0 +1,106 @@
+/*
+	lib605_profile.cpp - Persistent per-device profiles for warm restarts
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_profile.hpp"
+#include "./include/lib605_discovery.hpp"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace lib605 {
+
+	static const char* const ByIdDir = "/dev/serial/by-id/";
+
+	// On-disk layout: a header followed by the MSR::Profile as laid out in memory,
+	// Length and Version reject profiles written by another build
+	struct ProfileHeader {
+		char Magic[8];		// "L605PRF"
+		uint32_t Version;
+		uint32_t Length;
+		uint32_t Checksum;	// FNV-1a of the profile bytes
+		uint32_t Reserved;
+	};
+
+	static const uint32_t ProfileVersion = 1;
+
+	static uint32_t Checksum(const void* data, size_t len) {
+		const unsigned char* p = (const unsigned char*)data;
+		uint32_t h = 2166136261u;
+		for(size_t i = 0; i < len; i++) {
+			h ^= p[i];
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	std::string StableDevicePath(const std::string& Device) {
+		if(Device.compare(0, strlen(ByIdDir), ByIdDir) == 0) return Device;
+		std::string node = ResolveDevicePath(Device);
+		if(node.empty()) return Device;
+		for(const std::string& path : EnumerateSerialDevices()) {
+			if(path.compare(0, strlen(ByIdDir), ByIdDir) != 0) break;
+			if(ResolveDevicePath(path) == node) return path;
+		}
+		return Device;
+	}
+
+	std::string ProfileKey(const std::string& Device) {
+		std::string path = StableDevicePath(Device);
+		if(path.compare(0, strlen(ByIdDir), ByIdDir) == 0) return path.substr(strlen(ByIdDir));
+		std::string key = path;
+		for(char& c : key)
+			if(c == '/') c = '_';
+		return key;
+	}
+
+	bool LoadProfile(const std::string& Dir, const std::string& Key, MSR::Profile& Profile) {
+		int fd = open((Dir + "/" + Key).c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) return false;
+		ProfileHeader header;
+		MSR::Profile p;
+		bool ok = read(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+			memcmp(header.Magic, "L605PRF", 8) == 0 &&
+			header.Version == ProfileVersion &&
+			header.Length == sizeof(p) &&
+			read(fd, &p, sizeof(p)) == (ssize_t)sizeof(p) &&
+			header.Checksum == Checksum(&p, sizeof(p));
+		close(fd);
+		if(ok) Profile = p;
+		return ok;
+	}
+
+	bool SaveProfile(const std::string& Dir, const std::string& Key, const MSR::Profile& Profile) {
+		if(mkdir(Dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+		ProfileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.Magic, "L605PRF", 8);
+		header.Version = ProfileVersion;
+		header.Length = sizeof(Profile);
+		header.Checksum = Checksum(&Profile, sizeof(Profile));
+
+		// Readers never see a half written profile
+		std::string path = Dir + "/" + Key;
+		std::string tmp = path + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(fd < 0) return false;
+		bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+			write(fd, &Profile, sizeof(Profile)) == (ssize_t)sizeof(Profile);
+		if(close(fd) != 0) ok = false;
+		if(ok) ok = (rename(tmp.c_str(), path.c_str()) == 0);
+		if(!ok) unlink(tmp.c_str());
+		return ok;
+	}
+}
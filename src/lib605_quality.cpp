@@ -0,0 +1,166 @@
+/*
+	lib605_quality.cpp - Per track read quality counters
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_quality.hpp"
+
+#include <string.h>
+
+namespace lib605 {
+
+	static READ_OUTCOME DeviceOutcome(unsigned char status) {
+		switch(status) {
+			case cmd::RW_ERROR: return READ_RW_ERROR;
+			case cmd::CFMT_ERROR: return READ_FORMAT_ERROR;
+			case cmd::INVALID_SWP: return READ_INVALID_SWIPE;
+			default: return READ_DEVICE_ERROR;
+		}
+	}
+
+	READ_OUTCOME ClassifyTrack(bool raw, const unsigned char* data, int len, Track::TRACK_BIT_LEN bits, unsigned char status) {
+		if(data == NULL || len <= 0)
+			return (status == cmd::OK) ? READ_EMPTY : DeviceOutcome(status);
+		if(!raw)
+			return (status == cmd::OK) ? READ_OK : DeviceOutcome(status);
+		TrackDecode decoded;
+		DECODE_STATUS result = DecodeRawTrack(data, len, bits, decoded);
+		// Leading zeros and nothing else, the device had nothing to return either
+		if(result == DECODE_EMPTY && status != cmd::OK) return DeviceOutcome(status);
+		return (READ_OUTCOME)result;
+	}
+
+	// Same as ClassifyTrack, from the decode the card caches
+	static READ_OUTCOME ClassifyDecoded(const TrackDecode* decoded, unsigned char status) {
+		if(decoded == NULL || decoded->Status == DECODE_EMPTY)
+			return (status == cmd::OK) ? READ_EMPTY : DeviceOutcome(status);
+		return (status == cmd::OK) ? (READ_OUTCOME)decoded->Status : DeviceOutcome(status);
+	}
+
+/*	==== START QualityTracker CLASS ====	*/
+
+	QualityTracker::QualityTracker(std::chrono::milliseconds ReswipeWindow) {
+		this->ReswipeWindow = ReswipeWindow;
+		this->Stopping = false;
+		this->Generation = 0;
+		this->Reset();
+	}
+
+	QualityTracker::~QualityTracker(void) {
+		{
+			std::lock_guard<std::mutex> guard(this->Lock);
+			this->Stopping = true;
+		}
+		this->Wakeup.notify_all();
+		if(this->Worker.joinable()) this->Worker.join();
+	}
+
+	void QualityTracker::Push(History& h, bool ok) {
+		h.Bits = (h.Bits << 1) | (ok ? 1 : 0);
+		if(h.Count < QUALITY_WINDOW) h.Count++;
+	}
+
+	double QualityTracker::Rate(const History& h) {
+		if(h.Count == 0) return 0;
+		uint64_t mask = (h.Count == 64) ? ~(uint64_t)0 : (((uint64_t)1 << h.Count) - 1);
+		return (double)__builtin_popcountll(h.Bits & mask) / h.Count;
+	}
+
+	void QualityTracker::Record(const Magstripe& Card, unsigned char Status) {
+		Swipe swipe = { Card, Status, std::chrono::steady_clock::now(), READ_EMPTY, { READ_EMPTY, READ_EMPTY, READ_EMPTY } };
+		std::lock_guard<std::mutex> guard(this->Lock);
+		this->Pending.push_back(swipe);
+		// Most readers never look at their quality, they don't get a thread until they read a card
+		if(!this->Worker.joinable()) this->Worker = std::thread(&QualityTracker::Loop, this);
+		this->Wakeup.notify_one();
+	}
+
+	void QualityTracker::Loop(void) {
+		std::vector<Swipe> batch;
+		std::unique_lock<std::mutex> guard(this->Lock);
+		while(true) {
+			this->Wakeup.wait(guard, [this] { return this->Stopping || !this->Pending.empty(); });
+			if(this->Stopping) break;
+			batch.swap(this->Pending);
+			uint64_t generation = this->Generation;
+
+			// Raw tracks are decoded here, Record and Snapshot don't wait on it
+			guard.unlock();
+			for(Swipe& swipe : batch) Classify(swipe);
+			guard.lock();
+
+			if(generation == this->Generation) {
+				for(const Swipe& swipe : batch) this->Count(swipe);
+			}
+			batch.clear();
+		}
+	}
+
+	void QualityTracker::Classify(Swipe& swipe) {
+		const TrackDecode* decoded[3] = {
+			swipe.Card.GetDecodedTrack1(), swipe.Card.GetDecodedTrack2(), swipe.Card.GetDecodedTrack3()
+		};
+		for(int t = 0; t < 3; t++) swipe.Tracks[t] = ClassifyDecoded(decoded[t], swipe.Status);
+
+		// The device error first, then the first track that failed
+		swipe.Outcome = READ_EMPTY;
+		if(swipe.Status != cmd::OK) {
+			swipe.Outcome = DeviceOutcome(swipe.Status);
+		} else {
+			for(int t = 0; t < 3; t++) {
+				if(swipe.Tracks[t] == READ_OK) {
+					swipe.Outcome = READ_OK;
+				} else if(swipe.Tracks[t] != READ_EMPTY) {
+					swipe.Outcome = swipe.Tracks[t];
+					break;
+				}
+			}
+		}
+	}
+
+	void QualityTracker::Count(const Swipe& swipe) {
+		// A blank swipe is a failure too, the card was most likely swiped the wrong way round
+		bool ok = (swipe.Outcome == READ_OK);
+
+		bool retry = this->LastFailed && swipe.At - this->LastSwipe < this->ReswipeWindow;
+		this->Counts.Swipes++;
+		this->Counts.Outcomes[swipe.Outcome]++;
+		if(retry) this->Counts.Retries++;
+		else Push(this->Swipes, ok);
+		for(int t = 0; t < 3; t++) {
+			this->Counts.Tracks[t].Outcomes[swipe.Tracks[t]]++;
+			if(!retry && swipe.Tracks[t] != READ_EMPTY) Push(this->Tracks[t], swipe.Tracks[t] == READ_OK);
+		}
+		this->LastFailed = !ok;
+		this->LastSwipe = swipe.At;
+	}
+
+	ReadQuality QualityTracker::Snapshot(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		ReadQuality snap = this->Counts;
+		snap.Window = this->Swipes.Count;
+		snap.FirstSwipeRate = Rate(this->Swipes);
+		for(int t = 0; t < 3; t++) {
+			snap.Tracks[t].Window = this->Tracks[t].Count;
+			snap.Tracks[t].FirstSwipeRate = Rate(this->Tracks[t]);
+		}
+		return snap;
+	}
+
+	void QualityTracker::Reset(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		memset(&this->Counts, 0, sizeof(this->Counts));
+		memset(&this->Swipes, 0, sizeof(this->Swipes));
+		memset(this->Tracks, 0, sizeof(this->Tracks));
+		this->Pending.clear();
+		this->Generation++;
+		this->LastFailed = false;
+		this->LastSwipe = std::chrono::steady_clock::time_point();
+	}
+}
@@ -0,0 +1,97 @@
+/*
+	lib605_stream.cpp - Continuous swipe reading on a background thread
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_stream.hpp"
+
+namespace lib605 {
+
+	SwipeStream::SwipeStream(MSR& Device, Magstripe::CARD_DATA_FORMAT Format, size_t Depth) : Device(Device) {
+		this->Format = Format;
+		this->Depth = (Depth > 0) ? Depth : 1;
+		this->Sequence = 0;
+		this->Running = false;
+		this->Stopping = false;
+		this->Failed = false;
+	}
+
+	SwipeStream::~SwipeStream(void) {
+		this->Stop();
+	}
+
+	bool SwipeStream::Start(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		if(this->Running) return false;
+		// The previous run ended on its own
+		if(this->Worker.joinable()) this->Worker.join();
+		this->Stopper.Reset();
+		this->Running = true;
+		this->Stopping = false;
+		this->Failed = false;
+		this->Worker = std::thread(&SwipeStream::Loop, this);
+		return true;
+	}
+
+	void SwipeStream::Stop(void) {
+		{
+			std::lock_guard<std::mutex> guard(this->Lock);
+			this->Stopping = true;
+		}
+		this->Stopper.Cancel();
+		this->Writable.notify_all();
+		if(this->Worker.joinable()) this->Worker.join();
+	}
+
+	void SwipeStream::Loop(void) {
+		bool ok = this->Device.ReadCards(this->Format, [this](const Magstripe& Card, unsigned char Status) {
+			return this->Push(Card, Status);
+		}, &this->Stopper);
+		std::lock_guard<std::mutex> guard(this->Lock);
+		this->Failed = !ok;
+		this->Running = false;
+		this->Readable.notify_all();
+	}
+
+	bool SwipeStream::Push(const Magstripe& Card, unsigned char Status) {
+		// Stamped before waiting on the queue, the swipe happened now
+		auto now = std::chrono::system_clock::now();
+		std::unique_lock<std::mutex> guard(this->Lock);
+		while(this->Queue.size() >= this->Depth && !this->Stopping) this->Writable.wait(guard);
+		if(this->Stopping) return false;
+		this->Queue.push_back(SwipeRecord());
+		SwipeRecord& record = this->Queue.back();
+		record.Sequence = ++this->Sequence;
+		record.Timestamp = now;
+		record.Status = Status;
+		record.Card = Card;
+		this->Readable.notify_one();
+		return true;
+	}
+
+	bool SwipeStream::Next(SwipeRecord& Record, std::chrono::milliseconds Timeout) {
+		std::unique_lock<std::mutex> guard(this->Lock);
+		auto ready = [this] { return !this->Queue.empty() || !this->Running; };
+		if(Timeout.count() > 0) {
+			if(!this->Readable.wait_for(guard, Timeout, ready)) return false;
+		} else {
+			this->Readable.wait(guard, ready);
+		}
+		if(this->Queue.empty()) return false;
+		Record = this->Queue.front();
+		this->Queue.pop_front();
+		this->Writable.notify_one();
+		return true;
+	}
+
+	bool SwipeStream::HasFailed(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		return this->Failed;
+	}
+}
@@ -0,0 +1,126 @@
+/*
+	lib605_trace.cpp - Binary TX/RX trace ring implementation
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_trace.hpp"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <chrono>
+
+namespace lib605 {
+
+	static_assert(TRACE_RING_SIZE > sizeof(TraceRing::RecordHeader), "TRACE_RING_SIZE too small to hold a record");
+
+	// Current steady_clock time in nanoseconds
+	static uint64_t TraceNow(void) noexcept {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	TraceRing::TraceRing(void) noexcept {
+		this->Clear();
+	}
+
+	void TraceRing::Put(size_t offset, const void* data, size_t len) noexcept {
+		size_t first = TRACE_RING_SIZE - offset;
+		if(first > len) first = len;
+		memcpy(&this->Buffer[offset], data, first);
+		memcpy(this->Buffer, (const unsigned char*)data + first, len - first);
+	}
+
+	void TraceRing::Get(size_t offset, void* data, size_t len) const noexcept {
+		size_t first = TRACE_RING_SIZE - offset;
+		if(first > len) first = len;
+		memcpy(data, &this->Buffer[offset], first);
+		memcpy((unsigned char*)data + first, this->Buffer, len - first);
+	}
+
+	void TraceRing::Record(TraceRing::DIRECTION dir, const void* data, size_t len) noexcept {
+		const size_t max_len = TRACE_RING_SIZE - sizeof(RecordHeader);
+		if(data == NULL || len == 0) return;
+		// Keep the tail of oversize chunks, that is what ended up on the wire last
+		if(len > max_len) {
+			data = (const unsigned char*)data + (len - max_len);
+			len = max_len;
+		}
+		if(len > UINT16_MAX) {
+			data = (const unsigned char*)data + (len - UINT16_MAX);
+			len = UINT16_MAX;
+		}
+
+		size_t need = sizeof(RecordHeader) + len;
+		// Drop the oldest records until this one fits
+		while(TRACE_RING_SIZE - this->Used < need) {
+			RecordHeader old;
+			this->Get(this->Head, &old, sizeof(old));
+			size_t old_size = sizeof(RecordHeader) + old.Length;
+			this->Head = (this->Head + old_size) % TRACE_RING_SIZE;
+			this->Used -= old_size;
+			this->Records--;
+		}
+
+		RecordHeader hdr;
+		hdr.Timestamp = TraceNow();
+		hdr.Length = (uint16_t)len;
+		hdr.Direction = (uint8_t)dir;
+		hdr.Reserved = 0;
+		hdr.Sequence = this->Sequence++;
+
+		size_t tail = (this->Head + this->Used) % TRACE_RING_SIZE;
+		this->Put(tail, &hdr, sizeof(hdr));
+		this->Put((tail + sizeof(hdr)) % TRACE_RING_SIZE, data, len);
+		this->Used += need;
+		this->Records++;
+	}
+
+	void TraceRing::Clear(void) noexcept {
+		this->Head = 0;
+		this->Used = 0;
+		this->Records = 0;
+		this->Sequence = 0;
+	}
+
+	uint32_t TraceRing::GetRecordCount(void) const noexcept {
+		return this->Records;
+	}
+
+	bool TraceRing::Dump(const std::string& Path) const {
+		FileHeader fh;
+		memset(&fh, 0, sizeof(fh));
+		memcpy(fh.Magic, "L605TRC", 8);
+		fh.Version = 1;
+		fh.Records = this->Records;
+		fh.Timestamp = TraceNow();
+
+		int fd = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if(fd < 0) return false;
+
+		// The ring already holds records in file layout, at most two runs of them
+		struct iovec iov[3];
+		size_t first = TRACE_RING_SIZE - this->Head;
+		if(first > this->Used) first = this->Used;
+		iov[0].iov_base = (void*)&fh;
+		iov[0].iov_len = sizeof(fh);
+		iov[1].iov_base = (void*)&this->Buffer[this->Head];
+		iov[1].iov_len = first;
+		iov[2].iov_base = (void*)this->Buffer;
+		iov[2].iov_len = this->Used - first;
+
+		ssize_t total = (ssize_t)(sizeof(fh) + this->Used);
+		ssize_t written = writev(fd, iov, 3);
+		bool ok = (written == total);
+		if(close(fd) != 0) ok = false;
+		return ok;
+	}
+}
@@ -0,0 +1,298 @@
+/*
+	lib605_uring.cpp - io_uring backend for device exchanges
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+#include "./include/lib605_uring.hpp"
+
+#include <errno.h>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if defined(DEBUG)
+#include <iostream>
+#endif
+
+namespace lib605 {
+
+	// One chain of entries: the write, then the read. Every entry posts a
+	// completion, a failed write cancels the read and the read still posts
+	// one, so the last entry always completes last. Only that one wakes the
+	// waiter, a round trip costs a single wakeup
+	struct UringEngine::Op {
+		int Res[2];
+		int Last;
+		bool Done;
+		std::condition_variable Wake;
+	};
+
+	static int SysSetup(unsigned entries, struct io_uring_params* params) {
+		return (int)syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	static int SysEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+		return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+	}
+
+	UringEngine::UringEngine(void) {
+		this->RingFd = -1;
+		this->SqMap = MAP_FAILED;
+		this->CqMap = MAP_FAILED;
+		this->SqeMap = MAP_FAILED;
+		this->SqMapSize = 0;
+		this->CqMapSize = 0;
+		this->SqeMapSize = 0;
+		this->Staged = 0;
+		this->Polling = false;
+		memset(&this->Stats, 0, sizeof(this->Stats));
+	}
+
+	UringEngine::~UringEngine(void) {
+		if(this->SqeMap != MAP_FAILED) munmap(this->SqeMap, this->SqeMapSize);
+		if(this->CqMap != MAP_FAILED && this->CqMap != this->SqMap) munmap(this->CqMap, this->CqMapSize);
+		if(this->SqMap != MAP_FAILED) munmap(this->SqMap, this->SqMapSize);
+		if(this->RingFd >= 0) close(this->RingFd);
+	}
+
+	bool UringEngine::Setup(void) {
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		// ENOSYS on old kernels, EPERM where io_uring is disabled
+		if((this->RingFd = SysSetup(URING_ENTRIES, &params)) < 0) return false;
+		// Needs 5.17 for completions to be skipped
+		if((params.features & IORING_FEAT_CQE_SKIP) == 0) return false;
+
+		this->SqMapSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		this->CqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if(single) this->SqMapSize = this->CqMapSize = std::max(this->SqMapSize, this->CqMapSize);
+
+		this->SqMap = mmap(NULL, this->SqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->RingFd, IORING_OFF_SQ_RING);
+		if(this->SqMap == MAP_FAILED) return false;
+		if(single) {
+			this->CqMap = this->SqMap;
+		} else {
+			this->CqMap = mmap(NULL, this->CqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->RingFd, IORING_OFF_CQ_RING);
+			if(this->CqMap == MAP_FAILED) return false;
+		}
+		this->SqeMapSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		this->SqeMap = mmap(NULL, this->SqeMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->RingFd, IORING_OFF_SQES);
+		if(this->SqeMap == MAP_FAILED) return false;
+
+		char* sq = (char*)this->SqMap;
+		char* cq = (char*)this->CqMap;
+		this->SqHead = (uint32_t*)(sq + params.sq_off.head);
+		this->SqTail = (uint32_t*)(sq + params.sq_off.tail);
+		this->SqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+		this->SqEntries = *(uint32_t*)(sq + params.sq_off.ring_entries);
+		this->CqHead = (uint32_t*)(cq + params.cq_off.head);
+		this->CqTail = (uint32_t*)(cq + params.cq_off.tail);
+		this->CqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+		this->Sqes = this->SqeMap;
+		this->Cqes = cq + params.cq_off.cqes;
+		// Slot i always holds entry i
+		uint32_t* array = (uint32_t*)(sq + params.sq_off.array);
+		for(uint32_t i = 0; i < this->SqEntries; i++) array[i] = i;
+		return true;
+	}
+
+	std::shared_ptr<UringEngine> UringEngine::Shared(void) {
+		static std::mutex lock;
+		static std::weak_ptr<UringEngine> shared;
+		static bool unavailable = false;
+		std::lock_guard<std::mutex> guard(lock);
+		std::shared_ptr<UringEngine> engine = shared.lock();
+		if(engine || unavailable) return engine;
+		engine.reset(new UringEngine());
+		if(!engine->Setup()) {
+#if defined(DEBUG)
+			std::cout << "[*] io_uring unavailable, using the classic backend" << std::endl;
+#endif
+			// Don't retry the setup for every device
+			unavailable = true;
+			return std::shared_ptr<UringEngine>();
+		}
+		shared = engine;
+		return engine;
+	}
+
+	int UringEngine::Submit(unsigned min_complete) {
+		// Takes entries queued by other threads as well, the kernel stops at the tail it sees.
+		// A count read here may be stale once the lock is dropped and could end inside a
+		// chain published since, asking for the whole ring never does
+		return SysEnter(this->RingFd, this->SqEntries, min_complete, (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0);
+	}
+
+	bool UringEngine::Reserve(unsigned count) {
+		uint32_t tail = __atomic_load_n(this->SqTail, __ATOMIC_RELAXED);
+		if(tail - __atomic_load_n(this->SqHead, __ATOMIC_ACQUIRE) + count <= this->SqEntries) return true;
+		// Entries left behind by a failed enter, push them out first
+		this->Stats.Syscalls++;
+		if(this->Submit(0) < 0) return false;
+		return tail - __atomic_load_n(this->SqHead, __ATOMIC_ACQUIRE) + count <= this->SqEntries;
+	}
+
+	void UringEngine::Queue(uint8_t opcode, int fd, uint64_t addr, uint32_t len, uint8_t flags, Op* op, int index) {
+		uint32_t tail = __atomic_load_n(this->SqTail, __ATOMIC_RELAXED) + this->Staged;
+		struct io_uring_sqe* sqe = (struct io_uring_sqe*)this->Sqes + (tail & this->SqMask);
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->addr = addr;
+		sqe->len = len;
+		// Serial ports have no file position, -1 uses the current one
+		if(opcode != IORING_OP_LINK_TIMEOUT) sqe->off = (uint64_t)-1;
+		sqe->flags = flags;
+		// Op is int aligned, the low bits say which entry completed, zero is not looked at
+		sqe->user_data = (op != NULL) ? ((uint64_t)(uintptr_t)op | (uint64_t)index) : 0;
+		this->Staged++;
+		if(op != NULL) op->Last = index;
+		this->Stats.Requests++;
+	}
+
+	void UringEngine::Publish(void) {
+		__atomic_store_n(this->SqTail, __atomic_load_n(this->SqTail, __ATOMIC_RELAXED) + this->Staged, __ATOMIC_RELEASE);
+		this->Staged = 0;
+	}
+
+	void UringEngine::Reap(void) {
+		uint32_t head = __atomic_load_n(this->CqHead, __ATOMIC_RELAXED);
+		uint32_t tail = __atomic_load_n(this->CqTail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			const struct io_uring_cqe* cqe = (const struct io_uring_cqe*)this->Cqes + (head & this->CqMask);
+			if(cqe->user_data == 0) continue;
+			Op* op = (Op*)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+			int index = (int)(cqe->user_data & 3);
+			op->Res[index] = cqe->res;
+			// Op lives until the last entry is in
+			if(index == op->Last) {
+				op->Done = true;
+				op->Wake.notify_one();
+			}
+		}
+		__atomic_store_n(this->CqHead, head, __ATOMIC_RELEASE);
+	}
+
+	void UringEngine::Wait(std::unique_lock<std::mutex>& guard, Op& op) {
+		while(!op.Done && this->Polling) {
+			// The thread in the kernel picks up our completions, ours just need sending
+			if(__atomic_load_n(this->SqTail, __ATOMIC_RELAXED) != __atomic_load_n(this->SqHead, __ATOMIC_ACQUIRE)) {
+				this->Stats.Syscalls++;
+				this->Submit(0);
+			}
+			this->Sleepers.push_back(&op);
+			op.Wake.wait(guard);
+			this->Sleepers.erase(std::find(this->Sleepers.begin(), this->Sleepers.end(), &op));
+		}
+		if(op.Done) return;
+
+		this->Polling = true;
+		while(!op.Done) {
+			this->Stats.Syscalls++;
+			guard.unlock();
+			int ret = this->Submit(1);
+			guard.lock();
+			if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+#if defined(DEBUG)
+				std::cout << "[*] Error: io_uring_enter failed, " << strerror(errno) << std::endl;
+#endif
+			}
+			this->Reap();
+		}
+		this->Polling = false;
+		// Hand polling over to an exchange still in flight
+		for(Op* sleeper : this->Sleepers) {
+			if(!sleeper->Done) {
+				sleeper->Wake.notify_one();
+				break;
+			}
+		}
+	}
+
+	UringTransfer UringEngine::Exchange(int fd, const unsigned char* frame, int frame_len, unsigned char* reply, int reply_len, std::chrono::milliseconds Timeout) {
+		UringTransfer transfer;
+		transfer.Written = 0;
+		transfer.Received = 0;
+		transfer.Error = 0;
+		bool bounded = Timeout.count() > 0;
+		auto deadline = std::chrono::steady_clock::now() + Timeout;
+		bool writing = (frame_len > 0);
+
+		std::unique_lock<std::mutex> guard(this->Lock);
+		this->Stats.Exchanges++;
+		while(writing || transfer.Received < reply_len) {
+			struct __kernel_timespec ts;
+			bool reading = (transfer.Received < reply_len);
+			bool timed = reading && bounded;
+			if(timed) {
+				auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+				if(left.count() <= 0) {
+					transfer.Error = ETIME;
+					break;
+				}
+				ts.tv_sec = left.count() / 1000000000;
+				ts.tv_nsec = left.count() % 1000000000;
+			}
+
+			Op op;
+			op.Res[0] = op.Res[1] = 0;
+			op.Last = 0;
+			op.Done = false;
+			// A chain is queued whole, a dangling link would take in the next thread's entry
+			if(!this->Reserve((writing ? 1 : 0) + (reading ? 1 : 0) + (timed ? 1 : 0))) {
+				transfer.Error = writing ? EAGAIN : EBUSY;
+				break;
+			}
+			if(writing) this->Queue(IORING_OP_WRITE, fd, (uint64_t)(uintptr_t)frame, frame_len, reading ? IOSQE_IO_LINK : 0, &op, 0);
+			if(reading) this->Queue(IORING_OP_READ, fd, (uint64_t)(uintptr_t)(reply + transfer.Received), reply_len - transfer.Received, timed ? IOSQE_IO_LINK : 0, &op, 1);
+			// The timespec is copied on submission, the read tells whether the timeout fired
+			if(timed) this->Queue(IORING_OP_LINK_TIMEOUT, -1, (uint64_t)(uintptr_t)&ts, 1, IOSQE_CQE_SKIP_SUCCESS, NULL, 0);
+			this->Publish();
+			this->Wait(guard, op);
+
+			if(writing) {
+				writing = false;
+				if(op.Res[0] < 0) {
+					transfer.Error = -op.Res[0];
+					break;
+				}
+				// Serial writes of a frame this short are not split
+				transfer.Written = op.Res[0];
+				if(transfer.Written != frame_len) {
+					transfer.Error = EIO;
+					break;
+				}
+			}
+			if(!reading) break;
+			if(op.Res[1] > 0) {
+				transfer.Received += op.Res[1];
+			} else if(op.Res[1] == 0) {
+				// End of file, the device hung up
+				transfer.Error = EPIPE;
+				break;
+			} else if(timed && op.Res[1] == -ECANCELED) {
+				transfer.Error = ETIME;
+				break;
+			} else if(op.Res[1] != -EINTR && op.Res[1] != -EAGAIN) {
+				transfer.Error = -op.Res[1];
+				break;
+			}
+		}
+		return transfer;
+	}
+
+	UringStats UringEngine::GetStats(void) {
+		std::lock_guard<std::mutex> guard(this->Lock);
+		return this->Stats;
+	}
+}